@@ -24,15 +24,17 @@ enum linepos
     PAGE_START_LINE
 };
 
-#include "mGeneral.h"
 #include "m_microsd.h"
 #include "pageCache.h"
+#include "perf.h"
+#include "trace.h"
 #include <stdbool.h>
 #include <stdio.h>
 
 #define INVALID ((uint32_t)0xffffffff)
 
-uint32_t FILE_SIZE;
+// shown for as long as a save that failed partway holds up editing
+#define SAVE_PENDING_ERROR "Save failed partway! Edits are on hold until it's recovered"
 
 uint8_t cursor_row = 0;
 uint8_t cursor_col = 0;
@@ -45,23 +47,79 @@ enum EditState
 } editState = NAVIGATE;
 
 
-char prevPrintedChar = 0;
-inline void printChar (const char c)
+// The page area is drawn by diffing against a copy of what the terminal is
+// showing (screen_cells), so a keystroke only sends the cells it changed
+// rather than the whole page.  Each cell holds the printable character shown
+// there, or one of the codes below for the colored blanks we use for the
+// rest.  Getting from one changed cell to the next picks whichever is fewest
+// bytes: moving right or left, jumping with an absolute position, or just
+// printing the unchanged cells in between again.  A row that slid right or
+// left by one (typing or backspacing in front of it) is shifted in the
+// terminal with insert/delete character instead of being reprinted.
+enum CellCode
 {
-    // putchar printable characters and use background colors for the rest
+    CELL_UNKNOWN = 0,   // the terminal could be showing anything
+    CELL_LINE_BREAK,    // blue
+    CELL_TAB,           // yellow
+    CELL_OTHER          // red, any other unprintable
+};
+
+static char screen_cells[PAGE_BYTES];
+
+// where the terminal cursor is within the page, -1 when we don't know
+static int8_t screen_row = -1;
+static int8_t screen_col = -1;
+
+static char page_cell (uint16_t i)
+{
+    if (!currentPage || i >= currentPage->num_bytes)
+        return ' ';
+    
+    const char c = currentPage->data[i];
+    const char prev = (i > 0) ? currentPage->data[i - 1] : 0;
+    
     if (c >= 32 && c <= 126)
-        putchar (c);
-    else if ( (c == '\r' && prevPrintedChar != '\n') ||
-              (c == '\n' && prevPrintedChar != '\r') )
+        return c;
+    else if ( (c == '\r' && prev != '\n') ||
+              (c == '\n' && prev != '\r') )
     {  // make sure we don't double-print a CR-LF
-        printf ("\033[44m \033[0m");
+        return CELL_LINE_BREAK;
     }
     else if (c == '\t')
-        printf ("\033[43m \033[0m");
+        return CELL_TAB;
     else
-        printf ("\033[41m \033[0m");
-    
-    prevPrintedChar = c;
+        return CELL_OTHER;
+}
+
+// bytes it takes to draw a cell
+static uint8_t cell_cost (char cell)
+{
+    return (cell >= 32) ? 1 : 10;
+}
+
+static void draw_cell (char cell)
+{
+    // putchar printable characters and use background colors for the rest
+    switch (cell)
+    {
+        case CELL_LINE_BREAK:
+            printf ("\033[44m \033[0m");
+            break;
+        case CELL_TAB:
+            printf ("\033[43m \033[0m");
+            break;
+        case CELL_OTHER:
+            printf ("\033[41m \033[0m");
+            break;
+        default:
+            putchar (cell);
+            break;
+    }
+}
+
+static uint8_t digits (uint16_t n)
+{
+    return (n >= 100) ? 3 : (n >= 10) ? 2 : 1;
 }
 
 inline void position_cursor (uint8_t line_index, uint8_t column)
@@ -69,29 +127,170 @@ inline void position_cursor (uint8_t line_index, uint8_t column)
     printf ("\033[%u;%uH", line_index, column);
 }
 
-void print_current_page (void)
+// move the terminal cursor to a cell of the page by the cheapest route
+static void move_to_cell (uint8_t row, uint8_t col)
 {
-    if (!currentPage)
+    if (row == screen_row && col == screen_col)
         return;
     
-    position_cursor (PAGE_START_LINE, 0);
+    const uint8_t jump_cost = 4 + digits (PAGE_START_LINE + row) + digits (col + 1);
     
-    int i = 0;
-    for (int y = 0; y < LINES_PER_PAGE; y++)
+    if (row == screen_row && col > screen_col)
     {
-        for (int x = 0; x < COLS_PER_LINE; x++)
+        const uint8_t gap = col - screen_col;
+        const uint8_t forward_cost = 3 + digits (gap);
+        
+        // the cells in between are already right, so reprinting is harmless
+        uint16_t reprint_cost = 0;
+        for (uint8_t x = screen_col; x < col; x++)
+            reprint_cost += cell_cost (screen_cells[row * COLS_PER_LINE + x]);
+        
+        if (reprint_cost <= forward_cost && reprint_cost <= jump_cost)
         {
-            printChar (currentPage->data[i]);
-            i++;
-            
-            if (i >= currentPage->num_bytes)
-                return;
+            for (uint8_t x = screen_col; x < col; x++)
+                draw_cell (screen_cells[row * COLS_PER_LINE + x]);
+            screen_col = col;
+            return;
+        }
+        
+        if (forward_cost < jump_cost)
+        {
+            printf ("\033[%uC", gap);
+            screen_col = col;
+            return;
+        }
+    }
+    else if (row == screen_row && screen_col >= 0)
+    {
+        const uint8_t gap = screen_col - col;
+        if (3 + digits (gap) < jump_cost)
+        {
+            printf ("\033[%uD", gap);
+            screen_col = col;
+            return;
         }
+    }
+    
+    position_cursor (PAGE_START_LINE + row, col + 1);
+    screen_row = row;
+    screen_col = col;
+}
+
+// bytes needed to redraw the cells of a row from col on that don't match
+// target, if the row first shifted by shift cells (1 = right, -1 = left)
+static uint16_t row_repair_cost (const char *cells, const char *target, uint8_t col, int8_t shift)
+{
+    uint16_t cost = 0;
+    for (uint8_t x = col; x < COLS_PER_LINE; x++)
+    {
+        // the cell opened up at col, or slid in from beyond the page, is blank
+        const int16_t from = x - shift;
+        const char shown = (from >= col && from < COLS_PER_LINE) ? cells[from] : ' ';
         
-        printf ("\033[%dD", COLS_PER_LINE);  // move back to the beginning of the column
-        printf ("\033[B");  // move down one line
+        if (shown != target[x])
+            cost += cell_cost (target[x]);
+    }
+    return cost;
+}
+
+// if the row now looks like the terminal's copy slid over by one from the
+// first cell that differs, slide the terminal's copy too
+static void shift_row (uint8_t row, const char *target)
+{
+    char *cells = &screen_cells[row * COLS_PER_LINE];
+    
+    uint8_t col = 0;
+    while (col < COLS_PER_LINE && cells[col] == target[col])
+        col++;
+    if (col >= COLS_PER_LINE - 1)
+        return;
+    
+    for (uint8_t x = col; x < COLS_PER_LINE; x++)
+    {
+        if (cells[x] == CELL_UNKNOWN)
+            return;
     }
+    
+    // insert or delete character costs 3 bytes, on top of getting there
+    // nothing may be pushed off the end of the row, since a terminal wider
+    // than the page would show it, so a full row loses its last cell first
+    const bool full = (cells[COLS_PER_LINE - 1] != ' ');
+    const uint16_t plain = row_repair_cost (cells, target, col, 0);
+    const uint16_t right = row_repair_cost (cells, target, col, 1) + 3 + (full ? 13 : 0);  // roughly, for the trip to the end and back
+    const uint16_t left = row_repair_cost (cells, target, col, -1) + 3;
+    
+    if (right < plain && right <= left)
+    {
+        if (full)
+        {
+            move_to_cell (row, COLS_PER_LINE - 1);
+            printf ("\033[P");
+        }
+        move_to_cell (row, col);
+        printf ("\033[@");
+        for (uint8_t x = COLS_PER_LINE - 1; x > col; x--)
+            cells[x] = cells[x - 1];
+        cells[col] = ' ';
+    }
+    else if (left < plain)
+    {
+        move_to_cell (row, col);
+        printf ("\033[P");
+        for (uint8_t x = col; x < COLS_PER_LINE - 1; x++)
+            cells[x] = cells[x + 1];
+        cells[COLS_PER_LINE - 1] = ' ';
+    }
+}
+
+// bring the page area up to date, sending only what changed
+static void print_page_cells (void)
+{
+    screen_row = screen_col = -1;  // the editor moves the cursor around too
+    
+    char target[COLS_PER_LINE];
+    for (uint8_t y = 0; y < LINES_PER_PAGE; y++)
+    {
+        for (uint8_t x = 0; x < COLS_PER_LINE; x++)
+            target[x] = page_cell (y * COLS_PER_LINE + x);
+        
+        shift_row (y, target);
         
+        for (uint8_t x = 0; x < COLS_PER_LINE; x++)
+        {
+            char *shown = &screen_cells[y * COLS_PER_LINE + x];
+            if (*shown == target[x])
+                continue;
+            
+            move_to_cell (y, x);
+            draw_cell (target[x]);
+            *shown = target[x];
+            
+            screen_col++;
+            if (screen_col >= COLS_PER_LINE)
+                screen_row = screen_col = -1;  // the terminal may have wrapped
+        }
+    }
+}
+
+// the terminal was cleared, so the page area is blank
+static void blank_page_cells (void)
+{
+    for (uint16_t i = 0; i < PAGE_BYTES; i++)
+        screen_cells[i] = ' ';
+}
+
+void print_current_page (void)
+{
+    const uint32_t start = PERF_START();
+    trace (TRACE_REDRAW_START, 0);
+    
+    printf ("\033[s");  // save the cursor position
+    print_page_cells();
+    printf ("\033[u");  // restore the cursor position
+    mUSBFlush();
+    
+    trace (TRACE_REDRAW_END, 0);
+    perf_record (PERF_PRINT_PAGE, start);
 }
 
 void draw_mode_line (void)
@@ -102,10 +301,10 @@ void draw_mode_line (void)
     {
         case NAVIGATE:
             // "WASD" is green
-            printf ("NAV mode: use \033[32mWASD\033[0m to move around the document, CTRL-P to insert");
+            printf ("NAV mode: use \033[32mWASD\033[0m to move around the document, G to go to a line, CTRL-P to insert");
             break;
         case INSERT:
-            printf ("INSERT mode: type to insert characters, CTRL-P to navigate");
+            printf ("INSERT mode: type to insert, CTRL-Z/CTRL-Y to undo/redo, CTRL-P to navigate");
             break;
     }
 }
@@ -127,7 +326,64 @@ void draw_info_line (void)
 void draw_status_line (void)
 {
     position_cursor (STATUS_LINE, 1);
-    printf ("Cursor position: %d (row %d, col %d)                    \r\n", cursor_page_pos, cursor_row, cursor_col);
+    
+    // the line index fills in while the editor idles, so the total (and
+    // further into the file, the line itself) may not be known yet
+    uint32_t line;
+    if (!current_line (cursor_page_pos, &line))
+        printf ("Line ?   ");
+    else if (line_index_progress() < 100)
+        printf ("Line %lu of ? (indexing %u%%)   ", (unsigned long)line + 1, (unsigned)line_index_progress());
+    else
+        printf ("Line %lu of %lu   ", (unsigned long)line + 1, (unsigned long)line_count());
+    
+    printf ("Cursor position: %d (row %d, col %d)   Page cache: %lu hits, %lu misses\033[K\r\n",
+            cursor_page_pos, cursor_row, cursor_col,
+            (unsigned long)prefetch_stats.hits, (unsigned long)prefetch_stats.misses);
+}
+
+// ask for a number on the error line, 0 if nothing was entered
+uint32_t prompt_number (const char *prompt)
+{
+    printf ("\033[s");  // save the cursor position
+    position_cursor (ERROR_LINE, 1);
+    printf ("\033[K%s", prompt);
+    
+    uint32_t number = 0;
+    uint8_t digits_typed = 0;
+    for (;;)
+    {
+        const int intch = getchar();
+        if (intch < 0)
+            continue;
+        
+        const char c = (char)intch;
+        
+        if (c == '\r' || c == '\n')
+            break;
+        else if (c == 27 || c == 'C' - 64)
+        {  // escape or ctrl-c cancels
+            number = 0;
+            break;
+        }
+        else if ((c == 127 || c == 8) && digits_typed > 0)
+        {
+            number /= 10;
+            digits_typed--;
+            printf ("\033[D\033[K");
+        }
+        else if (c >= '0' && c <= '9' && digits_typed < 9)
+        {
+            number = number * 10 + (c - '0');
+            digits_typed++;
+            putchar (c);
+        }
+    }
+    
+    position_cursor (ERROR_LINE, 1);
+    printf ("\033[K");
+    printf ("\033[u");  // restore the cursor position
+    return number;
 }
 
 void redraw_screen (const char *name)
@@ -137,6 +393,7 @@ void redraw_screen (const char *name)
     
     // clear the screen
     printf ("\033[2J");
+    blank_page_cells();
     
     // move the cursor to the top-left corner
     printf ("\033[H");
@@ -161,36 +418,47 @@ void redraw_screen (const char *name)
     draw_mode_line();
     draw_info_line();
     draw_status_line();
-    draw_error_line ("");
+    draw_error_line (save_recovery_pending() ? SAVE_PENDING_ERROR : "");
     
     position_cursor (SEPARATOR_LINE, 1);
     for (uint8_t q = 0; q < COLS_PER_LINE; q++)
         putchar ('_');
     
-    print_current_page();
+    print_page_cells();
     
     printf ("\033[0m");  // make sure the text color is the default
     
     // restore the cursor position
     printf ("\033[u");
+    
+    mUSBFlush();
 }
 
-void edit (uint8_t file_id, const char *name)
+// hand the file back to the caller, who closes it under the id this leaves
+// in *file_id (saving may have recreated it under a new one); a save that
+// fails can't be retried once that id is gone, see release_pages()
+static void leave_file (uint8_t *file_id, bool save)
 {
-    // get the size of the file
-    if (!m_sd_seek (file_id, FILE_END_POS) ||
-        !m_sd_get_seek_pos (file_id, &FILE_SIZE))
-    {
-        printf ("Error getting file size, can't edit (error %d)\r\n", m_sd_error_code);
-        return;
-    }
+    if (save && !save_pages())
+        printf ("The changes couldn't be saved (error %d)\r\n", m_sd_error_code);
     
+    *file_id = active_file_id();
+    release_pages();
+}
+
+void edit (uint8_t *file_id, const char *name)
+{
     editState = NAVIGATE;
     
+    const uint32_t start_round_trips = m_sd_round_trips;
+    const uint32_t start_early_polls = m_sd_early_polls;
+    const uint32_t start_seeks_elided = m_sd_seeks_elided;
+    
     // load the initial data from the document
-    if (!init_pages (file_id))
+    if (!init_pages (*file_id, name))
     {
         printf ("Error reading file (error %d)\r\n", m_sd_error_code);
+        leave_file (file_id, false);
         return;
     }
     
@@ -201,10 +469,54 @@ void edit (uint8_t file_id, const char *name)
     
     for (;;)
     {
+        // whatever the last key drew has to go out before we sit and wait
+        mUSBFlush();
+        
+        // use the time until a key arrives to read ahead, index lines,
+        // write out old undo records and save once typing has paused
+        uint8_t progress = line_index_progress();
+        while (!mUSBDataAvailable())
+        {
+            prefetch_pages();
+            index_lines();
+            spill_undo_history();
+            m_sd_poll();
+            mRunDeferred();
+            
+            const bool was_pending = save_recovery_pending();
+            if (!autosave_pages())
+            {
+                printf ("\033[s");  // save the cursor position
+                draw_error_line (save_recovery_pending() ? SAVE_PENDING_ERROR : "Autosave failed!");
+                printf ("\033[u");  // restore the cursor position
+                mUSBFlush();
+            }
+            else if (was_pending && !save_recovery_pending())
+            {  // recovered, so the error can go
+                printf ("\033[s");  // save the cursor position
+                position_cursor (ERROR_LINE, 1);
+                printf ("\033[K");
+                printf ("\033[u");  // restore the cursor position
+                mUSBFlush();
+            }
+            
+            if (line_index_progress() != progress)
+            {
+                progress = line_index_progress();
+                
+                printf ("\033[s");  // save the cursor position
+                draw_status_line();
+                printf ("\033[u");  // restore the cursor position
+                mUSBFlush();
+            }
+        }
+        
         const int intch = getchar();
         if (intch < 0)
             continue;
         
+        trace (TRACE_KEY, (uint8_t)intch);
+        
         const char c = (char)intch;
         
         if (c == 'C' - 64)  // ctrl-c
@@ -224,7 +536,21 @@ void edit (uint8_t file_id, const char *name)
             
             if (!save_pages())
                 printf ("But there was an error when saving!\r\n");
+            else if (last_save.bytes > 0)
+            {
+                const uint32_t ms = (last_save.ms > 0) ? last_save.ms : 1;
+                printf ("Saved %lu bytes in %lu ms (%lu bytes/sec, %lu round trips)\r\n",
+                        (unsigned long)last_save.bytes, (unsigned long)last_save.ms,
+                        (unsigned long)((uint64_t)last_save.bytes * 1000 / ms),
+                        (unsigned long)last_save.round_trips);
+            }
             
+            printf ("Card traffic: %lu commands, %lu seeks elided, %lu early polls\r\n",
+                    (unsigned long)(m_sd_round_trips - start_round_trips),
+                    (unsigned long)(m_sd_seeks_elided - start_seeks_elided),
+                    (unsigned long)(m_sd_early_polls - start_early_polls));
+            
+            leave_file (file_id, false);
             return;
         }
         else if (c == 'P' - 64) // ctrl-p
@@ -247,6 +573,39 @@ void edit (uint8_t file_id, const char *name)
             redraw_screen (name);
             continue;
         }
+        else if (c == 'Z' - 64 || c == 'Y' - 64) // ctrl-z, ctrl-y
+        {  // undo or redo the last run of edits, in either mode
+            const bool undo = (c == 'Z' - 64);
+            
+            int pos;
+            if (undo ? !can_undo() : !can_redo())
+            {
+                printf ("\033[s");  // save the cursor position
+                draw_error_line (undo ? "Nothing to undo" : "Nothing to redo");
+                printf ("\033[u");  // restore the cursor position
+            }
+            else if (undo ? !undo_edit (&pos) : !redo_edit (&pos))
+            {
+                printf ("\033[2J\033[HError changing the file during %s (error %d)\r\n",
+                        undo ? "undo" : "redo", m_sd_error_code);
+                leave_file (file_id, true);
+                return;
+            }
+            else
+            {
+                cursor_page_pos = pos;
+                cursor_row = cursor_page_pos / COLS_PER_LINE;
+                cursor_col = cursor_page_pos % COLS_PER_LINE;
+                position_cursor (PAGE_START_LINE + cursor_row, cursor_col + 1);
+                
+                print_current_page();
+                
+                printf ("\033[s");  // save the cursor position
+                draw_status_line();
+                printf ("\033[u");  // restore the cursor position
+            }
+            continue;
+        }
         
         if (editState == NAVIGATE)
         {
@@ -262,6 +621,7 @@ void edit (uint8_t file_id, const char *name)
                     if (!page_up())
                     {
                         printf ("\033[2J\033[HError reading file while scrolling up (error %d)\r\n", m_sd_error_code);
+                        leave_file (file_id, true);
                         return;
                     }
                     cursor_row = LINES_PER_PAGE - 1;
@@ -280,6 +640,7 @@ void edit (uint8_t file_id, const char *name)
                     if (!page_down())
                     {
                         printf ("\033[2J\033[HError reading file while scrolling down (error %d)\r\n", m_sd_error_code);
+                        leave_file (file_id, true);
                         return;
                     }
                     cursor_row = 0;
@@ -304,6 +665,7 @@ void edit (uint8_t file_id, const char *name)
                     if (!page_up())
                     {
                         printf ("\033[2J\033[HError reading file while scrolling up (error %d)\r\n", m_sd_error_code);
+                        leave_file (file_id, true);
                         return;
                     }
                     cursor_row = LINES_PER_PAGE - 1;
@@ -329,6 +691,7 @@ void edit (uint8_t file_id, const char *name)
                     if (!page_down())
                     {
                         printf ("\033[2J\033[HError reading file while scrolling down (error %d)\r\n", m_sd_error_code);
+                        leave_file (file_id, true);
                         return;
                     }
                     cursor_row = 0;
@@ -336,6 +699,24 @@ void edit (uint8_t file_id, const char *name)
                     printf ("\033[%dA\033%dD", LINES_PER_PAGE - 1, COLS_PER_LINE - 1);
                 }
             }
+            else if (c == 'g' || c == 'G')
+            {  // jump to the start of a line
+                const uint32_t line = prompt_number ("Go to line: ");
+                if (line > 0)
+                {
+                    if (!goto_line (line - 1))
+                    {
+                        printf ("\033[2J\033[HError reading file while jumping to line %lu (error %d)\r\n",
+                                (unsigned long)line, m_sd_error_code);
+                        leave_file (file_id, true);
+                        return;
+                    }
+                    cursor_row = 0;
+                    cursor_col = 0;
+                    position_cursor (PAGE_START_LINE, 1);
+                    print_current_page();
+                }
+            }
             
             // update our offset in the page
             cursor_page_pos = cursor_row * COLS_PER_LINE + cursor_col;
@@ -348,7 +729,9 @@ void edit (uint8_t file_id, const char *name)
         {  // in edit mode
             if (c == 127) // backspace
             {
-                backspace_char (cursor_page_pos);
+                if (!backspace_char (cursor_page_pos))
+                    draw_error_line (save_recovery_pending() ? SAVE_PENDING_ERROR :
+                                     "Error when deleting character!");
                 
                 print_current_page();
                 
@@ -383,7 +766,8 @@ void edit (uint8_t file_id, const char *name)
                 }
                 else
                 {
-                    draw_error_line ("Error when inserting character!");
+                    draw_error_line (save_recovery_pending() ? SAVE_PENDING_ERROR :
+                                     "Error when inserting character!");
                 }
             }
         }
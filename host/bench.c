@@ -0,0 +1,505 @@
+/*
+bench.c
+
+Replays scripted editing sessions against the editor (edit.c, pageCache.c
+and m_microsd.c, built for the PC) and a simulated mMicroSD, and reports
+what each one cost: mMicroSD round trips, bytes on the I2C bus, bytes sent
+to the terminal, simulated time, and how long the editor took to answer a
+key.  Everything is simulated, so the numbers are the same on every run,
+and a change that costs more shows up as a difference against a baseline.
+
+    obj/bench [options] sessions/scroll.txt sessions/typing.txt ...
+
+    --card DIR             where the simulated cards go (default obj/card)
+    --baseline FILE        fail if a session costs more than it did in FILE
+    --write-baseline FILE  save this run's numbers as a baseline
+    --latency CMD=US       how long a command takes on the card, eg. READ_FILE=800
+    --bus-khz KHZ          I2C clock (default 400)
+    --usb-us US            time per 64-byte USB packet (default 64)
+    --screen FILE          copy everything the editor prints to FILE
+    --perf                 print the perf probes after each session
+    --no-compound          play an mMicroSD without compound orders
+
+A session is a text file of directives, one per line:
+
+    # comment
+    file NAME BYTES   put a file of generated text on the card first
+    edit NAME         the file to edit
+    gap MS            time between keys from here on (default 150)
+    idle MS           leave the editor alone for a while
+    keys TEXT         type TEXT
+    repeat N TEXT     type TEXT N times
+
+TEXT can use \r, \n, \t, \e (escape), \\, \xNN, ^X for control keys, ^?
+for backspace, and ^^ for a plain ^.  CTRL-C is typed at the end to save and
+leave the editor.
+*/
+
+#define _XOPEN_SOURCE 500
+#include "host.h"
+#include "sim_card.h"
+#include "../main.h"
+#include "../pageCache.h"
+#include "../perf.h"
+#include "../trace.h"
+#include <ctype.h>
+#include <errno.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define DEFAULT_GAP_MS 150
+#define MAX_SESSIONS   64
+
+typedef struct Result
+{
+    char name[64];
+    uint32_t keys;
+    uint32_t round_trips;
+    uint32_t early_polls;
+    uint64_t bus_bytes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t usb_bytes;
+    uint32_t sim_ms;
+    uint32_t key_avg_us;
+    uint32_t key_max_us;
+} Result;
+
+static const char *card_root = "obj/card";
+static FILE *screen = NULL;
+static bool show_perf = false;
+
+// edit.c
+bool fatal_error = false;
+
+static void fail (const char *session, int line, const char *what)
+{
+    fprintf (stderr, "%s:%d: %s\n", session, line, what);
+    exit (2);
+}
+
+
+//-----------------------------------------------
+// Setting up the card:
+
+static int remove_entry (const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove (path);
+}
+
+// a file of text that looks enough like prose, the same every time
+static bool generate_file (const char *directory, const char *name, uint32_t bytes)
+{
+    static const char *const words[] =
+    {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+        "card", "page", "cursor", "editor", "buffer", "line", "of", "a",
+        "microcontroller", "and", "to", "in", "is", "with", "saved"
+    };
+    const uint32_t num_words = sizeof (words) / sizeof (words[0]);
+    
+    char path[1024];
+    snprintf (path, sizeof (path), "%s/%s", directory, name);
+    FILE *f = fopen (path, "wb");
+    if (f == NULL)
+        return false;
+    
+    uint32_t seed = 12345;
+    uint32_t written = 0;
+    uint32_t column = 0;
+    while (written < bytes)
+    {
+        seed = seed * 1103515245 + 12345;
+        const char *word = words[(seed >> 16) % num_words];
+        
+        char piece[32];
+        int length;
+        if (column > 50 && ((seed >> 8) & 3) == 0)
+        {
+            length = snprintf (piece, sizeof (piece), "%s.\n", word);
+            column = 0;
+        }
+        else
+        {
+            length = snprintf (piece, sizeof (piece), "%s ", word);
+            column += length;
+        }
+        
+        if (written + length > bytes)
+            length = bytes - written;
+        fwrite (piece, 1, length, f);
+        written += length;
+    }
+    
+    fclose (f);
+    return true;
+}
+
+
+//-----------------------------------------------
+// Sessions:
+
+// type the text, expanding the escapes; false if one is malformed
+// any idle time goes in front of the first key
+static bool queue_text (const char *text, uint32_t gap_ms, uint32_t *idle_ms, uint32_t *keys)
+{
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        char key = *c;
+        
+        if (*c == '^' && c[1] != '\0')
+        {
+            c++;
+            if (*c == '^')
+                key = '^';
+            else if (*c == '?')
+                key = 127;  // backspace, as most terminals send it
+            else
+                key = (char)(toupper ((unsigned char)*c) - 64);
+        }
+        else if (*c == '\\' && c[1] != '\0')
+        {
+            c++;
+            switch (*c)
+            {
+                case 'r': key = '\r'; break;
+                case 'n': key = '\n'; break;
+                case 't': key = '\t'; break;
+                case 'e': key = 27;   break;
+                case '\\': key = '\\'; break;
+                case 'x':
+                {
+                    char hex[3] = { c[1], c[1] ? c[2] : '\0', '\0' };
+                    char *end;
+                    key = (char)strtoul (hex, &end, 16);
+                    if (end != hex + 2)
+                        return false;
+                    c += 2;
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        
+        host_queue_key (key, gap_ms + *idle_ms);
+        *idle_ms = 0;
+        (*keys)++;
+    }
+    return true;
+}
+
+static void run_session (const char *session, Result *result)
+{
+    FILE *f = fopen (session, "r");
+    if (f == NULL)
+        fail (session, 0, strerror (errno));
+    
+    const char *base = strrchr (session, '/') ? strrchr (session, '/') + 1 : session;
+    memset (result, 0, sizeof (*result));
+    snprintf (result->name, sizeof (result->name), "%.*s", (int)strcspn (base, "."), base);
+    
+    // a fresh card for each session
+    char card[1024];
+    snprintf (card, sizeof (card), "%s/%s", card_root, result->name);
+    mkdir (card_root, 0777);
+    nftw (card, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (mkdir (card, 0777) != 0)
+        fail (session, 0, "couldn't create the card directory");
+    
+    // the file directives have to be carried out before the editor starts,
+    // so the keys are queued as the script is read and the editing waits
+    char edit_name[13] = "";
+    uint32_t gap_ms = DEFAULT_GAP_MS;
+    uint32_t idle_ms = 0;
+    uint32_t keys = 0;
+    
+    host_us = 0;
+    
+    char line[1024];
+    for (int number = 1; fgets (line, sizeof (line), f) != NULL; number++)
+    {
+        line[strcspn (line, "\r\n")] = '\0';
+        
+        char directive[16] = "", name[64];
+        unsigned long value;
+        int used = 0;
+        sscanf (line, " %15s%n", directive, &used);
+        
+        // one space separates the directive from the rest, so typed text
+        // can start with spaces of its own
+        const char *rest = line + used;
+        if (*rest == ' ')
+            rest++;
+        
+        if (directive[0] == '\0' || directive[0] == '#')
+            continue;
+        else if (strcmp (directive, "file") == 0 && sscanf (rest, "%63s %lu", name, &value) == 2)
+        {
+            if (!generate_file (card, name, value))
+                fail (session, number, "couldn't create the file");
+        }
+        else if (strcmp (directive, "edit") == 0 && sscanf (rest, "%12s", edit_name) == 1)
+            continue;
+        else if (strcmp (directive, "gap") == 0 && sscanf (rest, "%lu", &value) == 1)
+            gap_ms = value;
+        else if (strcmp (directive, "idle") == 0 && sscanf (rest, "%lu", &value) == 1)
+            idle_ms += value;
+        else if (strcmp (directive, "keys") == 0 || strcmp (directive, "repeat") == 0)
+        {
+            unsigned long times = 1;
+            if (directive[0] == 'r')
+            {
+                if (sscanf (rest, "%lu %n", &times, &used) != 1)
+                    fail (session, number, "repeat needs a count");
+                rest += used;
+            }
+            
+            for (unsigned long i = 0; i < times; i++)
+            {
+                if (!queue_text (rest, gap_ms, &idle_ms, &keys))
+                    fail (session, number, "bad escape");
+            }
+        }
+        else
+            fail (session, number, "can't make sense of this line");
+    }
+    fclose (f);
+    
+    if (edit_name[0] == '\0')
+        fail (session, 0, "no edit directive");
+    
+    host_queue_key ('C' - 64, gap_ms + idle_ms);
+    keys++;
+    
+    // start up the way main.c does
+    memset (&sim_card_stats, 0, sizeof (sim_card_stats));
+    memset (&host_console_stats, 0, sizeof (host_console_stats));
+    perf_reset();
+    trace_clear();
+    
+    const uint32_t start_round_trips = m_sd_round_trips;
+    const uint32_t start_early_polls = m_sd_early_polls;
+    sim_card_mount (card);
+    if (!m_sd_init())
+        fail (session, 0, "the simulated card didn't mount");
+    forget_pages();
+    if (!recover_saves())
+        fail (session, 0, "recover_saves() failed");
+    
+    uint8_t fid = 255;
+    if (!m_sd_open_file (edit_name, APPEND_FILE, &fid) &&
+        m_sd_error_code == ERROR_FAT32_NOT_FOUND)
+    {
+        m_sd_open_file (edit_name, CREATE_FILE, &fid);
+    }
+    if (fid == 255)
+        fail (session, 0, "couldn't open the file to edit");
+    
+    host_console_open (screen);
+    edit (&fid, edit_name);
+    host_console_close();
+    
+    if (host_keys_waiting() > 0)
+        fail (session, 0, "the editor quit before the session was over (see --screen)");
+    
+    m_sd_close_file (fid);
+    m_sd_shutdown();
+    
+    result->keys = keys;
+    result->round_trips = m_sd_round_trips - start_round_trips;
+    result->early_polls = m_sd_early_polls - start_early_polls;
+    result->bus_bytes = sim_card_stats.bus_bytes;
+    result->bytes_read = sim_card_stats.bytes_read;
+    result->bytes_written = sim_card_stats.bytes_written;
+    result->usb_bytes = host_console_stats.usb_bytes;
+    result->sim_ms = (uint32_t)(host_us / 1000);
+    result->key_avg_us = host_console_stats.keys ?
+                         (uint32_t)(host_console_stats.key_us_total / host_console_stats.keys) : 0;
+    result->key_max_us = (uint32_t)host_console_stats.key_us_max;
+}
+
+
+//-----------------------------------------------
+// Reports:
+
+static void print_header (void)
+{
+    printf ("%-16s %6s %8s %6s %10s %10s %10s %10s %9s %10s %10s\n",
+            "session", "keys", "commands", "nacks", "bus bytes", "read", "written",
+            "usb bytes", "sim ms", "key avg us", "key max us");
+}
+
+static void print_result (const Result *r)
+{
+    printf ("%-16s %6lu %8lu %6lu %10llu %10llu %10llu %10llu %9lu %10lu %10lu\n",
+            r->name, (unsigned long)r->keys, (unsigned long)r->round_trips,
+            (unsigned long)r->early_polls,
+            (unsigned long long)r->bus_bytes, (unsigned long long)r->bytes_read,
+            (unsigned long long)r->bytes_written, (unsigned long long)r->usb_bytes,
+            (unsigned long)r->sim_ms, (unsigned long)r->key_avg_us, (unsigned long)r->key_max_us);
+}
+
+static void write_baseline (const char *path, const Result *results, int count)
+{
+    FILE *f = fopen (path, "w");
+    if (f == NULL)
+    {
+        fprintf (stderr, "%s: %s\n", path, strerror (errno));
+        exit (2);
+    }
+    
+    fprintf (f, "# session commands bus_bytes usb_bytes sim_ms key_max_us\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf (f, "%s %lu %llu %llu %lu %lu\n", results[i].name,
+                 (unsigned long)results[i].round_trips, (unsigned long long)results[i].bus_bytes,
+                 (unsigned long long)results[i].usb_bytes, (unsigned long)results[i].sim_ms,
+                 (unsigned long)results[i].key_max_us);
+    }
+    fclose (f);
+}
+
+// more than 5% over the baseline is a regression
+static bool worse (const char *session, const char *what, uint64_t now, uint64_t then)
+{
+    if (now <= then + then / 20)
+        return false;
+    
+    printf ("REGRESSION %s: %s went from %llu to %llu\n", session, what,
+            (unsigned long long)then, (unsigned long long)now);
+    return true;
+}
+
+static bool check_baseline (const char *path, const Result *results, int count)
+{
+    FILE *f = fopen (path, "r");
+    if (f == NULL)
+    {
+        fprintf (stderr, "%s: %s\n", path, strerror (errno));
+        exit (2);
+    }
+    
+    bool regressed = false;
+    char line[256];
+    while (fgets (line, sizeof (line), f) != NULL)
+    {
+        char name[64];
+        unsigned long long commands, bus_bytes, usb_bytes, sim_ms, key_max_us;
+        if (line[0] == '#' ||
+            sscanf (line, "%63s %llu %llu %llu %llu %llu", name, &commands, &bus_bytes,
+                    &usb_bytes, &sim_ms, &key_max_us) != 6)
+        {
+            continue;
+        }
+        
+        for (int i = 0; i < count; i++)
+        {
+            const Result *r = &results[i];
+            if (strcmp (r->name, name) != 0)
+                continue;
+            
+            regressed |= worse (name, "commands", r->round_trips, commands);
+            regressed |= worse (name, "bus bytes", r->bus_bytes, bus_bytes);
+            regressed |= worse (name, "usb bytes", r->usb_bytes, usb_bytes);
+            regressed |= worse (name, "sim ms", r->sim_ms, sim_ms);
+            regressed |= worse (name, "key max us", r->key_max_us, key_max_us);
+        }
+    }
+    fclose (f);
+    return !regressed;
+}
+
+
+int main (int argc, char **argv)
+{
+    const char *baseline = NULL;
+    const char *new_baseline = NULL;
+    const char *sessions[MAX_SESSIONS];
+    int num_sessions = 0;
+    
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        
+        if (strcmp (arg, "--perf") == 0)
+        {
+            show_perf = true;
+            continue;
+        }
+        if (strcmp (arg, "--no-compound") == 0)
+        {
+            sim_card_set_compound (false);
+            continue;
+        }
+        if (arg[0] != '-')
+        {
+            if (num_sessions == MAX_SESSIONS)
+                fail (arg, 0, "too many sessions");
+            sessions[num_sessions++] = arg;
+            continue;
+        }
+        if (value == NULL)
+            fail (arg, 0, "needs a value");
+        i++;
+        
+        if (strcmp (arg, "--card") == 0)
+            card_root = value;
+        else if (strcmp (arg, "--baseline") == 0)
+            baseline = value;
+        else if (strcmp (arg, "--write-baseline") == 0)
+            new_baseline = value;
+        else if (strcmp (arg, "--bus-khz") == 0)
+            sim_card_set_bus_khz (strtoul (value, NULL, 10));
+        else if (strcmp (arg, "--usb-us") == 0)
+            host_usb_us_per_packet = strtoul (value, NULL, 10);
+        else if (strcmp (arg, "--screen") == 0)
+        {
+            screen = fopen (value, "wb");
+            if (screen == NULL)
+                fail (value, 0, strerror (errno));
+        }
+        else if (strcmp (arg, "--latency") == 0)
+        {
+            char command[32];
+            unsigned long us;
+            if (sscanf (value, "%31[A-Z_]=%lu", command, &us) != 2 ||
+                !sim_card_set_latency (command, us))
+            {
+                fail (value, 0, "expected a command and a time, eg. READ_FILE=800");
+            }
+        }
+        else
+            fail (arg, 0, "unknown option");
+    }
+    
+    if (num_sessions == 0)
+    {
+        fprintf (stderr, "usage: %s [options] SESSION...\n", argv[0]);
+        return 2;
+    }
+    
+    static Result results[MAX_SESSIONS];
+    print_header();
+    for (int i = 0; i < num_sessions; i++)
+    {
+        run_session (sessions[i], &results[i]);
+        print_result (&results[i]);
+        
+        if (show_perf)
+        {
+            perf_dump();
+            printf ("\n");
+        }
+    }
+    
+    if (new_baseline != NULL)
+        write_baseline (new_baseline, results, num_sessions);
+    
+    if (baseline != NULL && !check_baseline (baseline, results, num_sessions))
+        return 1;
+    
+    return 0;
+}
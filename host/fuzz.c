@@ -0,0 +1,829 @@
+/*
+fuzz.c
+
+Drives pageCache.c (built for the PC, over the simulated mMicroSD) through
+long random sequences of the calls the editor makes, and after every step
+checks it against a reference model: a plain copy of the document with
+each edit applied to it directly.
+
+    obj/fuzz [--seed N] [--runs N] [--steps N] [--size BYTES] [--card DIR]
+             [--no-compound] [-v]
+
+Each run starts from its own seed (the first is --seed, then one more each
+run) and a fresh file of up to --size bytes, so a failure can be replayed
+on its own with the seed and step count it reports.  At the end it prints
+what each kind of step cost in bytes on the simulated I2C bus.
+--no-compound plays an mMicroSD without compound orders, to check the way
+m_microsd.c works with older firmware.
+
+After every step:
+  - the current page holds exactly the document at its offset, as much of
+    it as fits, and the pages either side hold nothing that isn't there
+  - document_size(), is_first_page() and is_last_page() agree with the model
+  - the line under the page, when it's known, and the line count, once the
+    index is complete, match the newlines in the model
+  - whenever nothing is unsaved, the file on the card is the model, and
+    nothing is left of the save's temporary file
+Every so often, and after an undo or redo, the whole document is compared
+too; an undo or redo must land on a document that existed earlier.
+
+A "crash" step cuts the card's power partway through a save, then starts
+over the way main.c does after a reset.  The file has to come back as
+either the last saved document or the one being saved.
+
+A "glitch" step loses a few orders partway through a save, with no reset.
+While a save is pending recovery no edit may get through, and once the
+bus is back, saving again has to get the document onto the card; the run
+then carries on editing and saving from there.
+
+A "switch" step makes the save on leaving the editor fail, the way a
+glitch does, then closes the file the way main.c does and edits another
+one, which is left just as it was, before coming back to the first.  That
+has to be either the last saved document or the one being saved.
+*/
+
+#define _XOPEN_SOURCE 500
+#include "host.h"
+#include "sim_card.h"
+#include "../m_microsd.h"
+#include "../pageCache.h"
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define FILE_NAME   "FUZZ.TXT"
+#define OTHER_NAME  "OTHER.TXT"  // what the switch step edits in between
+#define FULL_CHECK  16   // steps between whole-document checks
+#define HISTORY     8192 // documents remembered for checking undo and redo
+#define LOG_LENGTH  24   // steps shown when a check fails
+
+typedef enum op_kind
+{
+    OP_INSERT = 0,
+    OP_BACKSPACE,
+    OP_DELETE,
+    OP_PAGE_DOWN,
+    OP_PAGE_UP,
+    OP_GOTO_LINE,
+    OP_UNDO,
+    OP_REDO,
+    OP_IDLE,
+    OP_SAVE,
+    OP_CRASH,
+    OP_GLITCH,
+    OP_SWITCH,
+    
+    OP_KINDS
+} op_kind;
+
+static const char *const op_name[OP_KINDS] =
+{
+    "insert", "backspace", "delete", "page_down", "page_up", "goto_line",
+    "undo", "redo", "idle", "save", "crash", "glitch",
+    "switch"
+};
+
+// how often each kind comes up, out of the total
+static const uint8_t op_weight[OP_KINDS] =
+{
+    [OP_INSERT]    = 34,
+    [OP_BACKSPACE] = 12,
+    [OP_DELETE]    = 8,
+    [OP_PAGE_DOWN] = 9,
+    [OP_PAGE_UP]   = 9,
+    [OP_GOTO_LINE] = 3,
+    [OP_UNDO]      = 6,
+    [OP_REDO]      = 4,
+    [OP_IDLE]      = 8,
+    [OP_SAVE]      = 3,
+    [OP_CRASH]     = 1,
+    [OP_GLITCH]    = 2,
+    [OP_SWITCH]    = 1
+};
+
+typedef struct OpCost
+{
+    uint32_t count;
+    uint64_t bus_bytes;
+    uint64_t max_bus_bytes;
+    uint64_t us;
+} OpCost;
+
+static OpCost cost[OP_KINDS];
+
+static const char *card_root = "obj/fuzzcard";
+static char card[1024];
+static char file_path[1100];
+static char other_path[1100];
+static bool verbose = false;
+
+static uint64_t rng;
+
+// the reference model
+static char *model = NULL;
+static uint32_t model_bytes = 0;
+static uint32_t model_capacity = 0;
+
+static uint64_t history[HISTORY];   // hashes of every document since opening
+static uint32_t history_count = 0;
+
+// for reporting a failure
+static uint32_t run_seed;
+static uint32_t step;
+static char op_log[LOG_LENGTH][64];
+
+
+static uint32_t random_below (uint32_t limit)
+{
+    // xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (uint32_t)((rng * 2685821657736338717ULL) >> 32) % limit;
+}
+
+static void log_op (const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+static void log_op (const char *format, ...)
+{
+    va_list args;
+    va_start (args, format);
+    vsnprintf (op_log[step % LOG_LENGTH], sizeof (op_log[0]), format, args);
+    va_end (args);
+    
+    if (verbose)
+        printf ("%6lu  %s\n", (unsigned long)step, op_log[step % LOG_LENGTH]);
+}
+
+static void fail (const char *format, ...) __attribute__ ((format (printf, 1, 2), noreturn));
+
+static void fail (const char *format, ...)
+{
+    printf ("\nFAILED: seed %lu, step %lu: ", (unsigned long)run_seed, (unsigned long)step);
+    va_list args;
+    va_start (args, format);
+    vprintf (format, args);
+    va_end (args);
+    
+    printf ("\n(m_sd_error_code %d, document %lu bytes, page at %lu holding %u)\n\nlast steps:\n",
+            m_sd_error_code, (unsigned long)model_bytes,
+            (unsigned long)currentPage->file_offset, currentPage->num_bytes);
+    
+    const uint32_t first = (step + 1 > LOG_LENGTH) ? step + 1 - LOG_LENGTH : 0;
+    for (uint32_t i = first; i <= step; i++)
+        printf ("%6lu  %s\n", (unsigned long)i, op_log[i % LOG_LENGTH]);
+    
+    printf ("\nreplay with: obj/fuzz --seed %lu --runs 1 --steps %lu -v\n",
+            (unsigned long)run_seed, (unsigned long)step + 1);
+    exit (1);
+}
+
+
+//-----------------------------------------------
+// The model:
+
+static void model_reserve (uint32_t bytes)
+{
+    if (bytes <= model_capacity)
+        return;
+    
+    model_capacity = bytes * 2 + 256;
+    model = realloc (model, model_capacity);
+    if (model == NULL)
+    {
+        fprintf (stderr, "out of memory\n");
+        exit (2);
+    }
+}
+
+static uint64_t hash_document (const char *data, uint32_t bytes)
+{
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+    for (uint32_t i = 0; i < bytes; i++)
+        hash = (hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+    return hash ^ bytes;
+}
+
+static void remember_model (void)
+{
+    const uint64_t hash = hash_document (model, model_bytes);
+    
+    for (uint32_t i = 0; i < history_count; i++)
+    {
+        if (history[i] == hash)
+            return;
+    }
+    
+    // forget the oldest half when full; undo can't reach back that far anyway
+    if (history_count == HISTORY)
+    {
+        memmove (history, &history[HISTORY / 2], sizeof (history[0]) * HISTORY / 2);
+        history_count = HISTORY / 2;
+    }
+    history[history_count++] = hash;
+}
+
+static bool seen_before (const char *data, uint32_t bytes)
+{
+    const uint64_t hash = hash_document (data, bytes);
+    for (uint32_t i = 0; i < history_count; i++)
+    {
+        if (history[i] == hash)
+            return true;
+    }
+    return false;
+}
+
+static void model_insert (uint32_t offset, char c)
+{
+    model_reserve (model_bytes + 1);
+    memmove (&model[offset + 1], &model[offset], model_bytes - offset);
+    model[offset] = c;
+    model_bytes++;
+    remember_model();
+}
+
+static void model_remove (uint32_t offset)
+{
+    memmove (&model[offset], &model[offset + 1], model_bytes - offset - 1);
+    model_bytes--;
+    remember_model();
+}
+
+static uint32_t newlines_before (uint32_t offset)
+{
+    uint32_t lines = 0;
+    for (uint32_t i = 0; i < offset; i++)
+        lines += (model[i] == '\n');
+    return lines;
+}
+
+static uint32_t line_start (uint32_t line)
+{
+    uint32_t offset = 0;
+    for (uint32_t found = 0; found < line && offset < model_bytes; offset++)
+        found += (model[offset] == '\n');
+    return offset;
+}
+
+// read a file back from the card directory, NULL if it isn't there
+static char *read_card_file (const char *path, uint32_t *bytes)
+{
+    FILE *f = fopen (path, "rb");
+    if (f == NULL)
+        return NULL;
+    
+    fseek (f, 0, SEEK_END);
+    *bytes = (uint32_t)ftell (f);
+    fseek (f, 0, SEEK_SET);
+    
+    char *data = malloc (*bytes + 1);
+    if (data == NULL || fread (data, 1, *bytes, f) != *bytes)
+    {
+        fprintf (stderr, "couldn't read %s\n", path);
+        exit (2);
+    }
+    fclose (f);
+    return data;
+}
+
+static bool card_has (const char *name)
+{
+    char path[1200];
+    struct stat st;
+    snprintf (path, sizeof (path), "%s/%s", card, name);
+    return stat (path, &st) == 0;
+}
+
+
+//-----------------------------------------------
+// Checks:
+
+static void check_page (const Page *page, const char *which, bool must_be_full)
+{
+    if (page->file_offset == 0xffffffff)
+    {
+        if (must_be_full)
+            fail ("the %s page has no offset", which);
+        return;
+    }
+    
+    if (page->num_bytes > PAGE_BYTES)
+        fail ("the %s page holds %u bytes", which, page->num_bytes);
+    
+    if (page->num_bytes > 0 &&
+        (page->file_offset > model_bytes || page->num_bytes > model_bytes - page->file_offset))
+    {
+        fail ("the %s page (at %lu, %u bytes) runs past the end of the document",
+              which, (unsigned long)page->file_offset, page->num_bytes);
+    }
+    
+    for (uint16_t i = 0; i < page->num_bytes; i++)
+    {
+        if (page->data[i] != model[page->file_offset + i])
+        {
+            fail ("the %s page (at %lu) has 0x%02x at %u where the document has 0x%02x",
+                  which, (unsigned long)page->file_offset, (uint8_t)page->data[i], i,
+                  (uint8_t)model[page->file_offset + i]);
+        }
+    }
+    
+    if (must_be_full)
+    {
+        if (page->file_offset > model_bytes)
+            fail ("the %s page starts past the end of the document", which);
+        
+        const uint32_t left = model_bytes - page->file_offset;
+        const uint32_t expected = (left < PAGE_BYTES) ? left : PAGE_BYTES;
+        if (page->num_bytes != expected)
+            fail ("the %s page holds %u bytes, not %lu", which, page->num_bytes, (unsigned long)expected);
+    }
+}
+
+static void check_card_file (void)
+{
+    uint32_t bytes;
+    char *data = read_card_file (file_path, &bytes);
+    if (data == NULL)
+        fail ("%s has gone from the card", FILE_NAME);
+    
+    if (bytes != model_bytes || memcmp (data, model, bytes) != 0)
+        fail ("nothing is unsaved, but the file on the card (%lu bytes) isn't the document",
+              (unsigned long)bytes);
+    free (data);
+    
+    if (card_has ("EDITSAVE.TMP") || card_has ("EDITSAV2.TMP"))
+        fail ("a save's temporary file was left on the card");
+}
+
+static void check_whole_document (void)
+{
+    char *copy = malloc (model_bytes + 1);
+    if (!copy_document (0, model_bytes, copy))
+        fail ("copy_document() failed");
+    if (memcmp (copy, model, model_bytes) != 0)
+        fail ("the document doesn't match the model");
+    free (copy);
+}
+
+static void check_everything (void)
+{
+    if (document_size() != model_bytes)
+        fail ("document_size() is %lu, not %lu", (unsigned long)document_size(), (unsigned long)model_bytes);
+    
+    check_page (currentPage, "current", true);
+    check_page (prevPage, "previous", false);
+    check_page (nextPage, "next", false);
+    
+    if (is_first_page() != (currentPage->file_offset == 0))
+        fail ("is_first_page() is wrong");
+    if (is_last_page() != (currentPage->file_offset + PAGE_BYTES >= model_bytes))
+        fail ("is_last_page() is wrong");
+    
+    uint32_t line;
+    if (current_line (0, &line) && line != newlines_before (currentPage->file_offset))
+        fail ("current_line() says %lu, not %lu", (unsigned long)line,
+              (unsigned long)newlines_before (currentPage->file_offset));
+    
+    if (line_index_progress() == 100 && line_count() != newlines_before (model_bytes) + 1)
+        fail ("line_count() says %lu, not %lu", (unsigned long)line_count(),
+              (unsigned long)newlines_before (model_bytes) + 1);
+    
+    if (unsaved_byte_count() == 0)
+        check_card_file();
+    
+    if (step % FULL_CHECK == 0)
+        check_whole_document();
+}
+
+
+//-----------------------------------------------
+// Runs:
+
+static int remove_entry (const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove (path);
+}
+
+static char random_char (void)
+{
+    static const char common[] = "etaoin shrdlu\n\n\t.,EAXZ";
+    if (random_below (50) == 0)
+        return (char)random_below (256);  // anything at all, now and then
+    return common[random_below (sizeof (common) - 1)];
+}
+
+// open a file for editing, the way the edit command does
+static void open_document (const char *name)
+{
+    uint8_t fid;
+    if (!m_sd_open_file (name, APPEND_FILE, &fid))
+        fail ("couldn't open %s", name);
+    if (!init_pages (fid, name))
+        fail ("init_pages() failed on %s", name);
+}
+
+// leave the editor without saving again, the way edit() and main.c do it
+static void close_document (void)
+{
+    const uint8_t fid = active_file_id();
+    release_pages();
+    if (fid != INVALID_FID && !m_sd_close_file (fid))
+        fail ("couldn't close the file");
+}
+
+// open the file, taking whatever's on the card as the document
+static void open_model (void)
+{
+    open_document (FILE_NAME);
+    
+    uint32_t bytes;
+    char *data = read_card_file (file_path, &bytes);
+    model_reserve (bytes);
+    memcpy (model, data, bytes);
+    model_bytes = bytes;
+    free (data);
+    
+    history_count = 0;
+    remember_model();
+}
+
+// mount the card, recover from anything cut short, and open the file,
+// the way main.c and the edit command do it
+static void start_up (void)
+{
+    sim_card_mount (card);
+    if (!m_sd_init())
+        fail ("m_sd_init() failed");
+    
+    forget_pages();
+    if (!recover_saves())
+        fail ("recover_saves() failed");
+    
+    open_model();
+}
+
+static void run (uint32_t seed, uint32_t steps, uint32_t max_size)
+{
+    run_seed = seed;
+    rng = 0x9E3779B97F4A7C15ULL ^ seed;
+    if (rng == 0)
+        rng = 1;
+    step = 0;
+    
+    snprintf (card, sizeof (card), "%s/%lu", card_root, (unsigned long)seed);
+    snprintf (file_path, sizeof (file_path), "%s/%s", card, FILE_NAME);
+    snprintf (other_path, sizeof (other_path), "%s/%s", card, OTHER_NAME);
+    mkdir (card_root, 0777);
+    nftw (card, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (mkdir (card, 0777) != 0)
+    {
+        fprintf (stderr, "couldn't create %s\n", card);
+        exit (2);
+    }
+    
+    // a starting file, sometimes empty and sometimes spanning many pages
+    FILE *f = fopen (file_path, "wb");
+    const uint32_t size = random_below (max_size + 1);
+    for (uint32_t i = 0; i < size; i++)
+        fputc (random_char(), f);
+    fclose (f);
+    
+    // and one that the switch step edits in between
+    f = fopen (other_path, "wb");
+    const uint32_t other_size = random_below (max_size + 1);
+    for (uint32_t i = 0; i < other_size; i++)
+        fputc (random_char(), f);
+    fclose (f);
+    
+    start_up();
+    
+    uint32_t total_weight = 0;
+    for (uint8_t k = 0; k < OP_KINDS; k++)
+        total_weight += op_weight[k];
+    
+    for (step = 0; step < steps; step++)
+    {
+        uint32_t pick = random_below (total_weight);
+        op_kind kind = 0;
+        while (pick >= op_weight[kind])
+            pick -= op_weight[kind++];
+        
+        const uint64_t bus_before = sim_card_stats.bus_bytes;
+        const uint64_t us_before = host_us;
+        
+        const uint32_t offset = currentPage->file_offset;
+        const uint16_t num_bytes = currentPage->num_bytes;
+        bool full_check = false;
+        
+        switch (kind)
+        {
+            case OP_INSERT:
+            {
+                const int pos = random_below (num_bytes + 1);
+                const char c = random_char();
+                log_op ("insert 0x%02x at %d (offset %lu)", (uint8_t)c, pos, (unsigned long)(offset + pos));
+                if (!insert_char (c, pos))
+                    fail ("insert_char() failed");
+                model_insert (offset + pos, c);
+                break;
+            }
+            
+            case OP_BACKSPACE:
+            {
+                const int pos = random_below (num_bytes + 1);
+                log_op ("backspace at %d (offset %lu)", pos, (unsigned long)(offset + pos));
+                if (!backspace_char (pos))
+                    fail ("backspace_char() failed");
+                if (pos > 0)
+                    model_remove (offset + pos - 1);
+                break;
+            }
+            
+            case OP_DELETE:
+            {
+                const int pos = random_below (num_bytes + 1);
+                log_op ("delete at %d (offset %lu)", pos, (unsigned long)(offset + pos));
+                if (!delete_char (pos))
+                    fail ("delete_char() failed");
+                if (pos < num_bytes)
+                    model_remove (offset + pos);
+                break;
+            }
+            
+            case OP_PAGE_DOWN:
+                // the editor only asks for another page when there is one
+                log_op ("page_down from %lu%s", (unsigned long)offset, is_last_page() ? " (last page, skipped)" : "");
+                if (is_last_page())
+                    break;
+                if (!page_down())
+                    fail ("page_down() failed");
+                if (currentPage->file_offset != offset + num_bytes)
+                    fail ("page_down() went to %lu, not %lu", (unsigned long)currentPage->file_offset,
+                          (unsigned long)(offset + num_bytes));
+                break;
+            
+            case OP_PAGE_UP:
+            {
+                log_op ("page_up from %lu%s", (unsigned long)offset, is_first_page() ? " (first page, skipped)" : "");
+                if (is_first_page())
+                    break;
+                if (!page_up())
+                    fail ("page_up() failed");
+                const uint32_t expected = (offset > PAGE_BYTES) ? offset - PAGE_BYTES : 0;
+                if (currentPage->file_offset != expected)
+                    fail ("page_up() went to %lu, not %lu", (unsigned long)currentPage->file_offset,
+                          (unsigned long)expected);
+                break;
+            }
+            
+            case OP_GOTO_LINE:
+            {
+                const uint32_t lines = newlines_before (model_bytes) + 1;
+                uint32_t line = random_below (lines + 3);
+                log_op ("goto_line %lu of %lu", (unsigned long)line, (unsigned long)lines);
+                if (!goto_line (line))
+                    fail ("goto_line() failed");
+                if (line >= lines)
+                    line = lines - 1;
+                if (currentPage->file_offset != line_start (line))
+                    fail ("goto_line() went to %lu, not %lu", (unsigned long)currentPage->file_offset,
+                          (unsigned long)line_start (line));
+                break;
+            }
+            
+            case OP_UNDO:
+            case OP_REDO:
+            {
+                const bool undo = (kind == OP_UNDO);
+                const bool possible = undo ? can_undo() : can_redo();
+                log_op ("%s%s", op_name[kind], possible ? "" : " (nothing to do)");
+                if (!possible)
+                    break;
+                
+                int pos;
+                if (undo ? !undo_edit (&pos) : !redo_edit (&pos))
+                    fail ("%s failed", undo ? "undo_edit()" : "redo_edit()");
+                if (pos < 0 || pos > currentPage->num_bytes)
+                    fail ("the cursor went to %d, off the page", pos);
+                
+                // the model can't say what a step of undo covers, only that
+                // it has to end up somewhere the document has been before
+                const uint32_t bytes = document_size();
+                model_reserve (bytes);
+                if (!copy_document (0, bytes, model))
+                    fail ("copy_document() failed");
+                model_bytes = bytes;
+                if (!seen_before (model, model_bytes))
+                    fail ("%s made a document that never existed", op_name[kind]);
+                full_check = true;
+                break;
+            }
+            
+            case OP_IDLE:
+            {
+                // what the editor does while it waits for a key
+                const uint32_t ms = random_below (3000);
+                log_op ("idle %lu ms", (unsigned long)ms);
+                for (uint32_t waited = 0; waited < ms; waited += 50)
+                {
+                    host_advance (50000);
+                    prefetch_pages();
+                    index_lines();
+                    spill_undo_history();
+                    m_sd_poll();
+                    if (!autosave_pages())
+                        fail ("autosave_pages() failed");
+                }
+                break;
+            }
+            
+            case OP_SAVE:
+                log_op ("save (%lu unsaved)", (unsigned long)unsaved_byte_count());
+                if (!save_pages())
+                    fail ("save_pages() failed");
+                break;
+            
+            case OP_CRASH:
+            {
+                uint32_t old_bytes;
+                char *old = read_card_file (file_path, &old_bytes);
+                char *edited = malloc (model_bytes + 1);
+                const uint32_t edited_bytes = model_bytes;
+                memcpy (edited, model, model_bytes);
+                
+                const uint32_t orders = 1 + random_below (80);
+                log_op ("save, with the power cut after %lu orders", (unsigned long)orders);
+                
+                sim_card_fail_after (orders);
+                save_pages();
+                start_up();
+                
+                const bool is_old = (model_bytes == old_bytes && memcmp (model, old, old_bytes) == 0);
+                const bool is_new = (model_bytes == edited_bytes && memcmp (model, edited, edited_bytes) == 0);
+                free (old);
+                free (edited);
+                
+                if (!is_old && !is_new)
+                    fail ("after the crash the file is neither the old one nor the new one");
+                full_check = true;
+                break;
+            }
+            
+            case OP_GLITCH:
+            {
+                const uint32_t orders = 1 + random_below (80);
+                const uint32_t lost = 1 + random_below (4);
+                log_op ("save, with %lu orders lost after %lu", (unsigned long)lost,
+                        (unsigned long)orders);
+                
+                sim_card_lose_orders (orders, lost);
+                bool saved = save_pages();
+                sim_card_lose_orders (0, 0);  // in case the save didn't get that far
+                
+                // every failed attempt uses up at least one lost order
+                for (uint32_t tries = 0; !saved; tries++)
+                {
+                    if (save_recovery_pending() && insert_char ('x', 0))
+                        fail ("an edit got through while a save was pending recovery");
+                    if (tries == lost)
+                        fail ("save_pages() still fails with the bus back");
+                    saved = save_pages();
+                }
+                full_check = true;
+                break;
+            }
+            
+            case OP_SWITCH:
+            {
+                uint32_t old_bytes;
+                char *old = read_card_file (file_path, &old_bytes);
+                char *edited = malloc (model_bytes + 1);
+                const uint32_t edited_bytes = model_bytes;
+                memcpy (edited, model, model_bytes);
+                
+                const uint32_t orders = 1 + random_below (80);
+                log_op ("save losing orders after %lu, then edit %s", (unsigned long)orders,
+                        OTHER_NAME);
+                
+                // the bus is out for long enough that the save can't recover
+                // before the editor gives up on it
+                sim_card_lose_orders (orders, 1000);
+                save_pages();
+                sim_card_lose_orders (0, 0);
+                close_document();
+                
+                uint32_t other_bytes;
+                char *other = read_card_file (other_path, &other_bytes);
+                open_document (OTHER_NAME);
+                
+                char *copy = malloc (other_bytes + 1);
+                if (document_size() != other_bytes || !copy_document (0, other_bytes, copy) ||
+                    memcmp (copy, other, other_bytes) != 0)
+                {
+                    fail ("%s doesn't open as it was on the card", OTHER_NAME);
+                }
+                free (copy);
+                close_document();
+                
+                char *after = read_card_file (other_path, &other_bytes);
+                if (memcmp (after, other, other_bytes) != 0)
+                    fail ("%s was changed by the failed save of %s", OTHER_NAME, FILE_NAME);
+                free (after);
+                free (other);
+                
+                open_model();
+                
+                const bool is_old = (model_bytes == old_bytes && memcmp (model, old, old_bytes) == 0);
+                const bool is_new = (model_bytes == edited_bytes && memcmp (model, edited, edited_bytes) == 0);
+                free (old);
+                free (edited);
+                
+                if (!is_old && !is_new)
+                    fail ("after the switch the file is neither the old one nor the new one");
+                full_check = true;
+                break;
+            }
+            
+            default:
+                break;
+        }
+        
+        const uint64_t bus = sim_card_stats.bus_bytes - bus_before;
+        cost[kind].count++;
+        cost[kind].bus_bytes += bus;
+        cost[kind].us += host_us - us_before;
+        if (bus > cost[kind].max_bus_bytes)
+            cost[kind].max_bus_bytes = bus;
+        
+        check_everything();
+        if (full_check)
+            check_whole_document();
+    }
+    
+    // close up the way the editor does
+    if (!save_pages())
+        fail ("the final save failed");
+    check_card_file();
+    close_document();
+    forget_pages();
+    m_sd_shutdown();
+}
+
+
+int main (int argc, char **argv)
+{
+    uint32_t seed = 1;
+    uint32_t runs = 20;
+    uint32_t steps = 2000;
+    uint32_t size = 4 * PAGE_BYTES;
+    
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : "";
+        
+        if (strcmp (arg, "-v") == 0)
+            verbose = true;
+        else if (strcmp (arg, "--no-compound") == 0)
+            sim_card_set_compound (false);
+        else if (strcmp (arg, "--seed") == 0 && *value)
+            seed = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (arg, "--runs") == 0 && *value)
+            runs = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (arg, "--steps") == 0 && *value)
+            steps = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (arg, "--size") == 0 && *value)
+            size = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (arg, "--card") == 0 && *value)
+            card_root = argv[++i];
+        else
+        {
+            fprintf (stderr, "usage: %s [--seed N] [--runs N] [--steps N] [--size BYTES] [--card DIR] [--no-compound] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    for (uint32_t r = 0; r < runs; r++)
+    {
+        run (seed + r, steps, size);
+        if (!verbose)
+        {
+            printf (".");
+            fflush (stdout);
+        }
+    }
+    
+    printf ("\n%lu runs of %lu steps passed\n\n", (unsigned long)runs, (unsigned long)steps);
+    printf ("%-10s %8s %14s %14s %12s\n", "step", "count", "avg bus bytes", "max bus bytes", "avg sim us");
+    for (uint8_t k = 0; k < OP_KINDS; k++)
+    {
+        if (cost[k].count == 0)
+            continue;
+        printf ("%-10s %8lu %14.1f %14llu %12.1f\n", op_name[k], (unsigned long)cost[k].count,
+                (double)cost[k].bus_bytes / cost[k].count, (unsigned long long)cost[k].max_bus_bytes,
+                (double)cost[k].us / cost[k].count);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+host.c
+
+The M4's side of the host build: the simulated clock and the USB console.
+
+stdin is fed from a queue of keys, each due a set time after the previous
+one was read.  While the editor waits for the next key it runs its idle
+work, and the clock is moved on a millisecond at a time in between, so that
+idle work gets about as many chances to run as it would on the M4.
+*/
+
+#define _GNU_SOURCE
+#include "host.h"
+#include <stdlib.h>
+
+uint32_t SystemCoreClock = 72000000;
+uint64_t host_us = 0;
+
+HostConsoleStats host_console_stats;
+uint32_t host_usb_us_per_packet = 64;
+
+#define USB_PACKET   64
+#define IDLE_TICK_US 1000
+#define MAX_KEYS     65536
+
+typedef struct queued_key
+{
+    char key;
+    uint32_t gap_us;
+} queued_key;
+
+static queued_key keys[MAX_KEYS];
+static uint32_t key_head = 0;
+static uint32_t key_tail = 0;
+
+static uint64_t key_due = 0;       // when keys[key_head] arrives
+static uint64_t key_read_at = 0;   // when the last key was read
+static bool key_in_hand = false;   // and its lag hasn't been measured yet
+
+static FILE *screen_copy = NULL;
+static FILE *saved_stdin = NULL;
+static FILE *saved_stdout = NULL;
+static uint64_t unflushed_bytes = 0;
+
+
+void host_queue_key (char key, uint32_t gap_ms)
+{
+    if (key_tail == MAX_KEYS)
+    {
+        fprintf (stderr, "too many keys in one session\n");
+        exit (1);
+    }
+    
+    if (key_tail == key_head)
+        key_due = host_us + (uint64_t)gap_ms * 1000;
+    
+    keys[key_tail].key = key;
+    keys[key_tail].gap_us = gap_ms * 1000;
+    key_tail++;
+}
+
+uint32_t host_keys_waiting (void)
+{
+    return key_tail - key_head;
+}
+
+static void key_lag_ends (void)
+{
+    if (!key_in_hand)
+        return;
+    
+    const uint64_t lag = host_us - key_read_at;
+    host_console_stats.keys++;
+    host_console_stats.key_us_total += lag;
+    if (lag > host_console_stats.key_us_max)
+        host_console_stats.key_us_max = lag;
+    key_in_hand = false;
+}
+
+bool mUSBDataAvailable (void)
+{
+    key_lag_ends();
+    
+    if (key_head == key_tail)
+    {  // the editor would wait forever
+        fprintf (stderr, "the session ran out of keys with the editor still open\n");
+        exit (1);
+    }
+    
+    if (host_us >= key_due)
+        return true;
+    
+    const uint64_t wait = key_due - host_us;
+    host_advance (wait < IDLE_TICK_US ? wait : IDLE_TICK_US);
+    return false;
+}
+
+void mRunDeferred (void)
+{}
+
+// stdin: blocks (ie. moves the clock on) until the next key is due
+static ssize_t read_key (void *cookie, char *buffer, size_t size)
+{
+    if (size == 0 || key_head == key_tail)
+        return 0;
+    
+    key_lag_ends();
+    if (host_us < key_due)
+        host_us = key_due;
+    
+    buffer[0] = keys[key_head].key;
+    key_head++;
+    
+    key_read_at = host_us;
+    key_in_hand = true;
+    if (key_head != key_tail)
+        key_due = host_us + keys[key_head].gap_us;
+    return 1;
+}
+
+// stdout: counted, then charged for when it's flushed
+static ssize_t write_screen (void *cookie, const char *buffer, size_t size)
+{
+    if (screen_copy != NULL)
+        fwrite (buffer, 1, size, screen_copy);
+    
+    host_console_stats.usb_bytes += size;
+    unflushed_bytes += size;
+    return size;
+}
+
+void mUSBFlush (void)
+{
+    fflush (stdout);
+    
+    const uint64_t packets = (unflushed_bytes + USB_PACKET - 1) / USB_PACKET;
+    host_console_stats.usb_us += packets * host_usb_us_per_packet;
+    host_advance (packets * host_usb_us_per_packet);
+    unflushed_bytes = 0;
+}
+
+void host_console_open (FILE *screen)
+{
+    static const cookie_io_functions_t keyboard = { .read = read_key };
+    static const cookie_io_functions_t terminal = { .write = write_screen };
+    
+    screen_copy = screen;
+    saved_stdin = stdin;
+    saved_stdout = stdout;
+    
+    stdin = fopencookie (NULL, "r", keyboard);
+    stdout = fopencookie (NULL, "w", terminal);
+    if (stdin == NULL || stdout == NULL)
+    {
+        fprintf (stderr, "couldn't set up the console\n");
+        exit (1);
+    }
+    
+    // the same buffering the M4 sets up in mUSBInit()
+    setvbuf (stdin, NULL, _IONBF, 0);
+    setvbuf (stdout, NULL, _IOFBF, 256);
+}
+
+void host_console_close (void)
+{
+    mUSBFlush();
+    key_lag_ends();
+    
+    fclose (stdin);
+    fclose (stdout);
+    stdin = saved_stdin;
+    stdout = saved_stdout;
+    
+    if (screen_copy != NULL)
+        fflush (screen_copy);
+    key_head = key_tail = 0;
+}
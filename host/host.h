@@ -0,0 +1,74 @@
+/*
+host.h
+
+What the editor core needs from the M4 (mGeneral.h and mUSB.h), for building
+it on a Linux PC with -DHOST.  Time is simulated: it only moves when the
+simulated mMicroSD or USB port charge for their work, or when the editor
+sits waiting for a key, so a run takes the same simulated time every time.
+*/
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// the M4's core clock, which the simulated cycle counter runs at
+extern uint32_t SystemCoreClock;
+
+// simulated microseconds since startup
+extern uint64_t host_us;
+
+static inline void host_advance (uint64_t us)
+{
+    host_us += us;
+}
+
+static inline uint32_t mMillis (void)
+{
+    return (uint32_t)(host_us / 1000);
+}
+
+static inline uint32_t mCycles (void)
+{
+    return (uint32_t)(host_us * (SystemCoreClock / 1000000));
+}
+
+// there are no interrupts to mask
+static inline uint32_t __get_PRIMASK (void) { return 0; }
+static inline void __disable_irq (void) {}
+static inline void __set_PRIMASK (uint32_t primask) { (void)primask; }
+
+// the console, see host.c
+void mUSBFlush (void);
+bool mUSBDataAvailable (void);
+void mRunDeferred (void);
+
+// point stdin and stdout at the simulated console; what the editor prints
+// is counted and charged for, and copied to screen if that isn't NULL
+void host_console_open (FILE *screen);
+void host_console_close (void);
+
+// a key for the editor, which arrives gap_ms after the one before it was read
+void host_queue_key (char key, uint32_t gap_ms);
+uint32_t host_keys_waiting (void);
+
+// the time from reading a key to being back waiting for the next one,
+// which is the lag someone at the terminal would see
+typedef struct HostConsoleStats
+{
+    uint32_t keys;
+    uint64_t key_us_total;
+    uint64_t key_us_max;
+    uint64_t usb_bytes;  // printed by the editor
+    uint64_t usb_us;     // time charged for sending it
+} HostConsoleStats;
+
+extern HostConsoleStats host_console_stats;
+
+// how long each 64-byte USB packet takes to go out
+extern uint32_t host_usb_us_per_packet;
+
+#endif
@@ -0,0 +1,895 @@
+/*
+sim_card.c
+
+The simulated mMicroSD, see sim_card.h.
+
+Each order is carried out as soon as it arrives, against the files in the
+card directory, and its response is held until it's collected.  Names are
+8.3 and case-insensitive as on FAT32; files the simulator creates get upper
+case names, and anything in the directory that isn't a valid 8.3 name is
+invisible to the card.
+*/
+
+#include "sim_card.h"
+#include "../m_microsd.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// must match m_microsd.c
+typedef enum sim_command
+{
+    M_SD_INIT = 0,
+    M_SD_SHUTDOWN,
+    M_SD_GET_SIZE,
+    M_SD_OBJECT_EXISTS,
+    M_SD_GET_FIRST_ENTRY,
+    M_SD_GET_NEXT_ENTRY,
+    M_SD_PUSH,
+    M_SD_POP,
+    M_SD_MKDIR,
+    M_SD_RMDIR,
+    M_SD_DELETE,
+    M_SD_OPEN_FILE,
+    M_SD_CLOSE_FILE,
+    M_SD_SEEK,
+    M_SD_GET_SEEK,
+    M_SD_READ_FILE,
+    M_SD_WRITE_FILE,
+    M_SD_COMMIT,
+    M_SD_READ_AT,
+    M_SD_WRITE_AT,
+    M_SD_BATCH,
+    
+    SIM_COMMANDS
+} sim_command;
+
+static const char *const command_name[SIM_COMMANDS] =
+{
+    "INIT", "SHUTDOWN", "GET_SIZE", "OBJECT_EXISTS", "GET_FIRST_ENTRY",
+    "GET_NEXT_ENTRY", "PUSH", "POP", "MKDIR", "RMDIR", "DELETE", "OPEN_FILE",
+    "CLOSE_FILE", "SEEK", "GET_SEEK", "READ_FILE", "WRITE_FILE", "COMMIT",
+    "READ_AT", "WRITE_AT", "BATCH"
+};
+
+// rough figures for an SD card behind an AVR: anything that touches the
+// FAT or a directory costs a few block reads, data commands cost about one
+// a compound order costs what its parts would, a batch what its orders do
+static uint32_t latency_us[SIM_COMMANDS] =
+{
+    [M_SD_INIT]            = 200000,
+    [M_SD_SHUTDOWN]        = 5000,
+    [M_SD_GET_SIZE]        = 2000,
+    [M_SD_OBJECT_EXISTS]   = 2000,
+    [M_SD_GET_FIRST_ENTRY] = 2000,
+    [M_SD_GET_NEXT_ENTRY]  = 500,
+    [M_SD_PUSH]            = 2000,
+    [M_SD_POP]             = 500,
+    [M_SD_MKDIR]           = 10000,
+    [M_SD_RMDIR]           = 10000,
+    [M_SD_DELETE]          = 10000,
+    [M_SD_OPEN_FILE]       = 3000,
+    [M_SD_CLOSE_FILE]      = 2000,
+    [M_SD_SEEK]            = 300,
+    [M_SD_GET_SEEK]        = 100,
+    [M_SD_READ_FILE]       = 1000,
+    [M_SD_WRITE_FILE]      = 1500,
+    [M_SD_COMMIT]          = 5000,
+    [M_SD_READ_AT]         = 1300,
+    [M_SD_WRITE_AT]        = 1800,
+    [M_SD_BATCH]           = 0
+};
+
+#define SIM_OPEN_FILES 8
+#define SIM_PATH_MAX   1024
+
+// each byte is 8 bits and an ack, at 400 kHz unless told otherwise
+static uint32_t ns_per_byte = 9000000 / 400;
+
+SimCardStats sim_card_stats;
+
+typedef struct sim_file
+{
+    bool open;
+    bool read_only;
+    FILE *f;
+    char path[SIM_PATH_MAX];
+    uint32_t position;
+    uint32_t size;
+} sim_file;
+
+static sim_file files[SIM_OPEN_FILES];
+
+static char root[SIM_PATH_MAX];
+static char cwd[SIM_PATH_MAX];   // the current directory, under root
+static bool mounted = false;
+
+// the listing that GET_FIRST_ENTRY takes and GET_NEXT_ENTRY walks through
+#define SIM_DIR_ENTRIES 256
+static char listing[SIM_DIR_ENTRIES][13];
+static uint16_t listing_count = 0;
+static uint16_t listing_next = 0;
+
+static uint8_t response[2 + 257];
+static bool response_ready = false;
+static uint64_t busy_us = 0;   // how long the order being carried out takes
+static uint64_t ready_at = 0;  // host_us when its response can be read
+
+static uint32_t orders_until_failure = 0;  // 0 if no failure is coming
+static bool powered = true;
+
+static uint32_t orders_until_loss = 0;  // 0 if no glitch is coming
+static uint32_t orders_to_lose = 0;
+static uint32_t orders_lost = 0;        // still to go in the current glitch
+
+static bool compound_orders = true;
+
+
+bool sim_card_mount (const char *directory)
+{
+    struct stat st;
+    if (strlen (directory) >= SIM_PATH_MAX / 2 ||
+        stat (directory, &st) != 0 || !S_ISDIR (st.st_mode))
+    {
+        return false;
+    }
+    
+    for (uint8_t i = 0; i < SIM_OPEN_FILES; i++)
+    {
+        if (files[i].open)
+            fclose (files[i].f);
+        files[i].open = false;
+    }
+    
+    strcpy (root, directory);
+    strcpy (cwd, directory);
+    mounted = false;
+    powered = true;
+    orders_until_failure = 0;
+    orders_until_loss = orders_lost = 0;
+    response_ready = false;
+    listing_count = listing_next = 0;
+    return true;
+}
+
+bool sim_card_set_latency (const char *command, uint32_t us)
+{
+    for (uint8_t i = 0; i < SIM_COMMANDS; i++)
+    {
+        if (strcmp (command, command_name[i]) == 0)
+        {
+            latency_us[i] = us;
+            return true;
+        }
+    }
+    return false;
+}
+
+void sim_card_set_bus_khz (uint32_t khz)
+{
+    if (khz > 0)
+        ns_per_byte = 9000000 / khz;
+}
+
+void sim_card_set_compound (bool understood)
+{
+    compound_orders = understood;
+}
+
+void sim_card_fail_after (uint32_t orders)
+{
+    orders_until_failure = orders;
+}
+
+void sim_card_lose_orders (uint32_t orders, uint32_t count)
+{
+    orders_until_loss = orders;
+    orders_to_lose = count;
+    if (orders == 0)
+        orders_lost = 0;
+}
+
+// a transfer is the address byte and then the message
+static void charge_bus (uint32_t bytes)
+{
+    const uint64_t ns = (uint64_t)(bytes + 1) * ns_per_byte;
+    
+    sim_card_stats.bus_bytes += bytes + 1;
+    sim_card_stats.bus_us += ns / 1000;
+    host_advance (ns / 1000);
+}
+
+
+//-----------------------------------------------
+// Names:
+
+static bool valid_name_char (char c)
+{
+    return isalnum ((unsigned char)c) || strchr ("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+// upper-case an 8.3 name, false if it isn't one
+// directories get no extension
+static bool normalize_name (const char *name, char out[13], bool directory)
+{
+    const char *dot = strchr (name, '.');
+    const size_t base = dot ? (size_t)(dot - name) : strlen (name);
+    const size_t ext = dot ? strlen (dot + 1) : 0;
+    
+    if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0) || (directory && dot))
+        return false;
+    
+    size_t i;
+    for (i = 0; name[i] != '\0'; i++)
+    {
+        if (name + i != dot && !valid_name_char (name[i]))
+            return false;
+        out[i] = toupper ((unsigned char)name[i]);
+    }
+    out[i] = '\0';
+    return true;
+}
+
+// the name as it's stored in a directory entry: "TEST.TXT" is "TEST    TXT"
+static void name_to_fs (const char *name, uint8_t out[11])
+{
+    memset (out, ' ', 11);
+    
+    const char *dot = strchr (name, '.');
+    const size_t base = dot ? (size_t)(dot - name) : strlen (name);
+    memcpy (out, name, base);
+    if (dot)
+        memcpy (out + 8, dot + 1, strlen (dot + 1));
+}
+
+// find the entry in the current directory that the (normalized) name means,
+// and fill in its path; false if there isn't one, in which case the path
+// is where it would be created
+static bool find_entry (const char *name, char path[SIM_PATH_MAX], bool *is_directory)
+{
+    snprintf (path, SIM_PATH_MAX, "%s/%s", cwd, name);
+    
+    DIR *dir = opendir (cwd);
+    if (dir == NULL)
+        return false;
+    
+    bool found = false;
+    struct dirent *entry;
+    while (!found && (entry = readdir (dir)) != NULL)
+    {
+        if (strcasecmp (entry->d_name, name) != 0)
+            continue;
+        
+        snprintf (path, SIM_PATH_MAX, "%s/%s", cwd, entry->d_name);
+        found = true;
+    }
+    closedir (dir);
+    
+    if (found && is_directory != NULL)
+    {
+        struct stat st;
+        *is_directory = (stat (path, &st) == 0 && S_ISDIR (st.st_mode));
+    }
+    return found;
+}
+
+static int compare_names (const void *a, const void *b)
+{
+    return strcmp ((const char*)a, (const char*)b);
+}
+
+static void take_listing (void)
+{
+    listing_count = listing_next = 0;
+    
+    DIR *dir = opendir (cwd);
+    if (dir == NULL)
+        return;
+    
+    struct dirent *entry;
+    while (listing_count < SIM_DIR_ENTRIES && (entry = readdir (dir)) != NULL)
+    {
+        char path[SIM_PATH_MAX];
+        struct stat st;
+        snprintf (path, sizeof (path), "%s/%s", cwd, entry->d_name);
+        if (stat (path, &st) != 0)
+            continue;
+        
+        if (normalize_name (entry->d_name, listing[listing_count], S_ISDIR (st.st_mode)))
+            listing_count++;
+    }
+    closedir (dir);
+    
+    // readdir's order depends on the host filesystem, the card's shouldn't
+    qsort (listing, listing_count, sizeof (listing[0]), compare_names);
+}
+
+
+//-----------------------------------------------
+// Files:
+
+static sim_file *open_file_at (const char *path)
+{
+    for (uint8_t i = 0; i < SIM_OPEN_FILES; i++)
+    {
+        if (files[i].open && strcmp (files[i].path, path) == 0)
+            return &files[i];
+    }
+    return NULL;
+}
+
+static sim_file *file_for_id (uint8_t file_id, m_sd_errors *error)
+{
+    if (file_id >= SIM_OPEN_FILES)
+    {
+        *error = ERROR_FAT32_BAD_FILE_ID;
+        return NULL;
+    }
+    if (!files[file_id].open)
+    {
+        *error = ERROR_FAT32_NOT_OPEN;
+        return NULL;
+    }
+    return &files[file_id];
+}
+
+static void close_file (sim_file *file)
+{
+    fclose (file->f);
+    file->open = false;
+}
+
+
+//-----------------------------------------------
+// Commands:
+
+static void respond (m_sd_errors error, const uint8_t *data, uint8_t length)
+{
+    response[0] = (uint8_t)error;
+    response[1] = length;
+    if (length > 0)
+        memcpy (&response[2], data, length);
+    response_ready = true;
+}
+
+static void respond_u32 (uint32_t value)
+{
+    // little-endian, which is what both the M2 and M4 are
+    uint8_t data[4] = { value, value >> 8, value >> 16, value >> 24 };
+    respond (ERROR_NONE, data, 4);
+}
+
+static void respond_entry (void)
+{
+    uint8_t data[17];
+    memset (data, 0, sizeof (data));
+    
+    if (listing_next >= listing_count)
+    {  // end of the directory
+        respond (ERROR_NONE, data, 6);
+        return;
+    }
+    
+    const char *name = listing[listing_next++];
+    char path[SIM_PATH_MAX];
+    bool is_directory = false;
+    struct stat st;
+    uint32_t size = 0;
+    if (find_entry (name, path, &is_directory) && !is_directory && stat (path, &st) == 0)
+        size = (uint32_t)st.st_size;
+    
+    data[0] = 1;
+    data[1] = size >> 24;  // the size goes big-endian here, see m_microsd.c
+    data[2] = size >> 16;
+    data[3] = size >> 8;
+    data[4] = size;
+    data[5] = is_directory;
+    name_to_fs (name, &data[6]);
+    respond (ERROR_NONE, data, 17);
+}
+
+static void open_command (const uint8_t *data)
+{
+    const open_option action = (open_option)data[0];
+    char name[13], path[SIM_PATH_MAX];
+    bool is_directory = false;
+    
+    if (!normalize_name ((const char*)&data[1], name, false))
+    {
+        respond (ERROR_FAT32_INVALID_NAME, NULL, 0);
+        return;
+    }
+    
+    const bool exists = find_entry (name, path, &is_directory);
+    if (exists && is_directory)
+    {
+        respond (ERROR_FAT32_NOT_FILE, NULL, 0);
+        return;
+    }
+    if (!exists && action != CREATE_FILE)
+    {
+        respond (ERROR_FAT32_NOT_FOUND, NULL, 0);
+        return;
+    }
+    if (open_file_at (path) != NULL)
+    {
+        respond (ERROR_FAT32_ALREADY_OPEN, NULL, 0);
+        return;
+    }
+    
+    uint8_t id;
+    for (id = 0; id < SIM_OPEN_FILES && files[id].open; id++)
+    {}
+    if (id == SIM_OPEN_FILES)
+    {
+        respond (ERROR_FAT32_TOO_MANY_FILES, NULL, 0);
+        return;
+    }
+    
+    sim_file *file = &files[id];
+    file->f = fopen (path, (action == CREATE_FILE) ? "w+b" : (action == READ_FILE) ? "rb" : "r+b");
+    if (file->f == NULL)
+    {
+        respond (ERROR_UNKNOWN, NULL, 0);
+        return;
+    }
+    
+    fseek (file->f, 0, SEEK_END);
+    file->open = true;
+    file->read_only = (action == READ_FILE);
+    file->size = (uint32_t)ftell (file->f);
+    file->position = (action == APPEND_FILE) ? file->size : 0;
+    strcpy (file->path, path);
+    
+    respond (ERROR_NONE, &id, 1);
+}
+
+static void read_command (const uint8_t *data)
+{
+    m_sd_errors error;
+    sim_file *file = file_for_id (data[0], &error);
+    const uint8_t length = data[1];
+    
+    if (file == NULL)
+    {
+        respond (error, NULL, 0);
+        return;
+    }
+    if (file->position + length > file->size)
+    {
+        respond (ERROR_FAT32_TOO_FAR, NULL, 0);
+        return;
+    }
+    
+    uint8_t buffer[256];
+    fseek (file->f, file->position, SEEK_SET);
+    if (fread (buffer, 1, length, file->f) != length)
+    {
+        respond (ERROR_UNKNOWN, NULL, 0);
+        return;
+    }
+    
+    file->position += length;
+    sim_card_stats.bytes_read += length;
+    respond (ERROR_NONE, buffer, length);
+}
+
+static void write_command (const uint8_t *data, uint8_t data_length)
+{
+    m_sd_errors error;
+    sim_file *file = file_for_id (data[0], &error);
+    const uint8_t length = data_length - 1;
+    
+    if (file == NULL)
+    {
+        respond (error, NULL, 0);
+        return;
+    }
+    if (data_length == 0)
+    {
+        respond (ERROR_UNKNOWN, NULL, 0);
+        return;
+    }
+    if (file->read_only)
+    {
+        respond (ERROR_FAT32_FILE_READ_ONLY, NULL, 0);
+        return;
+    }
+    
+    fseek (file->f, file->position, SEEK_SET);
+    if (fwrite (&data[1], 1, length, file->f) != length)
+    {
+        respond (ERROR_FAT32_FULL, NULL, 0);
+        return;
+    }
+    
+    // straight through to the directory, so it can be checked at any point
+    fflush (file->f);
+    
+    file->position += length;
+    if (file->position > file->size)
+        file->size = file->position;
+    sim_card_stats.bytes_written += length;
+    respond (ERROR_NONE, NULL, 0);
+}
+
+static void seek_command (const uint8_t *data)
+{
+    m_sd_errors error;
+    sim_file *file = file_for_id (data[0], &error);
+    const uint32_t offset = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+    
+    if (file == NULL)
+        respond (error, NULL, 0);
+    else if (offset == FILE_END_POS)
+    {
+        file->position = file->size;
+        respond (ERROR_NONE, NULL, 0);
+    }
+    else if (offset > file->size)
+        respond (ERROR_FAT32_TOO_FAR, NULL, 0);
+    else
+    {
+        file->position = offset;
+        respond (ERROR_NONE, NULL, 0);
+    }
+}
+
+// seek, then carry out the rest of the order if that worked
+static void read_at_command (const uint8_t *data, uint8_t data_length)
+{
+    if (data_length != 6)
+    {
+        respond (ERROR_UNKNOWN, NULL, 0);
+        return;
+    }
+    
+    seek_command (data);
+    if (response[0] != ERROR_NONE)
+        return;
+    
+    const uint8_t read[2] = { data[0], data[5] };
+    read_command (read);
+}
+
+static void write_at_command (const uint8_t *data, uint8_t data_length)
+{
+    if (data_length < 5)
+    {
+        respond (ERROR_UNKNOWN, NULL, 0);
+        return;
+    }
+    
+    seek_command (data);
+    if (response[0] != ERROR_NONE)
+        return;
+    
+    uint8_t write[256];
+    write[0] = data[0];
+    memcpy (&write[1], &data[5], data_length - 5);
+    write_command (write, data_length - 4);
+}
+
+// everything that names something in the current directory
+static void name_command (uint8_t command, const char *given)
+{
+    const bool directory_name = (command == M_SD_PUSH || command == M_SD_MKDIR || command == M_SD_RMDIR);
+    char name[13], path[SIM_PATH_MAX];
+    bool is_directory = false;
+    
+    if (!normalize_name (given, name, directory_name))
+    {
+        respond (ERROR_FAT32_INVALID_NAME, NULL, 0);
+        return;
+    }
+    
+    const bool exists = find_entry (name, path, &is_directory);
+    
+    switch (command)
+    {
+        case M_SD_GET_SIZE:
+        {
+            struct stat st;
+            if (!exists)
+                respond (ERROR_FAT32_NOT_FOUND, NULL, 0);
+            else if (is_directory)
+                respond (ERROR_FAT32_NOT_FILE, NULL, 0);
+            else if (stat (path, &st) != 0)
+                respond (ERROR_UNKNOWN, NULL, 0);
+            else
+            {
+                const sim_file *file = open_file_at (path);
+                respond_u32 (file != NULL ? file->size : (uint32_t)st.st_size);
+            }
+            break;
+        }
+        
+        case M_SD_OBJECT_EXISTS:
+        {
+            const uint8_t data[2] = { exists, is_directory };
+            respond (ERROR_NONE, data, 2);
+            break;
+        }
+        
+        case M_SD_PUSH:
+            if (!exists)
+                respond (ERROR_FAT32_NOT_FOUND, NULL, 0);
+            else if (!is_directory)
+                respond (ERROR_FAT32_NOT_DIR, NULL, 0);
+            else if (strlen (path) >= SIM_PATH_MAX - 16)
+                respond (ERROR_UNKNOWN, NULL, 0);
+            else
+            {
+                strcpy (cwd, path);
+                respond (ERROR_NONE, NULL, 0);
+            }
+            break;
+        
+        case M_SD_MKDIR:
+            if (exists)
+                respond (ERROR_FAT32_ALREADY_EXISTS, NULL, 0);
+            else if (mkdir (path, 0777) != 0)
+                respond (ERROR_FAT32_FULL, NULL, 0);
+            else
+                respond (ERROR_NONE, NULL, 0);
+            break;
+        
+        case M_SD_RMDIR:
+            if (!exists)
+                respond (ERROR_FAT32_NOT_FOUND, NULL, 0);
+            else if (!is_directory)
+                respond (ERROR_FAT32_NOT_DIR, NULL, 0);
+            else if (rmdir (path) != 0)
+                respond (ERROR_FAT32_NOT_EMPTY, NULL, 0);
+            else
+                respond (ERROR_NONE, NULL, 0);
+            break;
+        
+        case M_SD_DELETE:
+        {
+            if (!exists)
+            {
+                respond (ERROR_FAT32_NOT_FOUND, NULL, 0);
+                break;
+            }
+            if (is_directory)
+            {
+                respond (ERROR_FAT32_NOT_FILE, NULL, 0);
+                break;
+            }
+            
+            sim_file *file = open_file_at (path);
+            if (file != NULL)
+                close_file (file);
+            
+            respond (unlink (path) == 0 ? ERROR_NONE : ERROR_UNKNOWN, NULL, 0);
+            break;
+        }
+    }
+}
+
+// the card works while the clock runs on; its response can't be read
+// until it's done
+static void take_time (uint8_t command)
+{
+    if (command < SIM_COMMANDS)
+    {
+        sim_card_stats.bus_us += latency_us[command];
+        busy_us += latency_us[command];
+    }
+}
+
+static void carry_out (const uint8_t *order);
+
+// carry out each order in turn until one fails, collecting their responses
+static void batch_command (const uint8_t *data, uint8_t data_length)
+{
+    uint8_t collected[255];
+    uint8_t used = 0;
+    m_sd_errors error = ERROR_NONE;
+    
+    for (uint16_t at = 0; at < data_length && error == ERROR_NONE; at += 2 + data[at + 1])
+    {
+        const uint8_t *order = &data[at];
+        if (at + 2 > data_length || at + 2 + order[1] > data_length ||
+            order[0] == M_SD_BATCH || order[0] == M_SD_INIT)
+        {
+            error = ERROR_UNKNOWN;
+            break;
+        }
+        
+        carry_out (order);
+        take_time (order[0]);
+        
+        if (used + 2 + response[1] > sizeof (collected))
+        {
+            error = ERROR_I2C_MESSAGE_TOO_LONG;
+            break;
+        }
+        memcpy (&collected[used], response, 2 + response[1]);
+        used += 2 + response[1];
+        error = (m_sd_errors)response[0];
+    }
+    
+    respond (error, collected, used);
+}
+
+static void carry_out (const uint8_t *order)
+{
+    const uint8_t command = order[0];
+    const uint8_t data_length = order[1];
+    const uint8_t *data = &order[2];
+    
+    // names arrive null-terminated, but don't trust that
+    char name[257];
+    memcpy (name, data, data_length);
+    name[data_length] = '\0';
+    
+    // older firmware doesn't know the compound orders
+    if (command >= SIM_COMMANDS || (command > M_SD_COMMIT && !compound_orders))
+    {
+        respond (ERROR_UNKNOWN, NULL, 0);
+        return;
+    }
+    
+    if (command == M_SD_INIT)
+    {
+        mounted = true;
+        strcpy (cwd, root);
+        respond (ERROR_NONE, NULL, 0);
+        return;
+    }
+    
+    if (!mounted)
+    {
+        respond (ERROR_FAT32_INIT, NULL, 0);
+        return;
+    }
+    
+    m_sd_errors error;
+    sim_file *file;
+    
+    switch (command)
+    {
+        case M_SD_SHUTDOWN:
+            for (uint8_t i = 0; i < SIM_OPEN_FILES; i++)
+            {
+                if (files[i].open)
+                    close_file (&files[i]);
+            }
+            mounted = false;
+            respond (ERROR_NONE, NULL, 0);
+            break;
+        
+        case M_SD_COMMIT:
+            for (uint8_t i = 0; i < SIM_OPEN_FILES; i++)
+            {
+                if (files[i].open)
+                    fflush (files[i].f);
+            }
+            respond (ERROR_NONE, NULL, 0);
+            break;
+        
+        case M_SD_GET_FIRST_ENTRY:
+            take_listing();
+            respond_entry();
+            break;
+        
+        case M_SD_GET_NEXT_ENTRY:
+            respond_entry();
+            break;
+        
+        case M_SD_POP:
+            if (strcmp (cwd, root) == 0)
+                respond (ERROR_FAT32_AT_ROOT, NULL, 0);
+            else
+            {
+                *strrchr (cwd, '/') = '\0';
+                respond (ERROR_NONE, NULL, 0);
+            }
+            break;
+        
+        case M_SD_GET_SIZE:
+        case M_SD_OBJECT_EXISTS:
+        case M_SD_PUSH:
+        case M_SD_MKDIR:
+        case M_SD_RMDIR:
+        case M_SD_DELETE:
+            name_command (command, name);
+            break;
+        
+        case M_SD_OPEN_FILE:
+            open_command ((const uint8_t*)name);
+            break;
+        
+        case M_SD_CLOSE_FILE:
+            file = file_for_id (data[0], &error);
+            if (file == NULL)
+                respond (error, NULL, 0);
+            else
+            {
+                close_file (file);
+                respond (ERROR_NONE, NULL, 0);
+            }
+            break;
+        
+        case M_SD_SEEK:
+            seek_command (data);
+            break;
+        
+        case M_SD_GET_SEEK:
+            file = file_for_id (data[0], &error);
+            if (file == NULL)
+                respond (error, NULL, 0);
+            else
+                respond_u32 (file->position);
+            break;
+        
+        case M_SD_READ_FILE:
+            read_command (data);
+            break;
+        
+        case M_SD_WRITE_FILE:
+            write_command (data, data_length);
+            break;
+        
+        case M_SD_READ_AT:
+            read_at_command (data, data_length);
+            break;
+        
+        case M_SD_WRITE_AT:
+            write_at_command (data, data_length);
+            break;
+        
+        case M_SD_BATCH:
+            batch_command (data, data_length);
+            break;
+    }
+}
+
+void sim_card_order (const uint8_t *order)
+{
+    sim_card_stats.orders++;
+    charge_bus (2 + order[1]);
+    
+    if (!powered)
+        return;
+    if (orders_until_failure > 0 && --orders_until_failure == 0)
+    {
+        powered = false;
+        response_ready = false;
+        return;
+    }
+    if (orders_until_loss > 0 && --orders_until_loss == 0)
+        orders_lost = orders_to_lose;
+    if (orders_lost > 0)
+    {
+        orders_lost--;
+        response_ready = false;
+        return;
+    }
+    
+    busy_us = 0;
+    carry_out (order);
+    take_time (order[0]);
+    ready_at = host_us + busy_us;
+}
+
+bool sim_card_response (uint8_t *out, uint8_t room)
+{
+    if (!response_ready || host_us < ready_at)
+    {
+        charge_bus (0);  // NACKed after the address
+        return false;
+    }
+    
+    const uint8_t length = (response[1] < room) ? response[1] : room;
+    
+    response_ready = false;
+    charge_bus (2 + length);
+    memcpy (out, response, 2 + length);
+    return true;
+}
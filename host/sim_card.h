@@ -0,0 +1,64 @@
+/*
+sim_card.h
+
+A simulated mMicroSD for the host build.  It speaks the same command
+protocol as the real one (see m_microsd.c), but keeps the card's files in a
+directory on the PC, and charges the simulated clock for the time each
+transfer would spend on the bus.  Each command takes as long on the card as
+it would on the real one, and asking for its response before then is NACKed.
+*/
+
+#ifndef SIM_CARD_H
+#define SIM_CARD_H
+
+#include "host.h"
+
+// the directory that plays the card's root
+// the simulated card starts unmounted, like a real one after power-up
+bool sim_card_mount (const char *directory);
+
+// hand over an order, as [command, data length, data...]
+void sim_card_order (const uint8_t *order);
+
+// collect the response to the last order, as [code, data length, data...]
+// false if there was no order to answer or the card is still carrying it
+// out, which costs the address byte on the bus like a real NACK
+// only the header and up to room bytes of data are read, like a read of
+// fixed length on the real bus, though the header still gives the full length
+bool sim_card_response (uint8_t *response, uint8_t room);
+
+// how long the card takes to carry out a command, in microseconds
+// command is the name without the M_SD_ prefix, eg. "READ_FILE"
+bool sim_card_set_latency (const char *command, uint32_t us);
+
+// the bus speed, which sets how long each byte takes to move
+void sim_card_set_bus_khz (uint32_t khz);
+
+// whether the card understands the compound orders (READ_AT, WRITE_AT and
+// BATCH, see m_microsd.c), as it does unless told otherwise; turning them
+// off plays the older firmware that doesn't
+void sim_card_set_compound (bool understood);
+
+// cut the card's power as the orders-th order from now arrives: neither it
+// nor anything after is carried out or answered until the next
+// sim_card_mount(), though whatever was written before stays written
+void sim_card_fail_after (uint32_t orders);
+
+// lose count orders, starting with the orders-th from now, the way a glitch
+// on the bus would: they're neither carried out nor answered, but the card
+// stays powered and carries on as usual with the orders after them; (0, 0)
+// calls off a glitch, along with any of it still in progress
+void sim_card_lose_orders (uint32_t orders, uint32_t count);
+
+typedef struct SimCardStats
+{
+    uint32_t orders;      // command/response round trips
+    uint64_t bus_bytes;   // every byte on the bus, addresses and headers included
+    uint64_t bytes_read;  // file data read from and written to the card
+    uint64_t bytes_written;
+    uint64_t bus_us;      // simulated time spent on the bus and in the card
+} SimCardStats;
+
+extern SimCardStats sim_card_stats;
+
+#endif
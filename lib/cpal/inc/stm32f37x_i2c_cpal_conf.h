@@ -411,8 +411,8 @@
 /* Transfer UserCallbacks : To use a Transfer callback comment the relative define */
 #define CPAL_I2C_TX_UserCallback        (void)
 #define CPAL_I2C_RX_UserCallback        (void)
-#define CPAL_I2C_TXTC_UserCallback      (void)
-#define CPAL_I2C_RXTC_UserCallback      (void)
+//#define CPAL_I2C_TXTC_UserCallback      (void)
+//#define CPAL_I2C_RXTC_UserCallback      (void)
 
 /* DMA Transfer UserCallbacks : To use a DMA Transfer UserCallbacks comment the relative define */
 #define CPAL_I2C_DMATXTC_UserCallback   (void)
@@ -451,9 +451,12 @@
 #define _CPAL_TIMEOUT_DEINIT()         SysTick->CTRL = 0        /*<! Disable the systick timer */
 
 
-#define CPAL_I2C_TIMEOUT_Manager       SysTick_Handler         /*<! This callback is used to handle Timeout error.
+/*#define CPAL_I2C_TIMEOUT_Manager       SysTick_Handler*/       /*<! This callback is used to handle Timeout error.
                                                                      When a timeout occurs CPAL_TIMEOUT_UserCallback
-                                                                     is called to handle this error */
+                                                                     is called to handle this error.
+                                                                     SysTick_Handler (stm32f37x_it.c) also keeps
+                                                                     the millisecond tick, so it calls the manager
+                                                                     under its own name instead */
 #ifndef CPAL_I2C_TIMEOUT_Manager
    void CPAL_I2C_TIMEOUT_Manager(void);
 #else   
@@ -6,6 +6,7 @@
 //-----------------------------------------------------------------------------
 
 #include "mBus.h"
+#include "trace.h"
 
 /* Initialize TX Transfer structure */
 CPAL_TransferTypeDef  mBusRx = { 
@@ -21,10 +22,47 @@ CPAL_TransferTypeDef  mBusTx = {
                         0};
 
 uint8_t bufferWr[2],bufferRd[2];
-uint8_t bufferBurstWr[256],bufferBurstRd[256];
 extern CPAL_InitTypeDef mBusStruct;
 __IO uint8_t mBusReadBurstReady=0, mBusReadBurstStartFlag=0;
 
+// bursts go straight between the caller's data and the bus, with no copy
+static uint8_t *mBusReadBurstBuffer = pNULL;
+
+/*=========== Link speed ===========*/
+
+// the speed mBusInit() sets up, and the errors seen at it so far
+static volatile mBusSpeed mBusCurrentSpeed = MBUS_FAST;
+static volatile uint32_t mBusErrorsAtSpeed = 0;
+
+volatile mBusLinkStats mBusStats;
+
+static const uint32_t mBusTimings[] = {
+  [MBUS_STANDARD]  = I2C_Timing_Standard,
+  [MBUS_FAST]      = I2C_Timing_FastMode,
+  [MBUS_FAST_PLUS] = I2C_Timing_FastModePlus
+};
+
+void mBusSetSpeed(mBusSpeed speed)
+{
+  mBusCurrentSpeed = speed;
+  mBusErrorsAtSpeed = 0;
+  mBusInit();
+}
+
+mBusSpeed mBusGetSpeed(void)
+{
+  return mBusCurrentSpeed;
+}
+
+uint32_t mBusSpeedKHz(mBusSpeed speed)
+{
+  if(speed == MBUS_FAST_PLUS)
+    {return 1000;}
+  else if(speed == MBUS_FAST)
+    {return 400;}
+  return 100;
+}
+
 void mBusInit(void)
 {
 	RCC_I2CCLKConfig(RCC_I2C1CLK_SYSCLK);
@@ -37,8 +75,20 @@ void mBusInit(void)
 	mBusStruct.pCPAL_TransferTx = &mBusTx;
 	mBusStruct.pCPAL_TransferRx = &mBusRx;
 	mBusStruct.wCPAL_Options = CPAL_OPT_I2C_AUTOMATIC_END;
-	mBusStruct.pCPAL_I2C_Struct->I2C_Timing = I2C_Timing_FastMode;
-	mBusStruct.pCPAL_I2C_Struct->I2C_AnalogFilter = I2C_AnalogFilter_Enable;
+	mBusStruct.pCPAL_I2C_Struct->I2C_Timing = mBusTimings[mBusCurrentSpeed];
+	// the FM+ timing assumes the analog filter is off (see mGeneral.h), and
+	// the pins need their 20 mA Fast-mode Plus drive
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	if(mBusCurrentSpeed == MBUS_FAST_PLUS)
+	{
+		mBusStruct.pCPAL_I2C_Struct->I2C_AnalogFilter = I2C_AnalogFilter_Disable;
+		SYSCFG_I2CFastModePlusConfig(SYSCFG_I2CFastModePlus_I2C1, ENABLE);
+	}
+	else
+	{
+		mBusStruct.pCPAL_I2C_Struct->I2C_AnalogFilter = I2C_AnalogFilter_Enable;
+		SYSCFG_I2CFastModePlusConfig(SYSCFG_I2CFastModePlus_I2C1, DISABLE);
+	}
 	mBusStruct.pCPAL_I2C_Struct->I2C_DigitalFilter = 0x00;
 	mBusStruct.pCPAL_I2C_Struct->I2C_Mode = I2C_Mode_I2C;
 	mBusStruct.pCPAL_I2C_Struct->I2C_OwnAddress1 = 0x00;
@@ -116,14 +166,9 @@ uint8_t mBusRead(uint8_t slaveAddr, uint8_t regAddr)
 }
 uint8_t mBusWriteBurst(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_t *data)
 {
-	uint8_t i;
-	for(i=0;i<length;i++)
-	{
-		bufferBurstWr[i] = data[i];	
-	}
 	mBusStruct.pCPAL_TransferTx = &mBusTx; 
   mBusStruct.pCPAL_TransferTx->wNumData = length;
- 	mBusStruct.pCPAL_TransferTx->pbBuffer = bufferBurstWr ;
+ 	mBusStruct.pCPAL_TransferTx->pbBuffer = data;
   mBusStruct.pCPAL_TransferTx->wAddr1   = (uint32_t)slaveAddr;
   mBusStruct.pCPAL_TransferTx->wAddr2   = (uint32_t)regAddr;
 
@@ -146,7 +191,7 @@ uint8_t mBusReadBurst(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_
 {
   mBusStruct.pCPAL_TransferRx = &mBusRx; 
   mBusStruct.pCPAL_TransferRx->wNumData = length;
-  mBusStruct.pCPAL_TransferRx->pbBuffer = bufferBurstRd ;
+  mBusStruct.pCPAL_TransferRx->pbBuffer = data;
   mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)slaveAddr;
   mBusStruct.pCPAL_TransferRx->wAddr2   = (uint32_t)regAddr;
 
@@ -158,10 +203,6 @@ uint8_t mBusReadBurst(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_
       mBusStruct.CPAL_State = CPAL_STATE_READY;
       return ERROR;
     }
-    for(uint8_t i=0;i<length;i++)
-    {
-      data[i] = bufferBurstRd[i]; 
-    }
     return SUCCESS;
   }
   else
@@ -228,15 +269,10 @@ uint8_t mBusReadNoAdd(uint8_t slaveAddr)
 }
 uint8_t mBusWriteBurstNoAdd(uint8_t slaveAddr, uint8_t length, uint8_t *data)
 {
-  uint8_t i;
-  for(i=0;i<length;i++)
-  {
-    bufferBurstWr[i] = data[i]; 
-  }
   mBusStruct.wCPAL_Options |= CPAL_OPT_NO_MEM_ADDR;
   mBusStruct.pCPAL_TransferTx = &mBusTx; 
   mBusStruct.pCPAL_TransferTx->wNumData = length;
-  mBusStruct.pCPAL_TransferTx->pbBuffer = bufferBurstWr ;
+  mBusStruct.pCPAL_TransferTx->pbBuffer = data;
   mBusStruct.pCPAL_TransferTx->wAddr1   = (uint32_t)slaveAddr;
 
   if(CPAL_I2C_Write(&mBusStruct) == CPAL_PASS)
@@ -262,7 +298,7 @@ uint8_t mBusReadBurstNoAdd(uint8_t slaveAddr, uint8_t length, uint8_t *data)
   mBusStruct.wCPAL_Options |= CPAL_OPT_NO_MEM_ADDR;
   mBusStruct.pCPAL_TransferRx = &mBusRx; 
   mBusStruct.pCPAL_TransferRx->wNumData = length;
-  mBusStruct.pCPAL_TransferRx->pbBuffer = bufferBurstRd ;
+  mBusStruct.pCPAL_TransferRx->pbBuffer = data;
   mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)slaveAddr;
 
   if(CPAL_I2C_Read(&mBusStruct) == CPAL_PASS)
@@ -275,10 +311,6 @@ uint8_t mBusReadBurstNoAdd(uint8_t slaveAddr, uint8_t length, uint8_t *data)
       return ERROR;
     }
     mBusStruct.wCPAL_Options &= ~CPAL_OPT_NO_MEM_ADDR;
-    for(uint8_t i=0;i<length;i++)
-    {
-      data[i] = bufferBurstRd[i]; 
-    }
     return SUCCESS;
   }
   else
@@ -290,14 +322,9 @@ uint8_t mBusReadBurstNoAdd(uint8_t slaveAddr, uint8_t length, uint8_t *data)
 
 uint8_t mBusWriteBurstNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_t *data)
 {
-  uint8_t i;
-  for(i=0;i<length;i++)
-  {
-    bufferBurstWr[i] = data[i]; 
-  }
   mBusStruct.pCPAL_TransferTx = &mBusTx; 
   mBusStruct.pCPAL_TransferTx->wNumData = length;
-  mBusStruct.pCPAL_TransferTx->pbBuffer = bufferBurstWr ;
+  mBusStruct.pCPAL_TransferTx->pbBuffer = data;
   mBusStruct.pCPAL_TransferTx->wAddr1   = (uint32_t)slaveAddr;
   mBusStruct.pCPAL_TransferTx->wAddr2   = (uint32_t)regAddr;
 
@@ -310,11 +337,12 @@ uint8_t mBusWriteBurstNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uin
     return ERROR;
   }
 }
-uint8_t mBusReadBurstStartNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length)
+uint8_t mBusReadBurstStartNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_t *data)
 {
+	mBusReadBurstBuffer = data;
 	mBusStruct.pCPAL_TransferRx = &mBusRx; 
   mBusStruct.pCPAL_TransferRx->wNumData = length;
- 	mBusStruct.pCPAL_TransferRx->pbBuffer = bufferBurstRd ;
+ 	mBusStruct.pCPAL_TransferRx->pbBuffer = data;
   mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)slaveAddr;
   mBusStruct.pCPAL_TransferRx->wAddr2   = (uint32_t)regAddr;
 
@@ -332,10 +360,14 @@ uint8_t mBusReadBurstDataNB(uint8_t length, uint8_t* data)
 {
 	if(mBusReadBurstReady)
 	{
-		for(uint8_t i=0;i<length;i++)
-    {
-      data[i] = bufferBurstRd[i]; 
-    }
+		// only a copy if it's wanted somewhere else than it was read to
+		if(data != mBusReadBurstBuffer)
+		{
+			for(uint8_t i=0;i<length;i++)
+			{
+				data[i] = mBusReadBurstBuffer[i];
+			}
+		}
 		mBusReadBurstReady = 0;
     mBusReadBurstStartFlag=0;
 		return SUCCESS;
@@ -357,16 +389,33 @@ uint32_t CPAL_TIMEOUT_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
     	mWait(800000);  	
     }
 	mBusRestart();*/
+    mBusStats.timeouts++;
     mBusStruct.CPAL_State = CPAL_STATE_READY;
   	return CPAL_PASS;
 }
 
 /*=========== Transfer UserCallback ===========*/
 
-//void CPAL_I2C_TXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
-//{ }
-//void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
-//{ }
+// called from interrupt context whenever a transfer ends, one way or another
+static void (*mBusTransferCallback)(void) = NULL;
+
+void mBusSetTransferCallback(void (*callback)(void))
+{
+  mBusTransferCallback = callback;
+}
+
+void CPAL_I2C_TXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
+{
+  trace(TRACE_I2C_DONE, 0);
+  if(mBusTransferCallback != NULL)
+    {mBusTransferCallback();}
+}
+void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
+{
+  trace(TRACE_I2C_DONE, 1);
+  if(mBusTransferCallback != NULL)
+    {mBusTransferCallback();}
+}
 //void CPAL_I2C_TX_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
 //{ } //
 //void CPAL_I2C_RX_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
@@ -379,7 +428,7 @@ uint32_t CPAL_TIMEOUT_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
 //{ }
 void CPAL_I2C_DMARXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
 {
-  if(mBusReadBurstStartFlag = 1)
+  if(mBusReadBurstStartFlag == 1)
 		{mBusReadBurstReady = 1;}
 }
 //void CPAL_I2C_DMARXHT_UserCallback(CPAL_InitTypeDef* pDevInitStruct)
@@ -392,7 +441,30 @@ volatile uint32_t mBusErrorCode = CPAL_I2C_ERR_NONE;
 void CPAL_I2C_ERR_UserCallback(CPAL_DevTypeDef pDevInstance, uint32_t DeviceError)
 {
     mBusErrorCode = DeviceError;
+    trace(TRACE_I2C_ERROR, (uint16_t)DeviceError);
+    
+    // a NACK is a slave saying no, which is the protocol working; anything
+    // else is the link itself failing, and enough of that at one speed
+    // drops the bus to the next slower one
+    if(DeviceError == CPAL_I2C_ERR_AF)
+    {
+      mBusStats.nacks++;
+    }
+    else
+    {
+      mBusStats.bus_errors++;
+      if(++mBusErrorsAtSpeed >= MBUS_ERRORS_BEFORE_FALLBACK && mBusCurrentSpeed > MBUS_STANDARD)
+      {
+        mBusCurrentSpeed--;
+        mBusErrorsAtSpeed = 0;
+        mBusStats.fallbacks++;
+      }
+    }
+    
+    mBusStats.restarts++;
 	mBusRestart();
+  if(mBusTransferCallback != NULL)
+    {mBusTransferCallback();}
 }
 
 // return and clear the most recent error code
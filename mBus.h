@@ -27,6 +27,48 @@
 */
 uint32_t mBusGetLastError (void);
 
+/*
+    Link speed:
+    
+    mBusInit() (and mBusRestart()) set the bus up at the current speed, which
+    is Fast-mode (400 kHz) until mBusSetSpeed() changes it; mBusSetSpeed()
+    re-initializes the bus straight away.  Fast-mode Plus (1 MHz) needs
+    pull-ups strong enough for it, so a driver should check the link works
+    before settling on it (m_sd_init() does).
+    
+    Once MBUS_ERRORS_BEFORE_FALLBACK bus errors (anything but a NACK) have
+    been seen at one speed, the bus drops to the next slower one by itself.
+*/
+typedef enum
+{
+  MBUS_STANDARD,   // 100 kHz
+  MBUS_FAST,       // 400 kHz
+  MBUS_FAST_PLUS   // 1 MHz
+} mBusSpeed;
+
+#define MBUS_ERRORS_BEFORE_FALLBACK 4
+
+void mBusSetSpeed(mBusSpeed speed);
+mBusSpeed mBusGetSpeed(void);
+uint32_t mBusSpeedKHz(mBusSpeed speed);
+
+/*
+    mBusStats:
+    
+    What has gone wrong on the bus since startup, counted from the CPAL error
+    and timeout callbacks.  Every error restarts the bus.
+*/
+typedef struct
+{
+  uint32_t nacks;       // CPAL_I2C_ERR_AF, eg. a response that isn't ready
+  uint32_t bus_errors;  // CPAL_I2C_ERR_BERR, _ARLO and _OVR
+  uint32_t timeouts;    // CPAL_TIMEOUT_UserCallback()
+  uint32_t restarts;    // mBusRestart() after an error
+  uint32_t fallbacks;   // drops to a slower speed after bus errors
+} mBusLinkStats;
+
+extern volatile mBusLinkStats mBusStats;
+
 void mBusInit(void);
 void mBusRestart(void);
 
@@ -45,14 +87,20 @@ uint8_t mBusWriteBurstNoAdd(uint8_t slaveAddr, uint8_t length, uint8_t* data);
 uint8_t mBusReadBurstNoAdd (uint8_t slaveAddr, uint8_t length, uint8_t* data);
 
 //Non Blocking functions, user takes care of waiting and other stuff 
+//The transfer callback runs in interrupt context at the end of every transfer
+//(successful or not), so a driver can start its next transfer from there
+//Bursts are moved by DMA straight from and to data, so for these data has to
+//stay put until the transfer is over; mBusReadBurstStartNB() reads into data,
+//and mBusReadBurstDataNB() only copies if it's given a different buffer
+void mBusSetTransferCallback(void (*callback)(void));
 uint8_t mBusWriteBurstNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_t* data);
-uint8_t mBusReadBurstStartNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length);
+uint8_t mBusReadBurstStartNB(uint8_t slaveAddr, uint8_t regAddr, uint8_t length, uint8_t* data);
 uint8_t mBusReadBurstDataNB (uint8_t length, uint8_t* data);
 
 void CPAL_I2C_ERR_UserCallback(CPAL_DevTypeDef pDevInstance, uint32_t DeviceError);
 uint32_t CPAL_TIMEOUT_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
-//void CPAL_I2C_TXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
-//void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
+void CPAL_I2C_TXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
+void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
 //void CPAL_I2C_TX_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
 //void CPAL_I2C_RX_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
 //void CPAL_I2C_DMATXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct);
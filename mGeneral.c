@@ -7,6 +7,16 @@
 
 #include "mGeneral.h"
 
+volatile uint32_t mTickCount = 0;
+
+typedef struct
+{
+	void (*job)(void);
+	mDeadline due;
+} mDeferredJob;
+
+static mDeferredJob deferred[M_DEFERRED_JOBS];
+
 void mInit(void)
 {
 	GPIO_InitTypeDef GPIO_InitStructure;
@@ -50,6 +60,61 @@ void mInit(void)
 	mRedOFF;
 	mBlueOFF;
 	mWhiteOFF;
+
+	// start the cycle counter for mCycles() and the waits
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void mWait(uint32_t cycles)
+{
+	const uint32_t start = mCycles();
+	while((uint32_t)(mCycles() - start) < cycles);
+}
+
+void mWaitus(uint32_t us)
+{
+	// in chunks, so a long wait can't overflow the cycle count
+	while(us > 1000)
+	{
+		mWait(SystemCoreClock / 1000);
+		us -= 1000;
+	}
+	mWait(us * (SystemCoreClock / 1000000));
+}
+
+void mWaitms(uint32_t ms)
+{
+	while(ms-- > 0)
+		mWait(SystemCoreClock / 1000);
+}
+
+ErrorStatus mDefer(void (*job)(void), uint32_t ms)
+{
+	for(uint8_t i = 0; i < M_DEFERRED_JOBS; i++)
+	{
+		if(deferred[i].job == 0)
+		{
+			deferred[i].due = mMsDeadline(ms);
+			deferred[i].job = job;
+			return SUCCESS;
+		}
+	}
+	return ERROR;
+}
+
+void mRunDeferred(void)
+{
+	for(uint8_t i = 0; i < M_DEFERRED_JOBS; i++)
+	{
+		if(deferred[i].job != 0 && mMsPassed(deferred[i].due))
+		{
+			// free the slot first, so the job can schedule itself again
+			void (*job)(void) = deferred[i].job;
+			deferred[i].job = 0;
+			job();
+		}
+	}
 }
 
 
@@ -119,16 +119,47 @@
 						else if(val==TOGGLE){mWhiteTOGGLE;}
 
 // -----------------------------------------------------------------------------
-// Wait for a specified number of clock cycles: 
+// Time base:
 // -----------------------------------------------------------------------------
-// val can between 1 to (2^32-1) 
-// and the number clock cycles wasted will be 4 * val
-#define mWait(val)   do{register uint32_t i;for(i=0;i<val;++i)\
-		__asm__ __volatile__ ("nop\n\t":::"memory");} while(0);
-#define mWaitus(val) do{register uint32_t i;for(i=0;i<(val*18);++i)\
-		__asm__ __volatile__ ("nop\n\t":::"memory");} while(0);
-#define mWaitms(val) do{register uint32_t i;for(i=0;i<(val*18000);++i)\
-		__asm__ __volatile__ ("nop\n\t":::"memory");} while(0);						
+// SysTick interrupts every 1 ms once mBusInit() has set it up (CPAL uses it
+// for its I2C timeouts), and SysTick_Handler counts the ticks here.
+// The count wraps after ~49 days, so compare times by subtracting them.
+extern volatile uint32_t mTickCount;
+#define mMillis()	(mTickCount)
+
+// the core's DWT cycle counter, started by mInit(); wraps every ~60 s
+#define mCycles()	(DWT->CYCCNT)
+
+// Deadlines: take one with mMsDeadline() or mUsDeadline(), then check it
+// with the matching mMsPassed() or mUsPassed().  Millisecond deadlines can
+// be up to ~24 days away, microsecond ones up to ~29 s.
+typedef uint32_t mDeadline;
+#define mMsDeadline(ms)	((mDeadline)(mMillis() + (ms)))
+#define mMsPassed(d)	((int32_t)(mMillis() - (d)) >= 0)
+#define mUsDeadline(us)	((mDeadline)(mCycles() + (us) * (SystemCoreClock / 1000000)))
+#define mUsPassed(d)	((int32_t)(mCycles() - (d)) >= 0)
+
+// -----------------------------------------------------------------------------
+// Waiting:
+// -----------------------------------------------------------------------------
+// These count the cycle counter rather than loop iterations, so they don't
+// drift with the optimization level or the interrupt load.  An interrupt
+// can only make them run long, never short.
+void mWait(uint32_t cycles);
+void mWaitus(uint32_t us);
+void mWaitms(uint32_t ms);
+
+// -----------------------------------------------------------------------------
+// Deferred work:
+// -----------------------------------------------------------------------------
+// Run a function once ms milliseconds have passed.  Jobs only run from
+// mRunDeferred(), never from an interrupt, and that's called whenever the
+// program is waiting for input (see _read() in mUSB.c and the editor's idle
+// loop), so a job must not wait for input itself.
+// Returns ERROR if all M_DEFERRED_JOBS slots are taken.
+#define M_DEFERRED_JOBS 4
+ErrorStatus mDefer(void (*job)(void), uint32_t ms);
+void mRunDeferred(void);
 
 // -----------------------------------------------------------------------------
 // M4 Board Initialization and mBus Setup:
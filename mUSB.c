@@ -7,6 +7,8 @@
 //-----------------------------------------------------------------------------
 
 #include "mUSB.h"
+#include "perf.h"
+#include "trace.h"
 #include "stdio.h"
 
 #define VCOMPORT_IN_FRAME_INTERVAL             5
@@ -30,10 +32,8 @@ __IO uint32_t wCNTR=0;
 ErrorStatus HSEStartUpStatus;
 EXTI_InitTypeDef EXTI_InitStructure;
 __IO uint8_t Send_Buffer[VIRTUAL_COM_PORT_DATA_SIZE] ;
-uint32_t Receive_length;
 
 // extern __IO uint32_t packet_sent;
-// extern __IO uint32_t packet_receive;
 
 
 uint8_t Request = 0;
@@ -46,7 +46,6 @@ LINE_CODING linecoding =
     0x08    /* no. of bits 8*/
   };
 
-uint8_t Receive_Buffer[64];
 uint32_t Send_length;
 
 
@@ -63,60 +62,146 @@ void USBWakeUp_IRQHandler(void)
 /*=========== Minimal System Call Implementation for newlib ===========*/
 
 __IO uint32_t packet_sent=1;
-__IO uint32_t packet_receive=0 ;
+static __IO bool port_open = FALSE;  // the host has raised DTR
 char *__env[1] = { 0 };
 char **environ = __env;
 
-int _write(int file, char *ptr, int len)
+// output goes into a ring here and _write() returns straight away; the ring
+// is drained into EP1 a packet at a time from EP1_IN_Callback, and EP1 is
+// double-buffered, so the next packet is already sitting in the PMA when the
+// host comes back for it.  Packets are only sent full (63 bytes, so a
+// transfer always ends on a short packet) unless mUSBFlush() asks for the rest
+//
+// Of the two buffers, DTOG_TX is the one the USB sends from and SW_BUF
+// (DTOG_RX) is ours; when they're equal both are ours and the endpoint NAKs.
+// So the USB only ever gets one packet at a time: the next is loaded into
+// our buffer while it sends, and handed over from EP1_IN_Callback once the
+// USB is done with its own
+#define TX_RING_SIZE  512  // power of two
+#define TX_PACKET_MAX (VIRTUAL_COM_PORT_DATA_SIZE - 1)
+#define TX_TIMEOUT_MS 20   // a full ring that doesn't move in this long has no reader
+
+static uint8_t tx_ring[TX_RING_SIZE];
+static __IO uint16_t tx_head = 0;    // written by _write()
+static __IO uint16_t tx_tail = 0;    // written by load_tx_packet()
+static __IO uint16_t tx_loaded = 0;  // bytes waiting in our EP1 buffer
+static __IO bool tx_flush = FALSE;   // send a short packet for the remainder
+
+static uint16_t tx_pending(void)
+{
+  return (tx_head - tx_tail) & (TX_RING_SIZE - 1);
+}
+
+// the USB has a packet it hasn't sent yet
+static bool tx_busy(void)
+{
+  const uint16_t ep = GetENDPOINT(ENDP1);
+  return ((ep & EP_DTOG_TX) != 0) != ((ep & EP_DTOG_RX) != 0);
+}
+
+// copy the next packet into our EP1 buffer, if one is due
+// called from the USB interrupt, or with it masked
+static bool load_tx_packet(void)
 {
-  if(bDeviceState == CONFIGURED)
+  uint16_t length = tx_pending();
+  if(length == 0)
   {
-    uint32_t timeout=180000;
-    while((!packet_sent) && timeout--){}
-    if(timeout)
-    {
-      if(len>63)
-      {
-        uint8_t packetNo,finalPacket,i;
-        packetNo    = len/64;
-        finalPacket = len;
-        for(i=0;i<packetNo;i++)
-        {
-          CDC_Send_DATA(ptr,63);
-          finalPacket -= 63;
-          ptr += 63;
-          timeout=180000;
-          while(packet_sent==0 && timeout--);
-          if(timeout==0)
-          { 
-            bDeviceState = UNCONNECTED;
-            return len;
-          }
-        }
-        CDC_Send_DATA(ptr,finalPacket);
-        return len;
-      }
-      else
-      {
-        CDC_Send_DATA(ptr,len);
-        return len;
-      }  
-    }
-    else 
-    {
-      return -1;
-    }
+    tx_flush = FALSE;
+    return FALSE;
   }
+  if(length > TX_PACKET_MAX)
+    length = TX_PACKET_MAX;
+  else if(length < TX_PACKET_MAX && !tx_flush)
+    return FALSE;
+
+  uint16_t addr = (GetENDPOINT(ENDP1) & EP_DTOG_RX) ? ENDP1_BUF1ADDR : ENDP1_TXADDR;
+  uint8_t packet[TX_PACKET_MAX];
+  for(uint16_t i=0; i<length; i++)
+  {
+    packet[i] = tx_ring[tx_tail];
+    tx_tail = (tx_tail + 1) & (TX_RING_SIZE - 1);
+  }
+  UserToPMABufferCopy(packet, addr, length);
+  if(addr == ENDP1_TXADDR)
+    SetEPDblBuf0Count(ENDP1, EP_DBUF_IN, length);
   else
+    SetEPDblBuf1Count(ENDP1, EP_DBUF_IN, length);
+  tx_loaded = length;
+  return TRUE;
+}
+
+// give the USB a packet if it has none, and load the one after it
+// so it's ready when EP1_IN_Callback comes round
+static void start_tx(void)
+{
+  if(!tx_busy())
   {
+    if(tx_loaded == 0 && !load_tx_packet())
+      return;
+    FreeUserBuffer(ENDP1, EP_DBUF_IN);  // hand it over, SW_BUF moves to the other
+    tx_loaded = 0;
+    packet_sent = 0;
+  }
+  if(tx_loaded == 0)
+    load_tx_packet();
+}
+
+static void start_tx_from_main(void)
+{
+  NVIC_DisableIRQ(USB_LP_IRQn);
+  start_tx();
+  NVIC_EnableIRQ(USB_LP_IRQn);
+}
+
+static void reset_tx(void)
+{
+  tx_head = tx_tail = 0;
+  tx_loaded = 0;
+  tx_flush = FALSE;
+  packet_sent = 1;
+}
+
+static int untimed_write(char *ptr, int len)
+{
+  if(bDeviceState != CONFIGURED)
     return len;
+  for(int i=0; i<len; i++)
+  {
+    if(tx_pending() == TX_RING_SIZE - 1)
+    {  // full: wait for the host to take some
+      const mDeadline deadline = mMsDeadline(TX_TIMEOUT_MS);
+      start_tx_from_main();
+      while(tx_pending() == TX_RING_SIZE - 1 && !mMsPassed(deadline)){}
+      if(tx_pending() == TX_RING_SIZE - 1)
+      {
+        bDeviceState = UNCONNECTED;
+        return len;  // nobody is listening, drop the rest
+      }
+    }
+    tx_ring[tx_head] = ptr[i];
+    tx_head = (tx_head + 1) & (TX_RING_SIZE - 1);
   }
-  //return len;
-  /*while(packet_sent == 0){}
-  if(bDeviceState == CONFIGURED)
-      CDC_Send_DATA(ptr,len);
+  if(tx_pending() >= TX_PACKET_MAX)
+    start_tx_from_main();
+  return len;
+}
+int _write(int file, char *ptr, int len)
+{
+  const uint32_t start = PERF_START();
+  len = untimed_write(ptr, len);
+  perf_record(PERF_USB_WRITE, start);
   return len;
-*/
+}
+// push out everything printed so far
+// returns once it's all queued on the endpoint, not once it has been sent
+void mUSBFlush(void)
+{
+  fflush(stdout);
+  if(bDeviceState == CONFIGURED && tx_pending() > 0)
+  {
+    tx_flush = TRUE;
+    start_tx_from_main();
+  }
 }
 caddr_t _sbrk(int incr) 
 {
@@ -134,25 +219,63 @@ caddr_t _sbrk(int incr)
   heap_end += incr;
   return (caddr_t) prev_heap_end;
 }
+// input lands in a ring from EP3_OUT_Callback; EP3 is only re-armed while
+// the ring has room for a whole packet, so when we fall behind (eg. in the
+// middle of an SD transfer) the host gets NAKs and holds on to the rest
+// rather than us dropping it
+#define RX_RING_SIZE 256  // power of two
+
+static uint8_t rx_ring[RX_RING_SIZE];
+static __IO uint16_t rx_head = 0;    // written by EP3_OUT_Callback
+static __IO uint16_t rx_tail = 0;    // written by _read()
+static __IO bool rx_armed = TRUE;    // EP3 will take another packet
+
+static uint16_t rx_pending(void)
+{
+  return (rx_head - rx_tail) & (RX_RING_SIZE - 1);
+}
+
+static bool rx_has_room(void)
+{
+  return (RX_RING_SIZE - 1 - rx_pending()) >= VIRTUAL_COM_PORT_DATA_SIZE;
+}
+
+static void reset_rx(void)
+{
+  rx_head = rx_tail = 0;
+  rx_armed = TRUE;
+}
+
+// blocks until there's at least one byte, then returns what's there
 int _read(int file, __IO char *ptr, int len) 
 {
-  uint8_t rLen=0;
-  uint8_t *temp;
-  while(rLen<len)
+  int rLen=0;
+  if(len <= 0)
+    return 0;
+  if(rx_pending() == 0)
   {
-    while(!packet_receive);
-    CDC_Receive_DATA();
-    temp = Receive_Buffer;
-    for(u8 i=0; i<Receive_length; i++)
-    {
-      *ptr = *temp;
-      ptr++;
-      temp++;
-    }
-    rLen += Receive_length;
-//    printf("%d %d %x\r\n",Receive_length,len,*Receive_Buffer);
+    mUSBFlush();  // whatever was printed has to show before we wait
+    while(rx_pending() == 0)
+      mRunDeferred();
   }
-  return len;
+  while(rLen<len && rx_pending() > 0)
+  {
+    ptr[rLen++] = rx_ring[rx_tail];
+    rx_tail = (rx_tail + 1) & (RX_RING_SIZE - 1);
+  }
+  if(!rx_armed)
+    CDC_Receive_DATA();
+  return rLen;
+}
+// true when input is waiting, so a read won't block
+bool mUSBDataAvailable(void)
+{
+  return rx_pending() != 0;
+}
+// true once a terminal on the host has opened the port
+bool mUSBPortOpen(void)
+{
+  return port_open;
 }
 int _close(int file){return -1;}
 int _fstat(int file, struct stat *st) {st->st_mode = S_IFCHR; return 0;}
@@ -686,13 +809,28 @@ void USB_Istr(void)
 
 void EP1_IN_Callback (void)
 {
-  packet_sent = 1;
+  // the USB's buffer is ours again, so the packet loaded in the other goes
+  start_tx();
+  if(!tx_busy())
+    packet_sent = 1;
+  trace(TRACE_USB_IN, tx_pending());
 }
 void EP3_OUT_Callback(void)
 {
-  packet_receive = 1;
-  Receive_length = GetEPRxCount(ENDP3);
-  PMAToUserBufferCopy((unsigned char*)Receive_Buffer, ENDP3_RXADDR, Receive_length);
+  uint8_t packet[VIRTUAL_COM_PORT_DATA_SIZE];
+  uint16_t length = GetEPRxCount(ENDP3);
+  PMAToUserBufferCopy(packet, ENDP3_RXADDR, length);
+  trace(TRACE_USB_OUT, length);
+  for(uint16_t i=0; i<length; i++)
+  {
+    rx_ring[rx_head] = packet[i];
+    rx_head = (rx_head + 1) & (RX_RING_SIZE - 1);
+  }
+  // the endpoint NAKs from here until it's re-armed
+  if(rx_has_room())
+    SetEPRxValid(ENDP3);
+  else
+    rx_armed = FALSE;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -770,6 +908,8 @@ void Virtual_Com_Port_init(void)
 
 void Virtual_Com_Port_Reset(void)
 {
+  port_open = FALSE;
+
   /* Set Virtual_Com_Port DEVICE as not configured */
   pInformation->Current_Configuration = 0;
 
@@ -790,11 +930,16 @@ void Virtual_Com_Port_Reset(void)
   SetEPRxCount(ENDP0, Device_Property.MaxPacketSize);
   SetEPRxValid(ENDP0);
 
-  /* Initialize Endpoint 1 */
+  /* Initialize Endpoint 1, double-buffered: it NAKs while both buffers are ours */
   SetEPType(ENDP1, EP_BULK);
-  SetEPTxAddr(ENDP1, ENDP1_TXADDR);
-  SetEPTxStatus(ENDP1, EP_TX_NAK);
+  SetEPDoubleBuff(ENDP1);
+  SetEPDblBuffAddr(ENDP1, ENDP1_TXADDR, ENDP1_BUF1ADDR);
+  SetEPDblBuffCount(ENDP1, EP_DBUF_IN, 0);
+  ClearDTOG_RX(ENDP1);
+  ClearDTOG_TX(ENDP1);
   SetEPRxStatus(ENDP1, EP_RX_DIS);
+  SetEPTxStatus(ENDP1, EP_TX_VALID);
+  reset_tx();
 
   /* Initialize Endpoint 2 */
   SetEPType(ENDP2, EP_INTERRUPT);
@@ -808,6 +953,7 @@ void Virtual_Com_Port_Reset(void)
   SetEPRxCount(ENDP3, VIRTUAL_COM_PORT_DATA_SIZE);
   SetEPRxStatus(ENDP3, EP_RX_VALID);
   SetEPTxStatus(ENDP3, EP_TX_DIS);
+  reset_rx();
 
   /* Set this device to response on default address */
   SetDeviceAddress(0);
@@ -880,6 +1026,7 @@ RESULT Virtual_Com_Port_NoData_Setup(uint8_t RequestNo)
     }
     else if (RequestNo == SET_CONTROL_LINE_STATE)
     {
+      port_open = (pInformation->USBwValue0 & 0x01) ? TRUE : FALSE;  // DTR
       return USB_SUCCESS;
     }
   }
@@ -993,7 +1140,7 @@ void mUSBInit(void)
   NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
   NVIC_Init(&NVIC_InitStructure);
 
-  setvbuf(stdout, (char *)0, _IOLBF, 256);
+  setvbuf(stdout, (char *)0, _IOFBF, 256);  // flushed by mUSBFlush()
   setvbuf(stdin , (char *)0, _IONBF, 0);
   setvbuf(stderr, (char *)0, _IOLBF, 256);
 
@@ -1060,12 +1207,13 @@ uint32_t CDC_Send_DATA (uint8_t *ptrBuffer, uint8_t Send_length)
 {
   if(Send_length < VIRTUAL_COM_PORT_DATA_SIZE)     
   {
-    /*Sent flag*/
-    packet_sent = 0;
-    /* send  packet to PMA*/
-    UserToPMABufferCopy((unsigned char*)ptrBuffer, ENDP1_TXADDR, Send_length);
-    SetEPTxCount(ENDP1, Send_length);
-    SetEPTxValid(ENDP1);
+    /* queue it behind anything already printed and send it now */
+    _write(1, (char*)ptrBuffer, Send_length);
+    if(tx_pending() > 0)
+    {
+      tx_flush = TRUE;
+      start_tx_from_main();
+    }
   }
   else
   {
@@ -1073,10 +1221,15 @@ uint32_t CDC_Send_DATA (uint8_t *ptrBuffer, uint8_t Send_length)
   } 
   return 1;
 }
+// re-arm EP3 once _read() has made room for another packet
 uint32_t CDC_Receive_DATA(void)
 { 
-  /*Receive flag*/
-  packet_receive = 0;
-  SetEPRxValid(ENDP3); 
-  return 1 ;
+  NVIC_DisableIRQ(USB_LP_IRQn);
+  if(!rx_armed && rx_has_room())
+  {
+    rx_armed = TRUE;
+    SetEPRxValid(ENDP3); 
+  }
+  NVIC_EnableIRQ(USB_LP_IRQn);
+  return rx_armed;
 }
@@ -40,6 +40,7 @@
 #define ENDP1_TXADDR        (0xC0)
 #define ENDP2_TXADDR        (0x100)
 #define ENDP3_RXADDR        (0x110)
+#define ENDP1_BUF1ADDR      (0x150)  // second EP1 buffer, ENDP1_TXADDR is the first
 /*-------------------------------------------------------------*/
 /* -------------------   ISTR events  -------------------------*/
 /*-------------------------------------------------------------*/
@@ -243,5 +244,8 @@ void USB_Cable_Config(FunctionalState NewState);
 void Get_SerialNum(void);
 uint32_t CDC_Send_DATA (uint8_t *ptrBuffer, uint8_t Send_length);
 uint32_t CDC_Receive_DATA(void);
+bool mUSBDataAvailable(void);
+bool mUSBPortOpen(void);
+void mUSBFlush(void);
 
 #endif
@@ -32,6 +32,11 @@ typedef enum m_microsd_command_type
     M_SD_WRITE_FILE,
     M_SD_COMMIT,
     
+    // compound orders, see "compound orders" below
+    M_SD_READ_AT,
+    M_SD_WRITE_AT,
+    M_SD_BATCH,
+    
     M_SD_NONE = 255
 } m_microsd_command_type;
 
@@ -56,8 +61,127 @@ union m_sd_transmission
 } transmission;
 
 m_sd_errors m_sd_error_code;
+uint32_t m_sd_round_trips = 0;
+bool m_sd_compound_orders;
+
+uint32_t m_sd_early_polls = 0;
+
+// a WRITE_AT frame carries the offset as well as the file id
+#define M_SD_MAX_WRITE_AT_LENGTH (M_SD_MAX_WRITE_LENGTH - 4)
+
+
+//------------------------------------------------------------------------------
+// framed transfers
+//
+// A file transfer's frame is a few bytes of header and then the payload,
+// which is the caller's data.  Rather than copying the payload through
+// transmission, the header can go into the bytes just in front of it, so
+// that the DMA moves the whole frame straight out of the caller's buffer, or
+// the response straight into it.  Whatever the header covers is saved first
+// and put back after.
+//
+// That only works where those bytes are free to borrow for the length of the
+// transfer.  Within a stream they're the tail of the frame before, which has
+// already gone; in front of the first frame they're only there if the caller
+// says so (the room argument, see M_SD_FRAME_HEADROOM in m_microsd.h).  A
+// frame without them is copied as before, and so is everything on the M2,
+// which moves every byte by hand anyway.
+
+#if defined(M4) || defined(HOST)
+#define FRAMED_TRANSFERS 1
+#else
+#define FRAMED_TRANSFERS 0
+#endif
+
+#define FRAME_HEADER_MAX 7  // WRITE_AT's command, length, file id and offset
+
+// where the next order goes out from and its response comes in to: the
+// transmission union, unless the frame is in the caller's buffer
+static i2c_command  *order_frame = &transmission.order;
+static i2c_response *response_frame = &transmission.response;
+
+typedef struct framing
+{
+    uint8_t *at;  // where the frame starts, in the caller's buffer
+    uint8_t  length;
+    uint8_t  saved[FRAME_HEADER_MAX];
+} framing;
+
+// borrow the header bytes in front of payload, returns the frame
+static uint8_t *frame_around (framing *frame, uint8_t *payload, uint8_t header)
+{
+    frame->at = payload - header;
+    frame->length = header;
+    for (uint8_t i = 0; i < header; i++)
+        frame->saved[i] = frame->at[i];
+    return frame->at;
+}
+
+static void unframe (const framing *frame)
+{
+    for (uint8_t i = 0; i < frame->length; i++)
+        frame->at[i] = frame->saved[i];
+}
+
+
+#if defined(M4) || defined(HOST)
+//------------------------------------------------------------------------------
+// response timing
+//
+// The mMicroSD NACKs a read of its response until the response is ready, so
+// every look that comes too early costs a transfer on the bus, and every one
+// that comes late adds to the wait.  Each command keeps a running estimate
+// of how long the card takes over it (an average weighted 1/4 towards the
+// latest round trip), and the first look is timed for just before then.  If
+// the response isn't ready, the looks that follow start a few microseconds
+// apart and back off exponentially, so a quick GET_SEEK is answered in well
+// under a millisecond and a long COMMIT is only asked a handful of times.
+// The card was done somewhere between the last look it NACKed and the one
+// it answered, so the midpoint is what's learned.
+
+#define RESPONSE_TIMEOUT_MS 1000  // how long the mMicroSD gets to answer
+
+#define M_SD_COMMANDS      (M_SD_BATCH + 1)
+#define POLL_FIRST_US_MIN  20     // the soonest a first look is ever made
+#define POLL_STEP_US_MIN   25     // the wait after the first miss,
+#define POLL_STEP_US_MAX   4000   // doubling after every miss up to this
+
+static uint32_t expected_us[M_SD_COMMANDS];  // 0 until one has been timed
+
+static uint8_t order_command;  // the order waiting for its response
+
+// how long after the order to make the first look
+static uint32_t poll_first_us (uint8_t command)
+{
+    if (command >= M_SD_COMMANDS || expected_us[command] == 0)
+        return POLL_FIRST_US_MIN;
+    
+    // a little early, so the estimate can come down as well as go up
+    const uint32_t us = expected_us[command] - expected_us[command] / 32;
+    return (us > POLL_FIRST_US_MIN) ? us : POLL_FIRST_US_MIN;
+}
 
+// the wait after a miss, given the wait after the last one
+static uint32_t poll_next_us (uint32_t wait_us)
+{
+    wait_us *= 2;
+    return (wait_us < POLL_STEP_US_MAX) ? wait_us : POLL_STEP_US_MAX;
+}
 
+// the response to command wasn't ready missed_us after the order went out
+// (0 if the first look found it), but was found_us after
+static void learn_latency (uint8_t command, uint32_t missed_us, uint32_t found_us)
+{
+    if (command >= M_SD_COMMANDS)
+        return;
+    
+    const uint32_t us = (missed_us == 0) ? found_us : missed_us + (found_us - missed_us) / 2;
+    if (expected_us[command] == 0)
+        expected_us[command] = us;
+    else
+        expected_us[command] += ((int32_t)us - (int32_t)expected_us[command]) / 4;
+}
+#endif
 
 
 #if defined(M2)
@@ -143,6 +267,7 @@ static bool send_order (void)
 	
 	sei();  // re-enable errors
     
+    m_sd_round_trips++;
     m_sd_error_code = ERROR_NONE;
     return true;
 }
@@ -166,6 +291,7 @@ retry:
     {
         twi_stop();
         retries++;
+        m_sd_early_polls++;
         m_wait (MS_BETWEEN_RESPONSE_RETRIES);
         goto retry;
     }
@@ -186,11 +312,48 @@ retry:
     return true;
 }
 
+// the M2 reads exactly as much as the response header says, so there's
+// nothing to gain from knowing the length in advance
+static bool receive_response_expecting (uint8_t expected_length)
+{
+    return receive_response();
+}
+
+// there's no interrupt-driven I2C on the M2, so requests simply run to
+// completion as soon as they're queued
+static void queue_request (m_sd_request *request)
+{
+    request->state = M_SD_REQUEST_ACTIVE;
+    
+    bool ok = m_sd_seek (request->file_id, request->offset);
+    if (ok && request->write)
+        ok = m_sd_write_stream (request->file_id, request->length, request->buffer, &request->done);
+    else if (ok)
+        ok = m_sd_read_stream (request->file_id, request->length, request->buffer, &request->done);
+    
+    request->error = ok ? ERROR_NONE : m_sd_error_code;
+    request->state = ok ? M_SD_REQUEST_DONE : M_SD_REQUEST_FAILED;
+    
+    if (request->callback != NULL)
+        request->callback (request);
+}
+
+void m_sd_poll (void)
+{}
+
+bool m_sd_busy (void)
+{
+    return false;
+}
+
 //!   END OF M2-SPECIFIC I2C CODE !=============================================
 
 #elif defined(M4)
 
 //! START OF M4-SPECIFIC I2C CODE !=============================================
+#include "perf.h"
+#include "trace.h"
+
 extern CPAL_InitTypeDef      mBusStruct;
 extern CPAL_TransferTypeDef  mBusTx;
 extern CPAL_TransferTypeDef  mBusRx;
@@ -198,9 +361,6 @@ extern CPAL_TransferTypeDef  mBusRx;
 #define I2C_ADDR_WRITE ((0x5D) << 1)
 #define I2C_ADDR_READ  (((0x5D) << 1) | 1)
 
-#define MAX_RESPONSE_RETRIES        1000
-#define MS_BETWEEN_RESPONSE_RETRIES 1
-
 #define nop()  __asm__ __volatile__("nop")
 
 #ifndef false
@@ -211,6 +371,102 @@ extern CPAL_TransferTypeDef  mBusRx;
 #define true ((bool)1)
 #endif
 
+static uint32_t  order_sent;  // mCycles() when the order finished going out
+static uint32_t  look_sent;   // mCycles() when the latest look at it began
+static mDeadline first_look;  // when to start asking for its response
+
+// how long the card took, as far as can be told: the time to the look
+// that found the response, which leaves out moving the response itself
+static uint32_t us_to_look (void)
+{
+    return (look_sent - order_sent) / (SystemCoreClock / 1000000);
+}
+
+#ifdef M_SD_READY_IRQ
+//------------------------------------------------------------------------------
+// ready line, see m_microsd.h
+//
+// The card raises the line when a response is ready, and the interrupt just
+// notes it.  Looks at the response wait for that instead of the estimate,
+// but not for ever: if the edge never comes, polling takes over after a
+// while, so a card that doesn't drive the line still works, only slowly.
+
+#define READY_JOIN(a, b)  a##b
+#define READY_GLUE(a, b)  READY_JOIN(a, b)
+
+#define READY_LINE  ((uint32_t)1 << M_SD_READY_PIN)
+
+static volatile bool card_ready;
+
+void READY_GLUE (M_SD_READY_IRQ, _IRQHandler) (void)
+{
+    if (EXTI_GetITStatus (READY_LINE) != RESET)
+    {
+        EXTI_ClearITPendingBit (READY_LINE);
+        card_ready = true;
+    }
+}
+
+static void ready_line_init (void)
+{
+    GPIO_InitTypeDef gpio;
+    EXTI_InitTypeDef exti;
+    NVIC_InitTypeDef nvic;
+    
+    RCC_AHBPeriphClockCmd (READY_GLUE (RCC_AHBPeriph_GPIO, M_SD_READY_PORT), ENABLE);
+    RCC_APB2PeriphClockCmd (RCC_APB2Periph_SYSCFG, ENABLE);
+    
+    GPIO_StructInit (&gpio);
+    gpio.GPIO_Pin  = READY_LINE;
+    gpio.GPIO_Mode = GPIO_Mode_IN;
+    gpio.GPIO_PuPd = GPIO_PuPd_DOWN;
+    GPIO_Init (READY_GLUE (GPIO, M_SD_READY_PORT), &gpio);
+    
+    SYSCFG_EXTILineConfig (READY_GLUE (EXTI_PortSourceGPIO, M_SD_READY_PORT), M_SD_READY_PIN);
+    
+    exti.EXTI_Line    = READY_LINE;
+    exti.EXTI_Mode    = EXTI_Mode_Interrupt;
+    exti.EXTI_Trigger = EXTI_Trigger_Rising;
+    exti.EXTI_LineCmd = ENABLE;
+    EXTI_Init (&exti);
+    
+    nvic.NVIC_IRQChannel = READY_GLUE (M_SD_READY_IRQ, _IRQn);
+    nvic.NVIC_IRQChannelPreemptionPriority = 1;
+    nvic.NVIC_IRQChannelSubPriority = 0;
+    nvic.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init (&nvic);
+}
+
+// the order is about to go out, so any earlier edge was for something else
+#define ready_line_arm()  (card_ready = false)
+#define ready_line_up()   (card_ready)
+
+// how long to wait for the line before falling back to polling
+static uint32_t ready_line_patience_us (uint8_t command)
+{
+    return 4 * poll_first_us (command) + 2000;
+}
+
+#else
+
+#define ready_line_arm()
+#define ready_line_up()   (false)
+
+#endif
+
+// the order has gone out: note when, and work out when to look for its
+// response
+static void order_went_out (void)
+{
+    order_sent = mCycles();
+    
+    #ifdef M_SD_READY_IRQ
+    first_look = mUsDeadline (ready_line_patience_us (order_command));
+    #else
+    first_look = mUsDeadline (poll_first_us (order_command));
+    #endif
+}
+
 static bool i2c_write (void)
 {
     if (CPAL_I2C_Write (&mBusStruct) == CPAL_PASS)
@@ -268,8 +524,351 @@ static bool i2c_read (void)
     return true;
 }
 
-static bool send_order (void)
+//------------------------------------------------------------------------------
+// request queue
+//
+// A request goes out as a seek order followed by as many read or write frames
+// as it takes (with compound orders, the first frame does the seek itself).
+// Every transfer is started from the end-of-transfer interrupt of the one
+// before it, except for response retries: when the mMicroSD isn't ready it
+// NACKs the read, and the next try waits for m_sd_poll() so the retries are
+// spaced out like they are in receive_response_expecting().
+//
+// Ownership of the queue's state passes back and forth cleanly: the
+// interrupt only touches it while a transfer is in flight, and m_sd_poll()
+// only while one isn't.
+
+typedef enum request_phase
+{
+    PHASE_IDLE = 0,   // head of the queue hasn't started
+    PHASE_SEND,       // order on the bus
+    PHASE_RECEIVE,    // response on the bus
+    PHASE_RETRY,      // waiting to ask for the response again
+    PHASE_FINISHED    // waiting for m_sd_poll() to hand it back
+} request_phase;
+
+// the blocking calls keep using transmission, so they can fill it in before
+// waiting for the queue
+static union m_sd_transmission async_transmission;
+
+// after its first frame, a request's frames go in place around its own
+// buffer (see "framed transfers"), and the bytes they borrow are put back
+// before the next frame starts or the request finishes
+static i2c_response *async_response = &async_transmission.response;
+static framing async_frame;
+static bool    async_framed;
+
+static uint8_t *borrow (uint8_t *payload, uint8_t header)
+{
+    async_framed = true;
+    return frame_around (&async_frame, payload, header);
+}
+
+static void give_back (void)
+{
+    if (!async_framed)
+        return;
+    
+    unframe (&async_frame);
+    async_framed = false;
+    async_response = &async_transmission.response;
+}
+
+static m_sd_request *queue_head = NULL;
+static m_sd_request *queue_tail = NULL;
+
+static volatile request_phase phase = PHASE_IDLE;
+static bool     seeked;           // the head request's seek has gone through
+static uint8_t  frame_length;     // data bytes in the order on the bus
+static uint8_t  expected_length;  // data bytes the response should carry
+static mDeadline response_deadline;  // when the frame on the bus times out
+static mDeadline retry_deadline;     // when to ask for the response next
+static uint32_t retry_wait_us;       // how long the next miss waits
+static uint32_t missed_us;           // when the last NACKed look was made
+
+static void finish_request (m_sd_errors error)
+{
+    give_back();
+    queue_head->error = error;
+    phase = PHASE_FINISHED;
+}
+
+static void start_receive (void);
+
+static void start_order (void)
+{
+    m_sd_request *request = queue_head;
+    i2c_command *order = &async_transmission.order;
+    
+    give_back();
+    
+    // with compound orders the seek rides along with the first frame
+    const bool seek_too = !seeked && m_sd_compound_orders && request->length > 0;
+    const uint8_t header = seek_too ? 5 : 1;  // file id, and the offset
+    
+    if (!seeked && !seek_too)
+    {
+        order->command = M_SD_SEEK;
+        order->data_length = 5;
+        order->data[0] = request->file_id;
+        uint32_t *offset_ptr = ((uint32_t*)&order->data[1]);
+        *offset_ptr = request->offset;
+    
+        frame_length = 0;
+        expected_length = 0;
+    }
+    else if (request->write)
+    {
+        uint32_t frame = request->length - request->done;
+        if (frame > M_SD_MAX_WRITE_LENGTH + 1 - header)
+            frame = M_SD_MAX_WRITE_LENGTH + 1 - header;
+    
+        const bool in_place = (request->done >= 2u + header);
+        if (in_place)
+            order = (i2c_command*)borrow (&request->buffer[request->done], 2 + header);
+    
+        order->command = seek_too ? M_SD_WRITE_AT : M_SD_WRITE_FILE;
+        order->data_length = frame + header;
+        order->data[0] = request->file_id;
+        if (seek_too)
+        {
+            uint32_t *offset_ptr = ((uint32_t*)&order->data[1]);
+            *offset_ptr = request->offset;
+        }
+        if (!in_place)
+        {
+            for (uint8_t i = 0; i < frame; i++)
+                order->data[i + header] = request->buffer[request->done + i];
+        }
+    
+        frame_length = frame;
+        expected_length = 0;
+    }
+    else
+    {
+        uint32_t frame = request->length - request->done;
+        if (frame > M_SD_MAX_READ_LENGTH)
+            frame = M_SD_MAX_READ_LENGTH;
+    
+        order->command = seek_too ? M_SD_READ_AT : M_SD_READ_FILE;
+        order->data_length = header + 1;
+        order->data[0] = request->file_id;
+        if (seek_too)
+        {
+            uint32_t *offset_ptr = ((uint32_t*)&order->data[1]);
+            *offset_ptr = request->offset;
+        }
+        order->data[header] = frame;
+    
+        if (request->done >= 2)
+            async_response = (i2c_response*)borrow (&request->buffer[request->done], 2);
+    
+        frame_length = frame;
+        expected_length = frame;
+    }
+    
+    if (seek_too)
+        seeked = true;  // so the response is taken as data
+    
+    response_deadline = mMsDeadline (RESPONSE_TIMEOUT_MS);
+    order_command = order->command;
+    ready_line_arm();
+    
+    mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
+    mBusStruct.pCPAL_TransferTx = &mBusTx;
+    mBusStruct.pCPAL_TransferTx->wNumData = 2 + order->data_length;
+    mBusStruct.pCPAL_TransferTx->pbBuffer = (uint8_t*)order;
+    mBusStruct.pCPAL_TransferTx->wAddr1   = (uint32_t)I2C_ADDR_WRITE;
+    
+    trace (TRACE_ORDER, (order->command << 8) | order->data_length);
+    
+    phase = PHASE_SEND;
+    if (CPAL_I2C_Write (&mBusStruct) != CPAL_PASS)
+        finish_request (ERROR_I2C_COMMAND);
+}
+
+static void retry_receive (void)
+{
+    if (mMsPassed (response_deadline))
+    {
+        finish_request (ERROR_I2C_RESPONSE_TIMEOUT);
+        return;
+    }
+    
+    retry_deadline = mUsDeadline (retry_wait_us);
+    retry_wait_us = poll_next_us (retry_wait_us);
+    phase = PHASE_RETRY;
+}
+
+static void start_receive (void)
+{
+    mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
+    mBusStruct.pCPAL_TransferRx = &mBusRx;
+    mBusStruct.pCPAL_TransferRx->wNumData = 2 + expected_length;
+    mBusStruct.pCPAL_TransferRx->pbBuffer = (uint8_t*)async_response;
+    mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)I2C_ADDR_READ;
+    
+    phase = PHASE_RECEIVE;
+    look_sent = mCycles();
+    if (CPAL_I2C_Read (&mBusStruct) != CPAL_PASS)
+        retry_receive();
+}
+
+static void handle_response (void)
+{
+    m_sd_request *request = queue_head;
+    const i2c_response *response = async_response;
+    
+    trace (TRACE_RESPONSE, (response->response_code << 8) | response->data_length);
+    learn_latency (order_command, missed_us, us_to_look());
+    
+    if (response->response_code != ERROR_NONE)
+    {
+        finish_request ((m_sd_errors)response->response_code);
+        return;
+    }
+    
+    if (response->data_length != expected_length)
+    {
+        finish_request (ERROR_I2C_COMMAND);
+        return;
+    }
+    
+    if (!seeked)
+        seeked = true;
+    else
+    {
+        if (!request->write && response == &async_transmission.response)
+        {
+            for (uint8_t i = 0; i < frame_length; i++)
+                request->buffer[request->done + i] = response->data[i];
+        }
+        request->done += frame_length;
+    }
+    
+    if (request->done == request->length)
+        finish_request (ERROR_NONE);
+    else
+        start_order();
+}
+
+// runs in interrupt context at the end of every I2C transfer
+static void bus_event (void)
+{
+    if (queue_head == NULL ||
+        (phase != PHASE_SEND && phase != PHASE_RECEIVE) ||
+        (mBusStruct.CPAL_State & CPAL_STATE_BUSY) != 0)
+    {  // not ours, or not over yet
+        return;
+    }
+    
+    const bool failed = (mBusStruct.CPAL_State == CPAL_STATE_ERROR ||
+                         mBusStruct.wCPAL_DevError != CPAL_I2C_ERR_NONE ||
+                         mBusGetLastError() != CPAL_I2C_ERR_NONE);
+    if (failed)
+        mBusStruct.CPAL_State = CPAL_STATE_READY;
+    
+    if (phase == PHASE_SEND)
+    {
+        if (failed)
+        {
+            finish_request (ERROR_I2C_COMMAND);
+            return;
+        }
+    
+        // m_sd_poll() asks for the response once the card should be done
+        m_sd_round_trips++;
+        order_went_out();
+        retry_deadline = first_look;
+        retry_wait_us = POLL_STEP_US_MIN;
+        missed_us = 0;
+        phase = PHASE_RETRY;
+    }
+    else
+    {
+        if (failed)
+        {  // usually a NACK, the response isn't ready yet
+            m_sd_early_polls++;
+            missed_us = us_to_look();
+            ready_line_arm();  // wait out the backoff, not the stale edge
+            retry_receive();
+        }
+        else
+            handle_response();
+    }
+}
+
+static void queue_request (m_sd_request *request)
+{
+    request->state = M_SD_REQUEST_QUEUED;
+    
+    if (queue_tail != NULL)
+        queue_tail->next = request;
+    else
+        queue_head = request;
+    queue_tail = request;
+    
+    m_sd_poll();  // start it right away if the bus is free
+}
+
+void m_sd_poll (void)
+{
+    if (queue_head == NULL)
+        return;
+    
+    if (phase == PHASE_FINISHED)
+    {
+        m_sd_request *request = queue_head;
+    
+        queue_head = request->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        request->next = NULL;
+        phase = PHASE_IDLE;
+    
+        request->state = (request->error == ERROR_NONE) ? M_SD_REQUEST_DONE
+                                                        : M_SD_REQUEST_FAILED;
+        if (request->callback != NULL)
+            request->callback (request);
+    
+        // the callback may have queued or waited on things itself
+        if (queue_head == NULL || phase != PHASE_IDLE)
+            return;
+    }
+    
+    if (phase == PHASE_IDLE)
+    {
+        if (mBusStruct.CPAL_State == CPAL_STATE_ERROR)
+            mBusStruct.CPAL_State = CPAL_STATE_READY;
+        else if (mBusStruct.CPAL_State != CPAL_STATE_READY)
+            return;  // try again next time
+    
+        seeked = false;
+        queue_head->state = M_SD_REQUEST_ACTIVE;
+        start_order();
+    }
+    else if (phase == PHASE_RETRY)
+    {
+        if (ready_line_up() || mUsPassed (retry_deadline))
+            start_receive();
+    }
+    else if ((mBusStruct.CPAL_State & CPAL_STATE_BUSY) == 0)
+    {  // a transfer ended without calling back (a CPAL timeout does that)
+        bus_event();
+    }
+}
+
+bool m_sd_busy (void)
+{
+    return (queue_head != NULL);
+}
+
+static bool untimed_send_order (void)
 {
+    // the blocking calls go after anything already queued
+    while (queue_head != NULL)
+        m_sd_poll();
+    
     if (mBusStruct.CPAL_State != CPAL_STATE_READY)
     {
         m_sd_error_code = ERROR_I2C_COMMAND;
@@ -279,26 +878,47 @@ static bool send_order (void)
     // send command type, data length, and data all in one go
     mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
     mBusStruct.pCPAL_TransferTx = &mBusTx; 
-    mBusStruct.pCPAL_TransferTx->wNumData = 2 + transmission.order.data_length;
-    mBusStruct.pCPAL_TransferTx->pbBuffer = (uint8_t*)&transmission.order;
+    mBusStruct.pCPAL_TransferTx->wNumData = 2 + order_frame->data_length;
+    mBusStruct.pCPAL_TransferTx->pbBuffer = (uint8_t*)order_frame;
     mBusStruct.pCPAL_TransferTx->wAddr1   = (uint32_t)I2C_ADDR_WRITE;
     
+    trace (TRACE_ORDER, (order_frame->command << 8) | order_frame->data_length);
+    
+    order_command = order_frame->command;
+    ready_line_arm();
+    
     if (!i2c_write())
     {
         m_sd_error_code = ERROR_I2C_COMMAND;
         return false;
     }
     
+    order_went_out();
+    m_sd_round_trips++;
     m_sd_error_code = ERROR_NONE;
     return true;
 }
 
-static bool receive_response (void)
+static bool send_order (void)
 {
-    uint16_t retries = 0;
+    const uint32_t start = PERF_START();
+    const bool sent = untimed_send_order();
+    perf_record (PERF_SEND_ORDER, start);
+    return sent;
+}
+
+static bool untimed_receive_response (uint8_t expected_length)
+{
+    const mDeadline deadline = mMsDeadline (RESPONSE_TIMEOUT_MS);
+    uint32_t wait_us = POLL_STEP_US_MIN;
+    uint32_t missed_us = 0;
+    
+    // nothing on the bus until the card should be about done
+    while (!ready_line_up() && !mUsPassed (first_look))
+    {}
     
 retry:
-    if (retries > MAX_RESPONSE_RETRIES)
+    if (mMsPassed (deadline))
     {
         m_sd_error_code = ERROR_I2C_RESPONSE_TIMEOUT;
         return false;
@@ -308,27 +928,34 @@ retry:
         mBusStruct.wCPAL_DevError != CPAL_I2C_ERR_NONE ||
         mBusGetLastError() != CPAL_I2C_ERR_NONE)
     {
-        retries++;
-        mWaitms (MS_BETWEEN_RESPONSE_RETRIES);
+        mWaitus (wait_us);
+        wait_us = poll_next_us (wait_us);
         goto retry;
     }
     
-    // receive command code and data length
+    // receive command code, data length, and the data we expect
     mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
     mBusStruct.pCPAL_TransferRx = &mBusRx; 
-    mBusStruct.pCPAL_TransferRx->wNumData = 2;
-    mBusStruct.pCPAL_TransferRx->pbBuffer = (uint8_t*)&transmission.response;
+    mBusStruct.pCPAL_TransferRx->wNumData = 2 + expected_length;
+    mBusStruct.pCPAL_TransferRx->pbBuffer = (uint8_t*)response_frame;
     mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)I2C_ADDR_READ;
     
+    look_sent = mCycles();
     if (!i2c_read())
     {
-        retries++;
-        mWaitms (MS_BETWEEN_RESPONSE_RETRIES);
+        m_sd_early_polls++;
+        missed_us = us_to_look();
+        mWaitus (wait_us);
+        wait_us = poll_next_us (wait_us);
         goto retry;
     }
     
-    // get data
-    if (transmission.response.data_length > 0)
+    learn_latency (order_command, missed_us, us_to_look());
+    
+    // get the rest of the data, unless the response is going straight into
+    // a buffer that only has room for what was expected
+    if (response_frame->data_length > expected_length &&
+        response_frame == &transmission.response)
     {
         mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
         mBusStruct.pCPAL_TransferRx = &mBusRx; 
@@ -343,38 +970,158 @@ retry:
         }
     }
     
+    trace (TRACE_RESPONSE, (response_frame->response_code << 8) | response_frame->data_length);
+    
     m_sd_error_code = ERROR_NONE;
     return true;
 }
+
+// expected_length is how much data we think the response will carry: the
+// header and that much data are fetched in one read, and a second read is
+// only needed if the response turns out to be longer
+static bool receive_response_expecting (uint8_t expected_length)
+{
+    const uint32_t start = PERF_START();
+    const bool received = untimed_receive_response (expected_length);
+    perf_record (PERF_RECEIVE_RESPONSE, start);
+    return received;
+}
+
+static bool receive_response (void)
+{
+    return receive_response_expecting (0);
+}
 //!   END OF M4-SPECIFIC I2C CODE !=============================================
 
-#else
- #error "Unknown device, you must define either M2 or M4 in the makefile"
-#endif
+#elif defined(HOST)
 
-// convert file names from their representation on disk
-// eg., "TEST    TXT" becomes "TEST.TXT"
-void filename_fs_to_8_3 (const char *input_name,
-                         char *output_name)
+//! START OF HOST-SPECIFIC CODE !===============================================
+// the host build (see host/) hands each order straight to a simulated
+// mMicroSD, which charges the simulated clock for the bus time it would take
+#include "host/sim_card.h"
+#include "perf.h"
+#include "trace.h"
+
+static uint64_t order_sent;  // host_us when the order finished going out
+
+static bool send_order (void)
 {
-    uint8_t in_index = 0;
-    uint8_t out_index = 0;
+    const uint32_t start = PERF_START();
     
-    bool wrote_dot = false;
+    trace (TRACE_ORDER, (order_frame->command << 8) | order_frame->data_length);
+    order_command = order_frame->command;
+    sim_card_order ((const uint8_t*)order_frame);
+    order_sent = host_us;
     
-    while (in_index < 11 && out_index < 11)
+    m_sd_round_trips++;
+    m_sd_error_code = ERROR_NONE;
+    perf_record (PERF_SEND_ORDER, start);
+    return true;
+}
+
+// the card is asked the way the M4 asks it: not until it should be about
+// done, and then less and less often
+//
+// the simulated bus moves exactly the bytes the response has, like the M2,
+// except into a framed buffer, which only has room for what was expected
+static bool receive_response_expecting (uint8_t expected_length)
+{
+    const uint32_t start = PERF_START();
+    const uint8_t room = (response_frame == &transmission.response) ? 255 : expected_length;
+    const uint64_t first_look = order_sent + poll_first_us (order_command);
+    uint32_t wait_us = POLL_STEP_US_MIN;
+    uint64_t look_sent;
+    uint32_t missed_us = 0;
+    
+    if (host_us < first_look)
+        host_advance (first_look - host_us);
+    
+    for (;;)
     {
-        if (in_index < 8)
+        look_sent = host_us;
+        if (sim_card_response ((uint8_t*)response_frame, room))
+            break;
+        
+        if (host_us - order_sent >= (uint64_t)RESPONSE_TIMEOUT_MS * 1000)
         {
-            if (input_name[in_index] == ' ')
-            {
-                in_index = 8;  // skip to the last 3 chars
-                continue;
-            }
-            else
-            {
-                output_name[out_index++] = input_name[in_index];
-            }
+            m_sd_error_code = ERROR_I2C_RESPONSE_TIMEOUT;
+            perf_record (PERF_RECEIVE_RESPONSE, start);
+            return false;
+        }
+        
+        m_sd_early_polls++;
+        missed_us = (uint32_t)(look_sent - order_sent);
+        host_advance (wait_us);
+        wait_us = poll_next_us (wait_us);
+    }
+    learn_latency (order_command, missed_us, (uint32_t)(look_sent - order_sent));
+    trace (TRACE_RESPONSE, (response_frame->response_code << 8) | response_frame->data_length);
+    
+    m_sd_error_code = ERROR_NONE;
+    perf_record (PERF_RECEIVE_RESPONSE, start);
+    return true;
+}
+
+static bool receive_response (void)
+{
+    return receive_response_expecting (0);
+}
+
+// requests run to completion as soon as they're queued, as on the M2
+static void queue_request (m_sd_request *request)
+{
+    request->state = M_SD_REQUEST_ACTIVE;
+    
+    bool ok = m_sd_seek (request->file_id, request->offset);
+    if (ok && request->write)
+        ok = m_sd_write_stream (request->file_id, request->length, request->buffer, &request->done);
+    else if (ok)
+        ok = m_sd_read_stream (request->file_id, request->length, request->buffer, &request->done);
+    
+    request->error = ok ? ERROR_NONE : m_sd_error_code;
+    request->state = ok ? M_SD_REQUEST_DONE : M_SD_REQUEST_FAILED;
+    
+    if (request->callback != NULL)
+        request->callback (request);
+}
+
+void m_sd_poll (void)
+{}
+
+bool m_sd_busy (void)
+{
+    return false;
+}
+
+//!   END OF HOST-SPECIFIC CODE !===============================================
+
+#else
+ #error "Unknown device, you must define either M2 or M4 in the makefile"
+#endif
+
+// convert file names from their representation on disk
+// eg., "TEST    TXT" becomes "TEST.TXT"
+void filename_fs_to_8_3 (const char *input_name,
+                         char *output_name)
+{
+    uint8_t in_index = 0;
+    uint8_t out_index = 0;
+    
+    bool wrote_dot = false;
+    
+    while (in_index < 11 && out_index < 11)
+    {
+        if (in_index < 8)
+        {
+            if (input_name[in_index] == ' ')
+            {
+                in_index = 8;  // skip to the last 3 chars
+                continue;
+            }
+            else
+            {
+                output_name[out_index++] = input_name[in_index];
+            }
         }
         else
         {  // extension characters
@@ -434,29 +1181,811 @@ void filename_8_3_to_fs (const char *input_name,
         }
     }
     
-    while (out_index < 11)
+    while (out_index < 11)
+    {
+        output_name[out_index] = ' ';
+        out_index++;
+    }
+}
+
+
+
+
+
+
+
+
+
+
+
+//------------------------------------------------------------------------------
+
+
+
+//------------------------------------------------------------------------------
+// compound orders
+//
+// Newer mMicroSD firmware understands three orders beyond the basic set, so
+// the pairs the editor sends all the time cost one round trip instead of two:
+//
+//   READ_AT  [file id, offset, length]      seek, then read
+//   WRITE_AT [file id, offset, data...]     seek, then write
+//   BATCH    [order, order, ...]            several orders in one frame
+//
+// A batch's orders are packed one after the other as [command, data length,
+// data...], and they're carried out in order until one of them fails.  The
+// response holds each of their responses, packed the same way, up to and
+// including the one that failed, and its code is the failed order's (or
+// ERROR_NONE).
+//
+// m_sd_init() sends an empty batch to find out whether the card understands
+// any of this; older firmware answers it with an error, and then everything
+// goes one order at a time as before.
+
+static void batch_start (void)
+{
+    transmission.order.command = M_SD_BATCH;
+    transmission.order.data_length = 0;
+}
+
+// add an order to the batch, returns where its data goes
+// the caller makes sure it all fits
+static uint8_t *batch_add (uint8_t command, uint8_t data_length)
+{
+    uint8_t *order = &transmission.order.data[transmission.order.data_length];
+    order[0] = command;
+    order[1] = data_length;
+    transmission.order.data_length += 2 + data_length;
+    return &order[2];
+}
+
+static bool batch_send (void)
+{
+    if (!send_order())
+        return false;
+    
+    if (!receive_response())
+        return false;
+    
+    m_sd_error_code = transmission.response.response_code;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+// the response to the index-th order in the batch, as [code, data length,
+// data...], or NULL if the batch stopped before it
+static const uint8_t *batch_response (uint8_t index)
+{
+    const uint8_t length = transmission.response.data_length;
+    uint16_t at = 0;
+    
+    while (at + 2 <= length && at + 2 + transmission.response.data[at + 1] <= length)
+    {
+        if (index-- == 0)
+            return &transmission.response.data[at];
+        at += 2 + transmission.response.data[at + 1];
+    }
+    return NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// local file state and block cache
+//
+// The seek position of every open file is mirrored here, along with its size
+// once we've had to ask for it.  Reads and writes advance the position, seeks
+// only move it, and m_sd_get_seek_pos() answers from it.  The card is told to
+// seek right before data actually has to move, and only if it isn't there
+// already, so seeking to where the file already is costs nothing.  With
+// compound orders, even that seek goes out as part of the read or write.
+//
+// On top of that, small reads and writes go through a few blocks of file data
+// (M_SD_CACHE_BLOCKS of them), so reading the same region again, or poking at
+// a handful of bytes, doesn't cost a command each time either.
+//
+// Blocks are evicted least recently used first.  Writes that hit a cached
+// block just dirty it (a miss goes straight to the card rather than reading
+// the block in first), and dirty blocks are written back when they're
+// evicted, and on commit, close, and shutdown.
+//
+// Transfers of CACHE_BYPASS_LENGTH or more skip the blocks and go to the card
+// in the largest frames the protocol allows, since splitting them into blocks
+// would only cost more commands.
+
+// defined with the rest of the file access functions
+static bool card_seek (uint8_t file_id, uint32_t offset);
+static bool card_get_seek_pos (uint8_t file_id, uint32_t *offset);
+static bool card_read_stream (uint8_t file_id, uint32_t length, uint8_t *buffer, uint32_t room, uint32_t *done);
+static bool card_write_stream (uint8_t file_id, uint32_t length, uint8_t *buffer, uint32_t room, uint32_t *done);
+
+uint32_t m_sd_cache_hits = 0;
+uint32_t m_sd_cache_misses = 0;
+uint32_t m_sd_seeks_elided = 0;
+
+#define TRACKED_FILES 8  // files with higher ids go straight to the card
+
+#define NO_FILE 0xff
+#define UNKNOWN ((uint32_t)0xffffffff)
+
+typedef struct tracked_file
+{
+    bool     open;
+    char     name[13];
+    uint32_t size;           // including dirty blocks, UNKNOWN until needed
+    uint32_t position;       // where the next read or write goes
+    uint32_t card_position;  // the card's idea of the seek position
+    bool     seek_pending;   // position was set by a seek the card hasn't seen
+    bool     seek_owed;      // card_position is where the next transfer's
+                             // READ_AT or WRITE_AT will put the card
+} tracked_file;
+
+static tracked_file tracked_files[TRACKED_FILES];
+
+static bool same_name (const char *a, const char *b)
+{
+    for (uint8_t i = 0; i < 13; i++)
+    {
+        char x = a[i];
+        char y = b[i];
+        if (x >= 'a' && x <= 'z')
+            x -= 0x20;
+        if (y >= 'a' && y <= 'z')
+            y -= 0x20;
+        
+        if (x != y)
+            return false;
+        if (x == '\0')
+            return true;
+    }
+    return true;
+}
+
+static tracked_file *tracked (uint8_t file_id)
+{
+    if (file_id >= TRACKED_FILES || !tracked_files[file_id].open)
+        return NULL;
+    return &tracked_files[file_id];
+}
+
+// a pending seek that won't need to reach the card after all
+static void drop_pending_seek (tracked_file *file)
+{
+    if (file->seek_pending)
+        m_sd_seeks_elided++;
+    file->seek_pending = false;
+}
+
+// seek to the end and ask where that is, in one batch
+static bool batch_seek_end (uint8_t file_id, uint32_t *size)
+{
+    batch_start();
+    
+    uint8_t *data = batch_add (M_SD_SEEK, 5);
+    data[0] = file_id;
+    uint32_t *offset_ptr = ((uint32_t*)&data[1]);
+    *offset_ptr = FILE_END_POS;
+    
+    data = batch_add (M_SD_GET_SEEK, 1);
+    data[0] = file_id;
+    
+    if (!batch_send())
+        return false;
+    
+    const uint8_t *response = batch_response (1);
+    if (response == NULL || response[1] != 4)
+    {
+        m_sd_error_code = ERROR_I2C_COMMAND;
+        return false;
+    }
+    
+    const uint32_t *size_ptr = ((const uint32_t*)&response[2]);
+    *size = *size_ptr;
+    return true;
+}
+
+// ask the card how big the file is
+// this leaves the card's seek position at the end
+static bool learn_size (uint8_t file_id, tracked_file *file)
+{
+    if (file->size != UNKNOWN)
+        return true;
+    
+    file->card_position = UNKNOWN;
+    file->seek_owed = false;
+    
+    const bool learned = m_sd_compound_orders ?
+                         batch_seek_end (file_id, &file->size) :
+                         (card_seek (file_id, FILE_END_POS) &&
+                          card_get_seek_pos (file_id, &file->size));
+    if (!learned)
+    {
+        file->size = UNKNOWN;
+        return false;
+    }
+    
+    file->card_position = file->size;
+    if (file->position == UNKNOWN)
+        file->position = file->size;  // opened for appending
+    return true;
+}
+
+// move the card's seek position to ours, if it isn't there already
+// always followed by a read or write, which carries the seek when it can
+static bool sync_position (uint8_t file_id, tracked_file *file, uint32_t position)
+{
+    if (file->card_position == position)
+        return true;
+    
+    if (m_sd_compound_orders)
+    {
+        file->card_position = position;
+        file->seek_owed = true;
+        return true;
+    }
+    
+    if (!card_seek (file_id, position))
+    {
+        file->card_position = UNKNOWN;
+        return false;
+    }
+    
+    file->card_position = position;
+    return true;
+}
+
+// get the card to where the next transfer starts
+static bool sync_file (uint8_t file_id, tracked_file *file)
+{
+    if (file->card_position == file->position)
+        drop_pending_seek (file);
+    file->seek_pending = false;
+    
+    return sync_position (file_id, file, file->position);
+}
+
+#if M_SD_CACHE_BLOCKS > 0
+
+#define CACHE_BYPASS_LENGTH (M_SD_CACHE_BLOCK_SIZE / 2)
+
+typedef struct cache_block
+{
+    uint8_t  file_id;    // NO_FILE when the block is free
+    bool     dirty;
+    uint16_t length;     // bytes held, short for the last block of a file
+    uint32_t index;      // which block of the file this is
+    uint32_t last_used;
+    uint8_t  headroom[M_SD_FRAME_HEADROOM];  // so data can be framed in place
+    uint8_t  data[M_SD_CACHE_BLOCK_SIZE];
+} cache_block;
+
+static cache_block cache[M_SD_CACHE_BLOCKS];
+static uint32_t cache_clock = 0;
+
+static void copy_bytes (uint8_t *to, const uint8_t *from, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++)
+        to[i] = from[i];
+}
+
+static void drop_blocks (uint8_t file_id)
+{
+    for (uint8_t i = 0; i < M_SD_CACHE_BLOCKS; i++)
+    {
+        if (cache[i].file_id == file_id)
+            cache[i].file_id = NO_FILE;
+    }
+}
+
+// write back the file's dirty blocks up to and including block last_index,
+// in order, so the card's copy of the file never has a gap in it
+static bool flush_blocks (uint8_t file_id, uint32_t last_index)
+{
+    tracked_file *file = &tracked_files[file_id];
+    
+    for (;;)
+    {
+        cache_block *block = NULL;
+        for (uint8_t i = 0; i < M_SD_CACHE_BLOCKS; i++)
+        {
+            if (cache[i].file_id == file_id && cache[i].dirty &&
+                cache[i].index <= last_index &&
+                (block == NULL || cache[i].index < block->index))
+            {
+                block = &cache[i];
+            }
+        }
+        
+        if (block == NULL)
+            return true;
+        
+        const uint32_t start = block->index * M_SD_CACHE_BLOCK_SIZE;
+        if (!sync_position (file_id, file, start))
+            return false;
+        
+        if (!card_write_stream (file_id, block->length, block->data, M_SD_FRAME_HEADROOM, NULL))
+        {
+            file->card_position = UNKNOWN;
+            return false;
+        }
+        
+        file->card_position = start + block->length;
+        block->dirty = false;
+    }
+}
+
+static bool flush_all (void)
+{
+    for (uint8_t i = 0; i < M_SD_CACHE_BLOCKS; i++)
+    {
+        if (cache[i].file_id != NO_FILE && cache[i].dirty &&
+            !flush_blocks (cache[i].file_id, UNKNOWN))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static cache_block *find_block (uint8_t file_id, uint32_t index)
+{
+    for (uint8_t i = 0; i < M_SD_CACHE_BLOCKS; i++)
+    {
+        if (cache[i].file_id == file_id && cache[i].index == index)
+        {
+            cache[i].last_used = ++cache_clock;
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+// read a block in, evicting the least recently used one to make room
+static cache_block *load_block (uint8_t file_id, tracked_file *file, uint32_t index)
+{
+    cache_block *victim = &cache[0];
+    for (uint8_t i = 0; i < M_SD_CACHE_BLOCKS; i++)
+    {
+        if (cache[i].file_id == NO_FILE)
+        {
+            victim = &cache[i];
+            break;
+        }
+        if (cache[i].last_used < victim->last_used)
+            victim = &cache[i];
+    }
+    
+    if (victim->file_id != NO_FILE && victim->dirty &&
+        !flush_blocks (victim->file_id, victim->index))
+    {
+        return NULL;
+    }
+    victim->file_id = NO_FILE;
+    
+    const uint32_t start = index * M_SD_CACHE_BLOCK_SIZE;
+    uint32_t length = file->size - start;
+    if (length > M_SD_CACHE_BLOCK_SIZE)
+        length = M_SD_CACHE_BLOCK_SIZE;
+    
+    if (!sync_position (file_id, file, start))
+        return NULL;
+    
+    if (!card_read_stream (file_id, length, victim->data, M_SD_FRAME_HEADROOM, NULL))
+    {
+        file->card_position = UNKNOWN;
+        return NULL;
+    }
+    file->card_position = start + length;
+    
+    victim->file_id = file_id;
+    victim->dirty = false;
+    victim->length = length;
+    victim->index = index;
+    victim->last_used = ++cache_clock;
+    return victim;
+}
+
+// copy a direct write into any blocks it overlaps, so they stay current
+static void update_blocks (uint8_t file_id, uint32_t position, uint32_t length, const uint8_t *buffer)
+{
+    for (uint8_t i = 0; i < M_SD_CACHE_BLOCKS; i++)
+    {
+        if (cache[i].file_id != file_id)
+            continue;
+        
+        const uint32_t start = cache[i].index * M_SD_CACHE_BLOCK_SIZE;
+        const uint32_t from = (position > start) ? position : start;
+        uint32_t to = position + length;
+        if (to > start + M_SD_CACHE_BLOCK_SIZE)
+            to = start + M_SD_CACHE_BLOCK_SIZE;
+        
+        if (from >= to)
+            continue;
+        
+        copy_bytes (&cache[i].data[from - start], &buffer[from - position], to - from);
+        if (to - start > cache[i].length)
+            cache[i].length = to - start;
+    }
+}
+
+#else
+
+// no blocks, so every transfer goes straight to the card
+#define CACHE_BYPASS_LENGTH 0
+
+static void drop_blocks (uint8_t file_id)
+{}
+
+static bool flush_blocks (uint8_t file_id, uint32_t last_index)
+{
+    return true;
+}
+
+static bool flush_all (void)
+{
+    return true;
+}
+
+static void update_blocks (uint8_t file_id, uint32_t position, uint32_t length, const uint8_t *buffer)
+{}
+
+#endif
+
+static void reset_tracking (void)
+{
+    for (uint8_t i = 0; i < TRACKED_FILES; i++)
+    {
+        tracked_files[i].open = false;
+        drop_blocks (i);
+    }
+}
+
+// size is UNKNOWN unless the card said when the file was opened
+static void tracked_open (uint8_t file_id, const char *name, open_option action, uint32_t size)
+{
+    if (file_id >= TRACKED_FILES)
+        return;
+    
+    tracked_file *file = &tracked_files[file_id];
+    
+    drop_blocks (file_id);
+    
+    file->open = true;
+    uint8_t i;
+    for (i = 0; i < 12 && name[i] != '\0'; i++)
+        file->name[i] = name[i];
+    file->name[i] = '\0';
+    
+    file->size = (action == CREATE_FILE) ? 0 : size;
+    file->position = (action == APPEND_FILE) ? file->size : 0;
+    file->card_position = file->position;
+    file->seek_pending = false;
+    file->seek_owed = false;
+}
+
+static void tracked_forget (uint8_t file_id)
+{
+    if (file_id >= TRACKED_FILES)
+        return;
+    
+    drop_pending_seek (&tracked_files[file_id]);
+    drop_blocks (file_id);
+    tracked_files[file_id].open = false;
+}
+
+static bool tracked_seek (uint8_t file_id, tracked_file *file, uint32_t offset)
+{
+    // staying where we are needs no checking
+    if (offset == FILE_END_POS || offset != file->position)
+    {
+        if (file->size == UNKNOWN && offset != FILE_END_POS)
+        {  // let the card check the offset, it's no dearer than finding the size
+            drop_pending_seek (file);
+            file->card_position = UNKNOWN;
+            if (!card_seek (file_id, offset))
+                return false;
+            
+            file->position = file->card_position = offset;
+            return true;
+        }
+        
+        if (!learn_size (file_id, file))
+            return false;
+        
+        if (offset == FILE_END_POS)
+            offset = file->size;
+        else if (offset > file->size)
+        {
+            m_sd_error_code = ERROR_FAT32_TOO_FAR;
+            return false;
+        }
+    }
+    
+    // if the last seek hasn't gone out yet, this one replaces it
+    drop_pending_seek (file);
+    
+    file->position = offset;
+    file->seek_pending = true;
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+static bool tracked_get_seek_pos (uint8_t file_id, tracked_file *file, uint32_t *offset)
+{
+    if (file->position != UNKNOWN)
+        m_sd_seeks_elided++;
+    else if (!learn_size (file_id, file))
+        return false;
+    
+    *offset = file->position;
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+static bool tracked_read (uint8_t file_id, tracked_file *file,
+                          uint32_t length, uint8_t *buffer, uint32_t room, uint32_t *done)
+{
+    uint32_t transferred = 0;
+    bool ok = true;
+    
+    if (file->position == UNKNOWN && !learn_size (file_id, file))
+        ok = false;
+    else if (length >= CACHE_BYPASS_LENGTH)
+    {  // straight from the card, once anything dirty in the way is written
+        const uint32_t last_index = (file->position + length - 1) / M_SD_CACHE_BLOCK_SIZE;
+        
+        ok = flush_blocks (file_id, last_index) &&
+             sync_file (file_id, file) &&
+             card_read_stream (file_id, length, buffer, room, &transferred);
+        
+        file->position += transferred;
+        file->card_position = ok ? file->position : UNKNOWN;
+    }
+    #if M_SD_CACHE_BLOCKS > 0
+    else if (!learn_size (file_id, file))
+        ok = false;
+    else if (file->position + length > file->size)
+    {
+        m_sd_error_code = ERROR_FAT32_TOO_FAR;
+        ok = false;
+    }
+    else
+    {
+        drop_pending_seek (file);  // the blocks know where to read from
+        
+        while (transferred < length)
+        {
+            const uint32_t index = file->position / M_SD_CACHE_BLOCK_SIZE;
+            const uint32_t within = file->position % M_SD_CACHE_BLOCK_SIZE;
+            
+            cache_block *block = find_block (file_id, index);
+            if (block != NULL)
+                m_sd_cache_hits++;
+            else
+            {
+                m_sd_cache_misses++;
+                block = load_block (file_id, file, index);
+                if (block == NULL)
+                {
+                    ok = false;
+                    break;
+                }
+            }
+            
+            uint32_t count = block->length - within;
+            if (count > length - transferred)
+                count = length - transferred;
+            
+            copy_bytes (&buffer[transferred], &block->data[within], count);
+            transferred += count;
+            file->position += count;
+        }
+    }
+    #endif
+    
+    if (done != NULL)
+        *done = transferred;
+    
+    if (ok)
+        m_sd_error_code = ERROR_NONE;
+    return ok;
+}
+
+static bool tracked_write (uint8_t file_id, tracked_file *file,
+                           uint32_t length, uint8_t *buffer, uint32_t room, uint32_t *done)
+{
+    uint32_t transferred = 0;
+    bool ok = (file->position != UNKNOWN) || learn_size (file_id, file);
+    
+    while (ok && transferred < length)
+    {
+        const uint32_t within = file->position % M_SD_CACHE_BLOCK_SIZE;
+        
+        uint32_t count = M_SD_CACHE_BLOCK_SIZE - within;
+        if (count > length - transferred)
+            count = length - transferred;
+        
+        #if M_SD_CACHE_BLOCKS > 0
+        cache_block *block = NULL;
+        if (length < CACHE_BYPASS_LENGTH)
+            block = find_block (file_id, file->position / M_SD_CACHE_BLOCK_SIZE);
+        
+        if (block != NULL)
+        {  // write-back: only the block changes for now
+            m_sd_cache_hits++;
+            drop_pending_seek (file);
+            copy_bytes (&block->data[within], &buffer[transferred], count);
+            if (within + count > block->length)
+                block->length = within + count;
+            block->dirty = true;
+        }
+        else
+        #endif
+        {  // write-through: anything dirty up to here has to go first
+            if (length < CACHE_BYPASS_LENGTH)
+                m_sd_cache_misses++;
+            else
+                count = length - transferred;  // the rest in one go
+            
+            const uint32_t last_index = (file->position + count - 1) / M_SD_CACHE_BLOCK_SIZE;
+            uint32_t written = 0;
+            
+            ok = flush_blocks (file_id, last_index) &&
+                 sync_file (file_id, file) &&
+                 card_write_stream (file_id, count, &buffer[transferred], room + transferred, &written);
+            
+            update_blocks (file_id, file->position, written, &buffer[transferred]);
+            file->card_position = ok ? file->position + written : UNKNOWN;
+            count = written;
+        }
+        
+        transferred += count;
+        file->position += count;
+        if (file->size != UNKNOWN && file->position > file->size)
+            file->size = file->position;
+    }
+    
+    if (done != NULL)
+        *done = transferred;
+    
+    if (ok)
+        m_sd_error_code = ERROR_NONE;
+    return ok;
+}
+
+// background requests go straight to the card, so the card has to be up to
+// date for the range first, and the blocks have to forget what it overwrites
+static bool tracked_prepare_request (m_sd_request *request)
+{
+    tracked_file *file = tracked (request->file_id);
+    if (file == NULL)
+        return true;
+    
+    if (request->length > 0)
+    {
+        const uint32_t last_index = (request->offset + request->length - 1) / M_SD_CACHE_BLOCK_SIZE;
+        
+        if (!flush_blocks (request->file_id, last_index))
+            return false;
+        
+        #if M_SD_CACHE_BLOCKS > 0
+        for (uint8_t i = 0; request->write && i < M_SD_CACHE_BLOCKS; i++)
+        {
+            if (cache[i].file_id == request->file_id &&
+                (cache[i].index + 1) * M_SD_CACHE_BLOCK_SIZE > request->offset &&
+                cache[i].index <= last_index)
+            {
+                cache[i].file_id = NO_FILE;
+            }
+        }
+        #endif
+    }
+    
+    if (request->write && file->size != UNKNOWN &&
+        request->offset + request->length > file->size)
+    {
+        file->size = request->offset + request->length;
+    }
+    
+    // the request does its own seek, and this is where it will leave things
+    drop_pending_seek (file);
+    file->position = request->offset + request->length;
+    file->card_position = UNKNOWN;
+    file->seek_owed = false;
+    return true;
+}
+
+
+//-----------------------------------------------
+// Startup and shutdown:
+
+#if defined(M4)
+// The card is mounted at whatever speed mBus is at (Fast-mode unless it's
+// been changed), then each speed from Fast-mode Plus down is tried until
+// the link passes a check: a few rounds of writing a scratch file with every
+// byte value in it and reading it back (with READ_AT when the card has it),
+// in frames as long as the protocol allows both ways.  Every byte has to come
+// back as it went out, with no bus error or timeout along the way, and the
+// file is deleted afterwards.  mBus keeps watching after that, and drops a
+// speed by itself if errors start turning up.
+
+#define LINK_CHECK_ROUNDS 3
+#define LINK_CHECK_BYTES  256  // every byte value once, and past one frame
+#define LINK_CHECK_NAME   "LINKCHK.TMP"
+
+static const mBusSpeed link_speeds[] = { MBUS_FAST_PLUS, MBUS_FAST, MBUS_STANDARD };
+
+// one round: the pattern, a different order of the byte values each round,
+// out to the card and back.  It's long enough to skip the blocks both ways,
+// so what's compared really came over the bus.
+static bool link_check_round (uint8_t file_id, uint8_t round)
+{
+    uint8_t pattern[LINK_CHECK_BYTES];
+    uint8_t answer[LINK_CHECK_BYTES];
+    
+    for (uint16_t i = 0; i < LINK_CHECK_BYTES; i++)
+    {
+        pattern[i] = (uint8_t)(i * 167 + round * 85);  // odd, so each value once
+        answer[i] = ~pattern[i];
+    }
+    
+    if (!m_sd_pwrite (file_id, 0, LINK_CHECK_BYTES, pattern) ||
+        !m_sd_pread (file_id, 0, LINK_CHECK_BYTES, answer))
+    {
+        return false;
+    }
+    
+    for (uint16_t i = 0; i < LINK_CHECK_BYTES; i++)
+    {
+        if (answer[i] != pattern[i])
+            return false;
+    }
+    return true;
+}
+
+static bool link_check (void)
+{
+    const uint32_t errors = mBusStats.bus_errors + mBusStats.timeouts;
+    uint8_t file_id;
+    
+    if (!m_sd_open_file (LINK_CHECK_NAME, CREATE_FILE, &file_id))
+        return false;
+    
+    bool ok = true;
+    for (uint8_t round = 0; ok && round < LINK_CHECK_ROUNDS; round++)
+        ok = link_check_round (file_id, round);
+    const m_sd_errors error = m_sd_error_code;
+    
+    // a failed close or delete is the link's fault as much as anything else,
+    // but otherwise the first thing to go wrong is what's reported
+    const bool closed = m_sd_close_file (file_id);
+    const bool deleted = m_sd_delete (LINK_CHECK_NAME);
+    if (!ok)
+        m_sd_error_code = error;
+    
+    return ok && closed && deleted && (mBusStats.bus_errors + mBusStats.timeouts == errors);
+}
+
+// settle on the fastest speed the link passes the check at
+static bool negotiate_link (void)
+{
+    for (uint8_t i = 0; i < sizeof (link_speeds) / sizeof (link_speeds[0]); i++)
+    {
+        mBusSetSpeed (link_speeds[i]);
+        if (link_check())
+            return true;
+    }
+    
+    // a full card has no room for the scratch file, which says nothing
+    // about the link, so stay at the slowest speed rather than not mount
+    if (m_sd_error_code == ERROR_FAT32_FULL)
     {
-        output_name[out_index] = ' ';
-        out_index++;
+        m_sd_error_code = ERROR_NONE;
+        return true;
     }
+    
+    m_sd_error_code = ERROR_I2C_COMMAND;
+    return false;
 }
-
-
-
-
-
-
-
-
-
-
-
-//------------------------------------------------------------------------------
-
-
-
-//-----------------------------------------------
-// Startup and shutdown:
+#endif
 
 // mount the microSD card's FAT32 filesystem
 bool m_sd_init (void)
@@ -465,6 +1994,10 @@ bool m_sd_init (void)
     m_bus_init();
     #elif defined(M4)
     mBusInit();
+    mBusSetTransferCallback (bus_event);
+    #ifdef M_SD_READY_IRQ
+    ready_line_init();
+    #endif
     #endif
     
     transmission.order.command = M_SD_INIT;
@@ -476,13 +2009,32 @@ bool m_sd_init (void)
     if (!receive_response())
         return false;
     
+    reset_tracking();
+    
     m_sd_error_code = transmission.response.response_code;
-    return (m_sd_error_code == ERROR_NONE);
+    if (m_sd_error_code != ERROR_NONE)
+        return false;
+    
+    // an empty batch only succeeds if the card knows what a batch is
+    batch_start();
+    m_sd_compound_orders = batch_send();
+    
+    #if defined(M4)
+    if (!negotiate_link())
+        return false;
+    #endif
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
 }
 
 // flush any pending writes and unmount the filesystem
 bool m_sd_shutdown (void)
 {
+    if (!flush_all())
+        return false;
+    reset_tracking();
+    
     transmission.order.command = M_SD_SHUTDOWN;
     transmission.order.data_length = 0;
     
@@ -500,6 +2052,9 @@ bool m_sd_shutdown (void)
 // useful if you don't know when the system might be powered off
 bool m_sd_commit (void)
 {
+    if (!flush_all())
+        return false;
+    
     transmission.order.command = M_SD_COMMIT;
     transmission.order.data_length = 0;
     
@@ -847,13 +2402,71 @@ bool m_sd_delete (const char *name)
         return false;
     
     m_sd_error_code = transmission.response.response_code;
-    return (m_sd_error_code == ERROR_NONE);
+    if (m_sd_error_code != ERROR_NONE)
+        return false;
+    
+    // the card closes the file if it was open, so our state for it goes too
+    for (i = 0; i < TRACKED_FILES; i++)
+    {
+        if (tracked_files[i].open && same_name (tracked_files[i].name, name))
+            tracked_forget (i);
+    }
+    
+    return true;
 }
 
 
 //-----------------------------------------------
 // File access and modification:
 
+// open the file and get its size in one batch
+static bool batch_open_file (const char *name,
+                             uint16_t len,
+                             open_option action,
+                             uint8_t *file_id)
+{
+    batch_start();
+    
+    uint8_t *data = batch_add (M_SD_OPEN_FILE, 1 + len + 1);
+    data[0] = (uint8_t)action;
+    for (uint8_t i = 0; i <= len; i++)
+        data[i + 1] = (uint8_t)name[i];
+    
+    data = batch_add (M_SD_GET_SIZE, len + 1);
+    for (uint8_t i = 0; i <= len; i++)
+        data[i] = (uint8_t)name[i];
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response())
+        return false;
+    
+    // the file may have opened even if the batch as a whole didn't work out
+    m_sd_error_code = transmission.response.response_code;
+    const uint8_t *opened = batch_response (0);
+    if (opened == NULL || opened[0] != ERROR_NONE || opened[1] != 1)
+    {
+        if (m_sd_error_code == ERROR_NONE)
+            m_sd_error_code = ERROR_I2C_COMMAND;
+        return false;
+    }
+    *file_id = opened[2];
+    
+    uint32_t size = UNKNOWN;
+    const uint8_t *sized = batch_response (1);
+    if (sized != NULL && sized[0] == ERROR_NONE && sized[1] == 4)
+    {
+        const uint32_t *size_ptr = ((const uint32_t*)&sized[2]);
+        size = *size_ptr;
+    }
+    
+    tracked_open (*file_id, name, action, size);
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
 // open a file in the current directory
 // actions are:
 //   READ_FILE:   open an existing file as read-only
@@ -871,6 +2484,10 @@ bool m_sd_open_file (const char *name,
         return false;
     }
     
+    // an existing file's size comes back with it, when it can
+    if (m_sd_compound_orders && action != CREATE_FILE)
+        return batch_open_file (name, len, action, file_id);
+    
     transmission.order.command = M_SD_OPEN_FILE;
     transmission.order.data_length = 1 + (uint8_t)len + 1;
     
@@ -895,6 +2512,9 @@ bool m_sd_open_file (const char *name,
         return false;
     
     *file_id = transmission.response.data[0];
+    
+    tracked_open (*file_id, name, action, UNKNOWN);
+    
     return true;
 }
 
@@ -902,6 +2522,10 @@ bool m_sd_open_file (const char *name,
 // does nothing if no file is open
 bool m_sd_close_file (uint8_t file_id)
 {
+    if (tracked (file_id) != NULL && !flush_blocks (file_id, UNKNOWN))
+        return false;
+    tracked_forget (file_id);
+    
     transmission.order.command = M_SD_CLOSE_FILE;
     transmission.order.data_length = 1;
     transmission.order.data[0] = file_id;
@@ -919,9 +2543,13 @@ bool m_sd_close_file (uint8_t file_id)
 
 // seek to a location within the opened file
 // an offset of FILE_END_POS will seek to the end of the file
-bool m_sd_seek (uint8_t file_id,
-                uint32_t offset)
+static bool card_seek (uint8_t file_id,
+                       uint32_t offset)
 {
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        file->seek_owed = false;  // this seek replaces it
+    
     transmission.order.command = M_SD_SEEK;
     transmission.order.data_length = 5;
     
@@ -940,8 +2568,8 @@ bool m_sd_seek (uint8_t file_id,
 }
 
 // get the seek position in the opened file
-bool m_sd_get_seek_pos (uint8_t file_id,
-                        uint32_t *offset)
+static bool card_get_seek_pos (uint8_t file_id,
+                               uint32_t *offset)
 {
     transmission.order.command = M_SD_GET_SEEK;
     transmission.order.data_length = 1;
@@ -970,82 +2598,430 @@ bool m_sd_get_seek_pos (uint8_t file_id,
     return true;
 }
 
+// the file, if the card has a seek coming for it with the next transfer
+static tracked_file *owed_seek (uint8_t file_id)
+{
+    tracked_file *file = tracked (file_id);
+    return (file != NULL && file->seek_owed) ? file : NULL;
+}
+
 // read from the current location in the file
 // updates the seek position
 //
 // if the length of the read would go beyond the end of the file, an
 // error is returned and nothing is read
-bool m_sd_read_file (uint8_t file_id,
-                     uint32_t length,
-                     uint8_t *buffer)
+//
+// room is how many bytes in front of buffer can be borrowed for the frame
+static bool card_read_file (uint8_t file_id,
+                            uint32_t length,
+                            uint8_t *buffer,
+                            uint32_t room)
+{
+    if (length > M_SD_MAX_READ_LENGTH)
+    {
+        m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
+        return false;
+    }
+    
+    tracked_file *file = owed_seek (file_id);
+    if (file != NULL)
+    {  // seek and read in one order
+        transmission.order.command = M_SD_READ_AT;
+        transmission.order.data_length = 6;
+        
+        transmission.order.data[0] = file_id;
+        uint32_t *offset_ptr = ((uint32_t*)&transmission.order.data[1]);
+        *offset_ptr = file->card_position;
+        transmission.order.data[5] = length;
+        
+        file->seek_owed = false;
+    }
+    else
+    {
+        transmission.order.command = M_SD_READ_FILE;
+        transmission.order.data_length = 2;
+        
+        transmission.order.data[0] = file_id;
+        transmission.order.data[1] = length;
+    }
+    
+    // the response code and length land just in front of the data
+    const bool in_place = FRAMED_TRANSFERS && room >= 2;
+    framing frame = { NULL, 0, { 0 } };
+    if (in_place)
+        response_frame = (i2c_response*)frame_around (&frame, buffer, 2);
+    
+    bool ok = send_order() && receive_response_expecting (length);
+    if (ok)
+    {
+        m_sd_error_code = response_frame->response_code;
+        if (m_sd_error_code != ERROR_NONE)
+            ok = false;
+        else if (response_frame->data_length != length)
+        {
+            m_sd_error_code = ERROR_I2C_COMMAND;
+            ok = false;
+        }
+    }
+    
+    if (in_place)
+    {
+        unframe (&frame);
+        response_frame = &transmission.response;
+    }
+    else if (ok)
+    {
+        for (uint8_t i = 0; i < length; i++)
+            buffer[i] = transmission.response.data[i];
+    }
+    
+    return ok;
+}
+
+
+// write to the current location in the file
+// updates the seek position
+//
+// room is how many bytes in front of buffer can be borrowed for the frame
+static bool card_write_file (uint8_t file_id,
+                             uint32_t length,
+                             uint8_t *buffer,
+                             uint32_t room)
 {
-    transmission.order.command = M_SD_READ_FILE;
-    transmission.order.data_length = 2;
+    tracked_file *file = owed_seek (file_id);
+    const uint8_t header = (file != NULL) ? 5 : 1;  // file id, and the offset
     
-    if (length > TWI_BUFFER_LEN - 1)
+    if (length > M_SD_MAX_WRITE_LENGTH + 1 - header)
     {
         m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
         return false;
     }
     
-    transmission.order.data[0] = file_id;
-    transmission.order.data[1] = length;
+    if (length == 0)
+        return true;
     
-    if (!send_order())
+    const bool in_place = FRAMED_TRANSFERS && room >= 2u + header;
+    framing frame = { NULL, 0, { 0 } };
+    i2c_command *order = &transmission.order;
+    if (in_place)
+        order = (i2c_command*)frame_around (&frame, buffer, 2 + header);
+    
+    order->data_length = length + header;
+    order->data[0] = file_id;
+    
+    if (file != NULL)
+    {  // seek and write in one order
+        order->command = M_SD_WRITE_AT;
+        uint32_t *offset_ptr = ((uint32_t*)&order->data[1]);
+        *offset_ptr = file->card_position;
+        file->seek_owed = false;
+    }
+    else
+        order->command = M_SD_WRITE_FILE;
+    
+    if (!in_place)
+    {
+        for (uint8_t i = 0; i < length; i++)
+            order->data[i + header] = (uint8_t)buffer[i];
+    }
+    
+    order_frame = order;
+    const bool sent = send_order();
+    order_frame = &transmission.order;
+    if (in_place)
+        unframe (&frame);
+    
+    if (!sent)
         return false;
     
     if (!receive_response())
         return false;
     
     m_sd_error_code = transmission.response.response_code;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+
+// read any amount from the current location in the file, one maximum-size
+// frame at a time
+static bool card_read_stream (uint8_t file_id,
+                              uint32_t length,
+                              uint8_t *buffer,
+                              uint32_t room,
+                              uint32_t *done)
+{
+    uint32_t transferred = 0;
     
-    if (m_sd_error_code != ERROR_NONE)
-        return false;
+    while (transferred < length)
+    {
+        uint32_t frame = length - transferred;
+        if (frame > M_SD_MAX_READ_LENGTH)
+            frame = M_SD_MAX_READ_LENGTH;
+        
+        if (!card_read_file (file_id, frame, &buffer[transferred], room + transferred))
+            break;
+        
+        transferred += frame;
+    }
+    
+    if (done != NULL)
+        *done = transferred;
+    
+    return (transferred == length);
+}
+
+
+// write any amount to the current location in the file, one maximum-size
+// frame at a time
+static bool card_write_stream (uint8_t file_id,
+                               uint32_t length,
+                               uint8_t *buffer,
+                               uint32_t room,
+                               uint32_t *done)
+{
+    uint32_t transferred = 0;
     
-    if (transmission.response.data_length != length)
+    // an owed seek always rides on the first frame as a WRITE_AT: that
+    // frame carries 4 bytes less, but even when it costs an extra frame,
+    // a separate SEEK would cost the same round trip and more bytes
+    while (transferred < length)
     {
-        m_sd_error_code = ERROR_I2C_COMMAND;
-        return false;
+        const uint32_t max = (owed_seek (file_id) != NULL) ? M_SD_MAX_WRITE_AT_LENGTH
+                                                           : M_SD_MAX_WRITE_LENGTH;
+        uint32_t frame = length - transferred;
+        if (frame > max)
+            frame = max;
+        
+        if (!card_write_file (file_id, frame, &buffer[transferred], room + transferred))
+            break;
+        
+        transferred += frame;
     }
     
-    for (uint8_t i = 0; i < length; i++)
-        buffer[i] = transmission.response.data[i];
+    if (done != NULL)
+        *done = transferred;
     
-    return true;
+    return (transferred == length);
 }
 
 
-// write to the current location in the file
-// updates the seek position
+// the public file access functions use the local file state when they can
+
+bool m_sd_seek (uint8_t file_id,
+                uint32_t offset)
+{
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        return tracked_seek (file_id, file, offset);
+    
+    return card_seek (file_id, offset);
+}
+
+bool m_sd_get_seek_pos (uint8_t file_id,
+                        uint32_t *offset)
+{
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        return tracked_get_seek_pos (file_id, file, offset);
+    
+    return card_get_seek_pos (file_id, offset);
+}
+
+bool m_sd_read_file (uint8_t file_id,
+                     uint32_t length,
+                     uint8_t *buffer)
+{
+    if (length > M_SD_MAX_READ_LENGTH)
+    {
+        m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
+        return false;
+    }
+    
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        return tracked_read (file_id, file, length, buffer, 0, NULL);
+    
+    return card_read_file (file_id, length, buffer, 0);
+}
+
 bool m_sd_write_file (uint8_t file_id,
                       uint32_t length,
                       uint8_t *buffer)
 {
-    transmission.order.command = M_SD_WRITE_FILE;
-    
-    if (length > TWI_BUFFER_LEN - 1)
+    if (length > M_SD_MAX_WRITE_LENGTH)
     {
         m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
         return false;
     }
     
-    if (length == 0)
-        return true;
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        return tracked_write (file_id, file, length, buffer, 0, NULL);
     
-    transmission.order.data_length = length + 1;
-    transmission.order.data[0] = file_id;
+    return card_write_file (file_id, length, buffer, 0);
+}
+
+// room is how many bytes in front of buffer the frames can borrow
+static bool read_stream (uint8_t file_id,
+                         uint32_t length,
+                         uint8_t *buffer,
+                         uint32_t room,
+                         uint32_t *done)
+{
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        return tracked_read (file_id, file, length, buffer, room, done);
     
-    for (uint8_t i = 0; i < length; i++)
-        transmission.response.data[i + 1] = (uint8_t)buffer[i];
+    return card_read_stream (file_id, length, buffer, room, done);
+}
+
+static bool write_stream (uint8_t file_id,
+                          uint32_t length,
+                          uint8_t *buffer,
+                          uint32_t room,
+                          uint32_t *done)
+{
+    tracked_file *file = tracked (file_id);
+    if (file != NULL)
+        return tracked_write (file_id, file, length, buffer, room, done);
     
-    if (!send_order())
+    return card_write_stream (file_id, length, buffer, room, done);
+}
+
+bool m_sd_read_stream (uint8_t file_id,
+                       uint32_t length,
+                       uint8_t *buffer,
+                       uint32_t *done)
+{
+    return read_stream (file_id, length, buffer, 0, done);
+}
+
+bool m_sd_write_stream (uint8_t file_id,
+                        uint32_t length,
+                        uint8_t *buffer,
+                        uint32_t *done)
+{
+    return write_stream (file_id, length, buffer, 0, done);
+}
+
+bool m_sd_read_framed (uint8_t file_id,
+                       uint32_t length,
+                       uint8_t *buffer,
+                       uint32_t *done)
+{
+    return read_stream (file_id, length, buffer, M_SD_FRAME_HEADROOM, done);
+}
+
+bool m_sd_write_framed (uint8_t file_id,
+                        uint32_t length,
+                        uint8_t *buffer,
+                        uint32_t *done)
+{
+    return write_stream (file_id, length, buffer, M_SD_FRAME_HEADROOM, done);
+}
+
+bool m_sd_pread (uint8_t file_id,
+                 uint32_t offset,
+                 uint32_t length,
+                 uint8_t *buffer)
+{
+    return m_sd_seek (file_id, offset) &&
+           m_sd_read_stream (file_id, length, buffer, NULL);
+}
+
+bool m_sd_pwrite (uint8_t file_id,
+                  uint32_t offset,
+                  uint32_t length,
+                  uint8_t *buffer)
+{
+    return m_sd_seek (file_id, offset) &&
+           m_sd_write_stream (file_id, length, buffer, NULL);
+}
+
+bool m_sd_file_size (uint8_t file_id,
+                     uint32_t *size)
+{
+    tracked_file *file = tracked (file_id);
+    if (file == NULL)
+    {  // only the card knows
+        return card_seek (file_id, FILE_END_POS) &&
+               card_get_seek_pos (file_id, size);
+    }
+    
+    if (!learn_size (file_id, file))
         return false;
     
-    if (!receive_response())
+    *size = file->size;
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+
+//-----------------------------------------------
+// Non-blocking file access:
+
+static bool submit_request (m_sd_request *request,
+                            bool write,
+                            uint8_t file_id,
+                            uint32_t offset,
+                            uint32_t length,
+                            uint8_t *buffer,
+                            m_sd_callback callback)
+{
+    if (request == NULL || (buffer == NULL && length > 0))
+    {
+        m_sd_error_code = ERROR_NULL_BUFFER;
         return false;
+    }
     
-    m_sd_error_code = transmission.response.response_code;
-    return (m_sd_error_code == ERROR_NONE);
+    request->file_id  = file_id;
+    request->write    = write;
+    request->offset   = offset;
+    request->length   = length;
+    request->buffer   = buffer;
+    request->callback = callback;
+    request->done     = 0;
+    request->error    = ERROR_NONE;
+    request->next     = NULL;
+    
+    if (!tracked_prepare_request (request))
+        return false;
+    
+    queue_request (request);
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+bool m_sd_submit_read (m_sd_request *request,
+                       uint8_t file_id,
+                       uint32_t offset,
+                       uint32_t length,
+                       uint8_t *buffer,
+                       m_sd_callback callback)
+{
+    return submit_request (request, false, file_id, offset, length, buffer, callback);
 }
 
+bool m_sd_submit_write (m_sd_request *request,
+                        uint8_t file_id,
+                        uint32_t offset,
+                        uint32_t length,
+                        uint8_t *buffer,
+                        m_sd_callback callback)
+{
+    return submit_request (request, true, file_id, offset, length, buffer, callback);
+}
 
+// poll until the request is finished
+bool m_sd_wait (m_sd_request *request)
+{
+    while (request->state == M_SD_REQUEST_QUEUED ||
+           request->state == M_SD_REQUEST_ACTIVE)
+    {
+        m_sd_poll();
+    }
+    
+    m_sd_error_code = request->error;
+    return (request->state == M_SD_REQUEST_DONE);
+}
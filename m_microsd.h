@@ -18,6 +18,8 @@
  #include "mGeneral.h"
  #include "mBus.h"
  #include "mUSB.h"
+#elif defined (HOST)
+ #include "host/host.h"
 #else
  #error "Unknown device, you must define either M2 or M4 in the makefile"
 #endif
@@ -82,6 +84,43 @@ void filename_fs_to_8_3 (const char *input_name,
 
 extern m_sd_errors m_sd_error_code;
 
+// number of commands sent to the mMicroSD since startup
+// (each one is a full command/response round trip over I2C)
+extern uint32_t m_sd_round_trips;
+
+// number of times a response was asked for before it was ready (and so
+// NACKed) since startup; the M4 times its first look at each response from
+// how long that command has been taking lately, so this stays low
+extern uint32_t m_sd_early_polls;
+
+// M_SD_READY_IRQ: on the M4, if the mMicroSD drives a "response ready" line,
+// define M_SD_READY_PORT and M_SD_READY_PIN as the port letter and pin number
+// it's wired to, and M_SD_READY_IRQ as that pin's EXTI interrupt, eg.
+// -DM_SD_READY_PORT=B -DM_SD_READY_PIN=4 -DM_SD_READY_IRQ=EXTI4.  Responses
+// are then asked for as soon as the line goes high, rather than when they're
+// estimated to be ready.  The line needs firmware on the mMicroSD to drive
+// it; if it never rises, polling takes over after a few milliseconds.
+
+// the client-side block cache (see m_microsd.c) keeps this many blocks of
+// file data in RAM; define it as 0 in the makefile to leave the cache out
+#ifndef M_SD_CACHE_BLOCKS
+#define M_SD_CACHE_BLOCKS 4
+#endif
+#define M_SD_CACHE_BLOCK_SIZE 256
+
+// small reads and writes that found their block cached, or didn't
+extern uint32_t m_sd_cache_hits;
+extern uint32_t m_sd_cache_misses;
+
+// seek and get-seek-position commands that never had to be sent, because the
+// locally tracked seek position already answered them
+extern uint32_t m_sd_seeks_elided;
+
+// whether the mMicroSD understands compound orders (seek-and-read,
+// seek-and-write, and batches of orders), as m_sd_init() found out;
+// without them, the same calls just take more round trips
+extern bool m_sd_compound_orders;
+
 //==============================================================================
 //=============================== USER FUNCTIONS ===============================
 //==============================================================================
@@ -93,6 +132,8 @@ extern m_sd_errors m_sd_error_code;
 // Startup and shutdown:
 
 // mount the microSD card's FAT32 filesystem
+// on the M4, this also settles on the fastest I2C speed the link works at,
+// starting from Fast-mode Plus (see mBus.h)
 bool m_sd_init (void);
 
 // flush any pending writes and unmount the filesystem
@@ -161,6 +202,9 @@ bool m_sd_close_file (uint8_t file_id);
 
 // seek to a location within the opened file
 // an offset of FILE_END_POS will seek to the end of the file
+//
+// the seek position is tracked locally, so the card only hears about a seek
+// when the next read or write needs it somewhere it isn't already
 #define FILE_END_POS ((uint32_t)0xffffffff)
 bool m_sd_seek (uint8_t file_id,
                 uint32_t offset);
@@ -169,6 +213,11 @@ bool m_sd_seek (uint8_t file_id,
 bool m_sd_get_seek_pos (uint8_t file_id,
                         uint32_t *offset);
 
+// the most that fits in one read or write command: the data length field is
+// a single byte, and a write also has to carry the file id
+#define M_SD_MAX_READ_LENGTH  255
+#define M_SD_MAX_WRITE_LENGTH 254
+
 // read from the current location in the file
 // updates the seek position
 //
@@ -184,5 +233,132 @@ bool m_sd_write_file (uint8_t file_id,
                       uint32_t length,
                       uint8_t *buffer);
 
+// bulk versions of the above for ranges of any length
+// the transfer is split into back-to-back frames of the largest size the
+// protocol allows, so a 64 KB read takes ~260 commands rather than the
+// ~1000 that 64-byte reads would
+//
+// on failure, *done (if not NULL) says how many bytes made it across
+bool m_sd_read_stream (uint8_t file_id,
+                       uint32_t length,
+                       uint8_t *buffer,
+                       uint32_t *done);
+
+bool m_sd_write_stream (uint8_t file_id,
+                        uint32_t length,
+                        uint8_t *buffer,
+                        uint32_t *done);
+
+// the same again for a buffer with M_SD_FRAME_HEADROOM spare bytes in front
+// of it: each frame's header is written there (or over the end of the frame
+// before), so the data goes between the buffer and the bus without being
+// copied, and the borrowed bytes are put back before these return
+// the other transfers still frame everything after their first frame in
+// place, but the first one goes through a copy
+#define M_SD_FRAME_HEADROOM 8
+
+bool m_sd_read_framed (uint8_t file_id,
+                       uint32_t length,
+                       uint8_t *buffer,
+                       uint32_t *done);
+
+bool m_sd_write_framed (uint8_t file_id,
+                        uint32_t length,
+                        uint8_t *buffer,
+                        uint32_t *done);
+
+// seek and then read or write any amount, the way a page fill or a journal
+// record wants it; with compound orders the seek goes out as part of the
+// first frame, so a short transfer is a single round trip
+bool m_sd_pread (uint8_t file_id,
+                 uint32_t offset,
+                 uint32_t length,
+                 uint8_t *buffer);
+
+bool m_sd_pwrite (uint8_t file_id,
+                  uint32_t offset,
+                  uint32_t length,
+                  uint8_t *buffer);
+
+// the size of an open file
+// usually answered locally, since the card says when the file is opened
+// (with compound orders) or the first time it's needed
+bool m_sd_file_size (uint8_t file_id,
+                     uint32_t *size);
+
+
+//-----------------------------------------------
+// Non-blocking file access:
+//
+// A request seeks to an offset in an open file and then reads or writes a
+// range of any length, in the background.  On the M4 each I2C transfer is
+// started from the completion interrupt of the one before it, so nothing
+// spins while the data moves.  m_sd_poll() still has to be called every so
+// often (eg. while waiting for a key press): it paces the retries while the
+// mMicroSD is busy, starts queued requests, and runs completion callbacks.
+//
+// The request and its buffer belong to the queue until the request is
+// finished.  Requests run in the order they were submitted, and any of the
+// blocking functions above will wait for the queue to empty first.  After
+// a request the file's seek position is at the end of its range.
+//
+// On the M2 a request runs to completion inside the submit call.
+
+typedef enum m_sd_request_state
+{
+    M_SD_REQUEST_IDLE = 0,  // never submitted
+    M_SD_REQUEST_QUEUED,    // waiting for the requests ahead of it
+    M_SD_REQUEST_ACTIVE,    // on the bus
+    M_SD_REQUEST_DONE,      // finished successfully
+    M_SD_REQUEST_FAILED     // finished with an error, see error
+} m_sd_request_state;
+
+typedef struct m_sd_request m_sd_request;
+
+// called from m_sd_poll(), never from an interrupt
+typedef void (*m_sd_callback) (m_sd_request *request);
+
+struct m_sd_request
+{
+    uint8_t  file_id;
+    bool     write;
+    uint32_t offset;
+    uint32_t length;
+    uint8_t *buffer;
+    
+    m_sd_callback callback;  // may be NULL
+    void *context;           // not touched, for the caller's use
+    
+    volatile m_sd_request_state state;
+    uint32_t done;           // bytes transferred so far
+    m_sd_errors error;
+    
+    m_sd_request *next;
+};
+
+bool m_sd_submit_read (m_sd_request *request,
+                       uint8_t file_id,
+                       uint32_t offset,
+                       uint32_t length,
+                       uint8_t *buffer,
+                       m_sd_callback callback);
+
+bool m_sd_submit_write (m_sd_request *request,
+                        uint8_t file_id,
+                        uint32_t offset,
+                        uint32_t length,
+                        uint8_t *buffer,
+                        m_sd_callback callback);
+
+// move the queue along, returns quickly
+void m_sd_poll (void);
+
+// whether any requests are queued or active
+bool m_sd_busy (void);
+
+// poll until the request is finished
+// sets m_sd_error_code to the request's error
+bool m_sd_wait (m_sd_request *request);
+
 #endif
 
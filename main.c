@@ -9,6 +9,9 @@ and modify the files on a FAT32-formatted microSD card.
 
 
 #include "main.h"
+#include "pageCache.h"
+#include "perf.h"
+#include "trace.h"
 
 void process_command (void);
 
@@ -28,10 +31,7 @@ char *command_ptr = command_buffer;
 char *command_tokens[(COMMAND_SIZE + 1) / 2];
 
 
-extern volatile uint32_t Receive_length;
 extern __IO uint32_t packet_sent;
-extern __IO uint32_t packet_receive;
-extern uint8_t Receive_Buffer[64];
 
 bool fatal_error = false;
 
@@ -53,15 +53,27 @@ int main (void)
 reconnect:
     while (bDeviceState != CONFIGURED);
     
+    // a terminal usually opens the port just after the device is configured,
+    // so the welcome screen waits for that, but not forever
+    const mDeadline port_deadline = mMsDeadline (1000);
+    
     sd_initialized = m_sd_init();
     
-    mWaitms (1000);
+    // whatever was being edited before a disconnect is gone with its file
+    // ids, but a save that the disconnect cut short gets finished now
+    forget_pages();
+    const bool recovered = !sd_initialized || recover_saves();
+    
+    while (!mUSBPortOpen() && !mMsPassed (port_deadline));
     welcome_screen();
     
     if (!sd_initialized)
         printf ("ERROR: Could not initialize microSD card\r\n");
+    else if (!recovered)
+        printf ("ERROR: Could not finish an interrupted save (error %d)\r\n", m_sd_error_code);
     
     printf ("> ");
+    mUSBFlush();
     
     for (;;)
     {
@@ -108,6 +120,7 @@ reconnect:
             command_ptr = command_buffer;  // reset the current command length to 0
             
             printf ("> ");
+            mUSBFlush();
         }
         else if (c == 8 || c == 127)
         {  // received backspace (or delete)
@@ -210,7 +223,7 @@ void process_command (void)
     */
     
     if (strcmp (command_tokens[0], "help") == 0)
-        printf ("Commands: ls, cd, print, mkdir, rmdir, write, append, edit, keycode\r\n");
+        printf ("Commands: ls, cd, print, mkdir, rmdir, write, append, edit, keycode, perf, trace, link\r\n");
     else if (strcmp (command_tokens[0], "ls") == 0)
     {
         if (num_tokens > 1)
@@ -341,9 +354,10 @@ void process_command (void)
             return;
         }
         
-        edit (fid, command_tokens[1]);
+        edit (&fid, command_tokens[1]);
         
-        if (!m_sd_close_file (fid))
+        // a failed save can leave the file already closed
+        if (fid != INVALID_FID && !m_sd_close_file (fid))
         {
             printf ("Error closing file!  Error code %d\r\n", m_sd_error_code);
         }
@@ -352,6 +366,29 @@ void process_command (void)
     {  // print the ASCII number of the pressed keys, CTRL-C exits
         keycodes();
     }
+    else if (strcmp (command_tokens[0], "perf") == 0)
+    {  // print the timing probes (see perf.h) and start them over
+        perf_dump();
+    }
+    else if (strcmp (command_tokens[0], "trace") == 0)
+    {  // the event trace, see trace.h
+        if (num_tokens == 2 && strcmp (command_tokens[1], "dump") == 0)
+            trace_dump();
+        else if (num_tokens == 2 && strcmp (command_tokens[1], "clear") == 0)
+            trace_clear();
+        else if (num_tokens == 1)
+            printf ("%lu events in the trace (it keeps the last %u)\r\n", (unsigned long)trace_count(), TRACE_RECORDS);
+        else
+            printf ("usage: trace [dump|clear]\r\n");
+    }
+    else if (strcmp (command_tokens[0], "link") == 0)
+    {  // the I2C speed m_sd_init() settled on, and what's gone wrong at it
+        printf ("I2C at %lu kHz\r\n", (unsigned long)mBusSpeedKHz (mBusGetSpeed()));
+        printf ("%lu NACKs (%lu early polls), %lu bus errors, %lu timeouts, %lu restarts, %lu fallbacks\r\n",
+                (unsigned long)mBusStats.nacks, (unsigned long)m_sd_early_polls,
+                (unsigned long)mBusStats.bus_errors, (unsigned long)mBusStats.timeouts,
+                (unsigned long)mBusStats.restarts, (unsigned long)mBusStats.fallbacks);
+    }
     else
     {
         printf ("unknown command\r\n");
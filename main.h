@@ -1,9 +1,6 @@
 #ifndef MAIN_H
 #define MAIN_H
 
-#include "mGeneral.h"
-#include "mBus.h"
-#include "mUSB.h"
 #include "m_microsd.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -25,7 +22,7 @@ void writeToFile  (const char *fileName,
                    uint8_t *data);  // write or append text to a file
 
 // edit.c:
-void edit (uint8_t file_id, const char *name);  // open the text editor for this file
+void edit (uint8_t *file_id, const char *name);  // open the text editor for this file
 
 // keycodes.c:
 void keycodes (void);  // print the ASCII code of the pressed key
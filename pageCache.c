@@ -1,118 +1,381 @@
+
 #include "pageCache.h"
+#include "perf.h"
+#include <string.h>
 
-#define INVALID_FID    0xff
 #define INVALID_OFFSET 0xffffffff
 
 /*
-typedef struct Page
-{
-    char data[PAGE_BYTES];
-    uint16_t num_bytes;
-    bool modified;
-    
-    uint32_t file_offset;
-} Page;
+The document is held as a piece table: an ordered list of spans, each one
+pointing either into the file as it was last saved on the card (ORIGINAL) or
+into an append-only arena of typed text in RAM (ADDED).  Inserting or deleting
+a character only splits or trims a span, so nothing on the card moves until
+save_pages() writes the edited document back out.
+
+The Page buffers are just rendered windows onto that document.  They're
+patched in RAM as the user types, and refilled from the piece table when they
+scroll.  While the editor waits for a key, prefetch_pages() tops up the pages
+either side of the current one in the background, so scrolling normally finds
+them already in RAM.
 */
 
+#define ADD_BYTES  1024  // typed text kept in RAM between saves
+#define MAX_PIECES 64
+
+// where save_pages() writes the new text before copying it over the original
+#define SAVE_TEMP_NAME     "EDITSAVE.TMP"
+#define SAVE_TEMP_NAME_ALT "EDITSAV2.TMP"
+
+typedef enum PieceSource
+{
+    ORIGINAL = 0,
+    ADDED
+} PieceSource;
+
+typedef struct Piece
+{
+    uint32_t start;   // offset into the file on the card, or into add_arena
+    uint32_t length;
+    uint8_t source;   // PieceSource
+} Piece;
+
 #define NUM_PAGES 3
 
 uint8_t active_fid = INVALID_FID;
+char active_name[13];
 uint32_t active_fid_disk_size = 0;
-//Page page[4];
-Page page[NUM_PAGES];
+uint32_t document_bytes = 0;
+
+static Piece piece[MAX_PIECES];
+static uint8_t num_pieces = 0;
+
+static char add_arena[ADD_BYTES];
+static uint16_t add_used = 0;
+
+// bytes inserted or deleted since the last save, and when the latest was
+static uint32_t unsaved_bytes = 0;
+static uint32_t last_edit_ms = 0;
 
-Page saveTemp;
+// a save got as far as its temp file but not through the copy back, so the
+// file on the card may be part old and part new text (see untimed_save_pages())
+static bool recovery_pending = false;
+
+// the temp file while it's open, which it stays if a failed save couldn't
+// close it, so the next save can
+static uint8_t save_temp_fid = INVALID_FID;
+
+Page page[NUM_PAGES];
 
 Page *prevPage;
 Page *currentPage;
-Page *editOverflowPage;
-//Page *nextPage;
+Page *nextPage;
 
-static bool fill_buffer (Page *buffer)
+PrefetchStats prefetch_stats;
+
+// the background read in flight, if any, and the page it's filling
+static m_sd_request prefetch_request;
+static Page *prefetch_page = NULL;
+
+// the line index's background read, if one is in flight
+static m_sd_request index_request;
+static bool index_reading = false;
+
+// the line index, further down
+static void reset_line_index (void);
+static bool index_step (void);
+static bool index_complete (void);
+static void index_inserted (uint32_t offset, char c);
+static void index_deleted (uint32_t offset, char c);
+
+// the undo journal, further down
+typedef enum UndoKind
 {
-    if (buffer->num_bytes >= PAGE_BYTES)
-        return true;  // already full
-    
-    // seek to where the buffer's data runs out
-    if (!m_sd_seek (active_fid, buffer->file_offset + buffer->num_bytes))
-        return false;
-    
-    // fill the buffer line by line so we don't
-    // hit any size limits in the transfer code
-    while (buffer->num_bytes < PAGE_BYTES &&
-           buffer->file_offset + buffer->num_bytes < active_fid_disk_size)
-    {
-        uint32_t increment = COLS_PER_LINE;
-        
-        // avoid reading past the end of the file
-        if (active_fid_disk_size < buffer->file_offset + buffer->num_bytes + increment)
-            increment = active_fid_disk_size -
-                           (buffer->file_offset + (uint32_t)buffer->num_bytes);
-       
-        // avoid reading more than the buffer can hold
-        if (buffer->num_bytes + increment > PAGE_BYTES)
-            increment = PAGE_BYTES - buffer->num_bytes;
-        
-        if (!m_sd_read_file (active_fid, increment, &(buffer->data[buffer->num_bytes]) ))
-            return false;
-        
-        buffer->num_bytes += increment;
+    UNDO_INSERT = 0,
+    UNDO_BACKSPACE,  // deleted going backwards, the cursor was after the text
+    UNDO_DELETE      // deleted going forwards, the cursor was before it
+} UndoKind;
+
+static void reset_undo (void);
+static void record_edit (uint8_t kind, uint32_t offset, char c);
+
+// save recovery, further down
+static bool recover_save (const char *temp_name, uint8_t *file_id);
+
+// start over with a single piece covering the whole file on the card
+static void reset_pieces (uint32_t file_size)
+{
+    piece[0].start = 0;
+    piece[0].length = file_size;
+    piece[0].source = ORIGINAL;
+
+    num_pieces = (file_size > 0) ? 1 : 0;
+    add_used = 0;
+    unsaved_bytes = 0;
+}
+
+// find the piece holding a document offset
+// *within is set to the position inside that piece; an offset at the very
+// end of the document returns num_pieces
+static uint8_t find_piece (uint32_t offset, uint32_t *within)
+{
+    uint8_t i;
+    for (i = 0; i < num_pieces; i++)
+    {
+        if (offset < piece[i].length)
+            break;
+        offset -= piece[i].length;
     }
+
+    *within = offset;
+    return i;
 }
 
-bool init_pages (uint8_t file_id)
+// make room for a new piece at index i
+static void open_piece_slot (uint8_t i)
 {
-    if (active_fid != INVALID_FID)
-        save_pages();
-    
-    active_fid = file_id;
-    
-    for (uint8_t i = 0; i < 4; i++)
+    for (uint8_t j = num_pieces; j > i; j--)
+        piece[j] = piece[j - 1];
+    num_pieces++;
+}
+
+static void close_piece_slot (uint8_t i)
+{
+    num_pieces--;
+    for (uint8_t j = i; j < num_pieces; j++)
+        piece[j] = piece[j + 1];
+}
+
+// read straight from the file on the card
+// every buffer read_document() fills has M_SD_FRAME_HEADROOM bytes in front
+// of it (pages, index_buffer and save_buffer), so the data comes off the bus
+// straight into it
+static bool read_original (uint32_t offset, uint32_t length, char *buffer)
+{
+    if (length == 0)
+        return true;
+    if (recovery_pending)
+        return false;  // the pieces don't describe the file any more
+
+    return m_sd_seek (active_fid, offset) &&
+           m_sd_read_framed (active_fid, length, (uint8_t*)buffer, NULL);
+}
+
+// read a range of the edited document
+static bool read_document (uint32_t offset, uint32_t length, char *buffer)
+{
+    uint32_t within;
+    uint8_t i = find_piece (offset, &within);
+
+    while (length > 0 && i < num_pieces)
     {
-        page[i].num_bytes = 0;
-        page[i].modified = false;
-        page[i].file_offset = INVALID_OFFSET;
+        uint32_t count = piece[i].length - within;
+        if (count > length)
+            count = length;
+
+        if (piece[i].source == ADDED)
+            memcpy (buffer, &add_arena[piece[i].start + within], count);
+        else if (!read_original (piece[i].start + within, count, buffer))
+            return false;
+
+        buffer += count;
+        length -= count;
+        within = 0;
+        i++;
     }
-    
-    // get the file's size on disk
-    if (!m_sd_seek (file_id, FILE_END_POS))
+
+    return (length == 0);
+}
+
+static void clear_page (Page *buffer, uint32_t file_offset)
+{
+    buffer->num_bytes = 0;
+    buffer->file_offset = file_offset;
+}
+
+static bool untimed_fill_buffer (Page *buffer)
+{
+    if (buffer->file_offset == INVALID_OFFSET)
+        return false;
+
+    const uint32_t start = buffer->file_offset + buffer->num_bytes;
+
+    if (buffer->num_bytes >= PAGE_BYTES || start >= document_bytes)
+        return true;  // already full
+
+    uint32_t increment = PAGE_BYTES - buffer->num_bytes;
+
+    // avoid reading past the end of the document
+    if (start + increment > document_bytes)
+        increment = document_bytes - start;
+
+    if (!read_document (start, increment, &(buffer->data[buffer->num_bytes])))
         return false;
-    
-    if (!m_sd_get_seek_pos (file_id, &active_fid_disk_size))
+
+    buffer->num_bytes += increment;
+    return true;
+}
+
+// top the buffer up to a full page, or to the end of the document
+static bool fill_buffer (Page *buffer)
+{
+    const uint32_t start = PERF_START();
+    const bool filled = untimed_fill_buffer (buffer);
+    perf_record (PERF_FILL_BUFFER, start);
+    return filled;
+}
+
+// an edit at this offset leaves only the bytes in front of it valid
+static void trim_page (Page *buffer, uint32_t offset)
+{
+    if (buffer->file_offset == INVALID_OFFSET ||
+        buffer->file_offset + buffer->num_bytes <= offset)
+        return;
+
+    if (buffer->file_offset <= offset)
+        buffer->num_bytes = offset - buffer->file_offset;
+    else
+        clear_page (buffer, INVALID_OFFSET);
+}
+
+// whether nextPage picks up exactly where currentPage leaves off
+static bool next_page_follows (void)
+{
+    return (nextPage->file_offset == currentPage->file_offset + currentPage->num_bytes);
+}
+
+// whether the page holds everything it can, so showing it won't touch the card
+static bool page_complete (const Page *buffer)
+{
+    return (buffer->file_offset == INVALID_OFFSET ||
+            buffer->num_bytes >= PAGE_BYTES ||
+            buffer->file_offset + buffer->num_bytes >= document_bytes);
+}
+
+// where page_up() will look for the page before the current one
+static uint32_t prev_page_offset (void)
+{
+    return (currentPage->file_offset > PAGE_BYTES) ?
+           currentPage->file_offset - PAGE_BYTES :
+           0;
+}
+
+static void prefetch_done (m_sd_request *request)
+{
+    if (request->state == M_SD_REQUEST_DONE)
+        prefetch_page->num_bytes += request->length;
+
+    prefetch_page = NULL;
+}
+
+// anything that edits the document or moves the pages has to let the
+// background reads land first, since they were aimed at the old layout
+static void finish_background (void)
+{
+    if (prefetch_page != NULL)
+        m_sd_wait (&prefetch_request);
+    if (index_reading)
+        m_sd_wait (&index_request);
+}
+
+void prefetch_pages (void)
+{
+    if (active_fid == INVALID_FID || prefetch_page != NULL || recovery_pending)
+        return;  // nothing open, the last step is still on its way, or the
+                 // file can't be read until a save is recovered
+
+    if (prevPage->file_offset == INVALID_OFFSET && currentPage->file_offset > 0)
+        clear_page (prevPage, prev_page_offset());
+
+    // scrolling down is the more common case, so that side goes first
+    Page *target = nextPage;
+    if (page_complete (target))
+        target = prevPage;
+    if (page_complete (target))
+        return;
+
+    // one piece at a time, so each step is a single contiguous read
+    const uint32_t start = target->file_offset + target->num_bytes;
+    uint32_t count = PAGE_BYTES - target->num_bytes;
+    if (start + count > document_bytes)
+        count = document_bytes - start;
+
+    uint32_t within;
+    const uint8_t i = find_piece (start, &within);
+    if (count > piece[i].length - within)
+        count = piece[i].length - within;
+
+    char *destination = &target->data[target->num_bytes];
+
+    if (piece[i].source == ADDED)
+    {
+        memcpy (destination, &add_arena[piece[i].start + within], count);
+        target->num_bytes += count;
+        return;
+    }
+
+    prefetch_page = target;
+    if (!m_sd_submit_read (&prefetch_request, active_fid, piece[i].start + within,
+                           count, (uint8_t*)destination, prefetch_done))
+    {
+        prefetch_page = NULL;
+    }
+}
+
+bool init_pages (uint8_t file_id, const char *name)
+{
+    // the last file should have been let go of already; either way nothing
+    // is saved through its id, which may belong to another file by now
+    release_pages();
+
+    prefetch_stats.hits = 0;
+    prefetch_stats.misses = 0;
+
+    active_fid = file_id;
+    strncpy (active_name, name, sizeof (active_name) - 1);
+    active_name[sizeof (active_name) - 1] = '\0';
+
+    for (uint8_t i = 0; i < NUM_PAGES; i++)
+        clear_page (&page[i], INVALID_OFFSET);
+
+    // finish off a save of this file (or one left pending by the last file)
+    // that was cut short
+    if (!recover_save (SAVE_TEMP_NAME, &active_fid) ||
+        !recover_save (SAVE_TEMP_NAME_ALT, &active_fid))
     {
-        m_sd_seek (file_id, 0);
         return false;
     }
-    
-    // seek to the beginning of the file
-    if (!m_sd_seek (file_id, 0))
+
+    // get the file's size on disk, under the id the recovery may have given it
+    if (!m_sd_file_size (active_fid, &active_fid_disk_size))
         return false;
-    
+
+    document_bytes = active_fid_disk_size;
+    reset_pieces (active_fid_disk_size);
+
+    // the line index is built in the background by index_lines()
+    reset_line_index();
+    reset_undo();
+
     // set up the page pointers
     prevPage = &page[0];
     currentPage = &page[1];
-    editOverflowPage = &page[2];
-    
-    // initialize the "previous page" buffer
-    prevPage->num_bytes = 0;
-    prevPage->file_offset = 0;
-    prevPage->modified = false;
-    
-    // initialize and read into the "current page" buffer
-    currentPage->num_bytes = 0;
-    currentPage->file_offset = 0;
-    currentPage->modified = false;
+    nextPage = &page[2];
+
+    // read the first page
+    clear_page (currentPage, 0);
     if (!fill_buffer (currentPage))
         return false;
-    
-    // initialize the "edit overflow" buffer
-    editOverflowPage->num_bytes = 0;
-    editOverflowPage->file_offset = currentPage->num_bytes;
-    editOverflowPage->modified = false;
-    
+
+    clear_page (nextPage, currentPage->num_bytes);
+
     return true;
 }
 
+uint8_t active_file_id (void)
+{
+    return active_fid;
+}
+
 bool is_first_page (void)
 {
     return (currentPage->file_offset == 0);
@@ -120,209 +383,1430 @@ bool is_first_page (void)
 
 bool is_last_page  (void)
 {
-    return (currentPage->file_offset + PAGE_BYTES >= active_fid_disk_size);
+    return (currentPage->file_offset + PAGE_BYTES >= document_bytes);
 }
 
-bool insert_char (char c, int pos)
+uint32_t document_size (void)
 {
-    if (currentPage->num_bytes < PAGE_BYTES)
-    {  // there's room for another character in our current buffer
-        // shift everything beyond pos forward
-        for (int i = PAGE_BYTES - 1; i > pos; i--)
-            currentPage->data[i] = currentPage->data[i - 1];
-        
-        currentPage->num_bytes++;
-        editOverflowPage->file_offset++;
-        
-        currentPage->data[pos] = c;
-        return true;
+    return document_bytes;
+}
+
+#define COPY_CHUNK 128
+
+bool copy_document (uint32_t offset, uint32_t length, char *buffer)
+{
+    if (active_fid == INVALID_FID || offset > document_bytes || length > document_bytes - offset)
+        return false;
+
+    finish_background();
+
+    // the caller's buffer needn't have room in front, so it goes through one
+    // that does
+    char frame[M_SD_FRAME_HEADROOM + COPY_CHUNK];
+    while (length > 0)
+    {
+        const uint32_t chunk = (length > COPY_CHUNK) ? COPY_CHUNK : length;
+        if (!read_document (offset, chunk, &frame[M_SD_FRAME_HEADROOM]))
+            return false;
+        memcpy (buffer, &frame[M_SD_FRAME_HEADROOM], chunk);
+
+        offset += chunk;
+        buffer += chunk;
+        length -= chunk;
     }
-    else if (editOverflowPage->num_bytes < PAGE_BYTES)
-    {  // there's room in the overflow buffer
-        // shift everything in the overflow buffer forward
-        for (int i = PAGE_BYTES - 1; i > 0; i--)
-            editOverflowPage->data[i] = editOverflowPage->data[i - 1];
-        
-        // copy the last byte of the current page into the first byte of overflow
-        editOverflowPage->data[0] = currentPage->data[PAGE_BYTES - 1];
-        editOverflowPage->num_bytes++;
-        
-        // shift everything beyond pos forward in the current buffer
-        for (int i = PAGE_BYTES - 1; i > pos; i--)
-            currentPage->data[i] = currentPage->data[i - 1];
-        
-        currentPage->data[pos] = c;
-        return true;
+    return true;
+}
+
+static bool insert_at (uint32_t offset, char c)
+{
+    if (recovery_pending)
+        return false;
+
+    // make sure a worst-case split still fits; if not, flush our edits
+    // to the card so the table starts over with a single piece
+    if (add_used >= ADD_BYTES || num_pieces + 2 > MAX_PIECES)
+    {
+        if (!save_pages())
+            return false;
+    }
+
+    uint32_t within;
+    uint8_t i = find_piece (offset, &within);
+
+    if (within == 0 && i > 0 &&
+        piece[i - 1].source == ADDED &&
+        piece[i - 1].start + piece[i - 1].length == add_used)
+    {  // continuing the run we typed last, just extend it
+        piece[i - 1].length++;
     }
     else
-    {  // both the current and edit overflow buffers are full
-        // we need to save first, to clear out the overflow buffer
+    {
+        if (within > 0)
+        {  // split the piece at the insertion point
+            open_piece_slot (i + 1);
+            piece[i + 1].start = piece[i].start + within;
+            piece[i + 1].length = piece[i].length - within;
+            piece[i + 1].source = piece[i].source;
+            piece[i].length = within;
+            i++;
+        }
+
+        open_piece_slot (i);
+        piece[i].start = add_used;
+        piece[i].length = 1;
+        piece[i].source = ADDED;
+    }
+
+    add_arena[add_used++] = c;
+    document_bytes++;
+
+    unsaved_bytes++;
+    last_edit_ms = mMillis();
+    return true;
+}
+
+static bool delete_at (uint32_t offset)
+{
+    if (offset >= document_bytes || recovery_pending)
+        return false;
+
+    if (num_pieces + 1 > MAX_PIECES)
+    {
         if (!save_pages())
             return false;
-        
-        // copy the last byte of the current page into the first byte of overflow
-        editOverflowPage->data[0] = currentPage->data[PAGE_BYTES - 1];
-        editOverflowPage->num_bytes++;
-        
-        // shift everything beyond pos forward in the current buffer
-        for (int i = PAGE_BYTES - 1; i > pos; i--)
-            currentPage->data[i] = currentPage->data[i - 1];
-        
+    }
+
+    uint32_t within;
+    uint8_t i = find_piece (offset, &within);
+
+    if (within == piece[i].length - 1)
+    {  // trim the end of the piece
+        piece[i].length--;
+
+        // backspacing over something we just typed gives the space back
+        if (piece[i].source == ADDED && piece[i].start + piece[i].length + 1 == add_used)
+            add_used--;
+    }
+    else if (within == 0)
+    {  // trim the start of the piece
+        piece[i].start++;
+        piece[i].length--;
+    }
+    else
+    {  // split the piece around the deleted byte
+        open_piece_slot (i + 1);
+        piece[i + 1].start = piece[i].start + within + 1;
+        piece[i + 1].length = piece[i].length - within - 1;
+        piece[i + 1].source = piece[i].source;
+        piece[i].length = within;
+    }
+
+    if (piece[i].length == 0)
+        close_piece_slot (i);
+
+    document_bytes--;
+
+    unsaved_bytes++;
+    last_edit_ms = mMillis();
+    return true;
+}
+
+bool insert_char (char c, int pos)
+{
+    if (pos < 0 || pos > currentPage->num_bytes)
+        return false;
+
+    finish_background();
+
+    const uint32_t offset = currentPage->file_offset + pos;
+    const bool follows = next_page_follows();
+
+    if (!insert_at (offset, c))
+        return false;
+
+    index_inserted (offset, c);
+    record_edit (UNDO_INSERT, offset, c);
+    trim_page (prevPage, offset);
+
+    if (currentPage->num_bytes < PAGE_BYTES)
+    {  // there's room for another character in the current page
+        memmove (&currentPage->data[pos + 1], &currentPage->data[pos],
+                 currentPage->num_bytes - pos);
         currentPage->data[pos] = c;
+        currentPage->num_bytes++;
+
+        if (follows)
+            nextPage->file_offset++;
+        else
+            trim_page (nextPage, offset);
+
         return true;
     }
+
+    // the current page is full, so its last byte gets pushed onto the next one
+    char spill = c;
+    if (pos < PAGE_BYTES)
+    {
+        spill = currentPage->data[PAGE_BYTES - 1];
+        memmove (&currentPage->data[pos + 1], &currentPage->data[pos],
+                 PAGE_BYTES - 1 - pos);
+        currentPage->data[pos] = c;
+    }
+
+    if (follows)
+    {
+        uint16_t keep = nextPage->num_bytes;
+        if (keep == PAGE_BYTES)
+            keep--;
+
+        memmove (&nextPage->data[1], &nextPage->data[0], keep);
+        nextPage->data[0] = spill;
+        nextPage->num_bytes = keep + 1;
+    }
+    else
+        trim_page (nextPage, offset);
+
+    return true;
 }
 
-void backspace_char (int pos)
+// delete the byte before pos, recorded as the given UndoKind
+static bool remove_char (int pos, uint8_t kind)
 {
-    if (pos == 0 || pos >= currentPage->num_bytes)
-        return;
-    
+    if (pos <= 0 || pos > currentPage->num_bytes)
+        return true;  // nothing to delete
+
+    finish_background();
+
+    const uint32_t offset = currentPage->file_offset + pos - 1;
+    const bool follows = next_page_follows();
+
+    const char deleted = currentPage->data[pos - 1];
+    if (!delete_at (offset))
+        return false;
+
+    index_deleted (offset, deleted);
+    record_edit (kind, offset, deleted);
+    trim_page (prevPage, offset);
+
     // shift everything beyond pos-1 back one space
-    for (int i = pos; i < currentPage->num_bytes; i++)
-        currentPage->data[i - 1] = currentPage->data[i];
-    
+    memmove (&currentPage->data[pos - 1], &currentPage->data[pos],
+             currentPage->num_bytes - pos);
     currentPage->num_bytes--;
+
+    if (!follows)
+        trim_page (nextPage, offset);
+    else if (nextPage->num_bytes > 0)
+    {  // pull the first byte of the next page onto the end of this one
+        currentPage->data[currentPage->num_bytes++] = nextPage->data[0];
+
+        memmove (&nextPage->data[0], &nextPage->data[1], nextPage->num_bytes - 1);
+        nextPage->num_bytes--;
+    }
+    else
+        nextPage->file_offset--;
+
+    // only touches the card if the next page wasn't already in RAM
+    return fill_buffer (currentPage);
 }
 
-void delete_char (int pos)
+bool backspace_char (int pos)
 {
-    backspace_char (pos + 1);
+    return remove_char (pos, UNDO_BACKSPACE);
+}
+
+bool delete_char (int pos)
+{
+    return remove_char (pos + 1, UNDO_DELETE);
+}
+
+// a page that's still arriving when it's needed counts as a miss
+static void count_prefetch (const Page *buffer, uint32_t offset)
+{
+    if (buffer != prefetch_page && buffer->file_offset == offset && page_complete (buffer))
+        prefetch_stats.hits++;
+    else
+        prefetch_stats.misses++;
 }
 
 bool page_down (void)
 {
-    // save the document if the prev page buffer has been modified
-    if (prevPage->modified && prevPage->file_offset != INVALID_OFFSET)
-        save_pages();
-    
-    // dump the prev page buffer
-    prevPage->num_bytes = 0;
-    prevPage->modified = false;
-    prevPage->file_offset = INVALID_OFFSET;
-    
+    const uint32_t offset = currentPage->file_offset + currentPage->num_bytes;
+
+    count_prefetch (nextPage, offset);
+    finish_background();
+
     // shift the buffers
     Page *formerPrevPage = prevPage;
     prevPage = currentPage;
-    currentPage = editOverflowPage;
-    editOverflowPage = formerPrevPage;
-    
+    currentPage = nextPage;
+    nextPage = formerPrevPage;
+
+    if (currentPage->file_offset != offset)
+        clear_page (currentPage, offset);
+
     // fill the current page to its limit
-    fill_buffer (currentPage);
-    
-    // initialize the new edit overflow page
-    editOverflowPage->file_offset = currentPage->file_offset + currentPage->num_bytes;
-    editOverflowPage->num_bytes = 0;
-    editOverflowPage->modified = false;
+    if (!fill_buffer (currentPage))
+        return false;
+
+    clear_page (nextPage, currentPage->file_offset + currentPage->num_bytes);
+    return true;
+}
+
+// throw the pages away and show the document from offset
+static bool show_page_at (uint32_t offset)
+{
+    clear_page (prevPage, INVALID_OFFSET);
+    clear_page (currentPage, offset);
+    if (!fill_buffer (currentPage))
+        return false;
+
+    clear_page (nextPage, currentPage->file_offset + currentPage->num_bytes);
+    return true;
 }
 
 bool page_up (void)
 {
-    // save the edit overflow page if it's been modified
-    if (editOverflowPage->modified && editOverflowPage->file_offset != INVALID_OFFSET)
-        save_pages();
-    
+    const uint32_t offset = prev_page_offset();
+
+    count_prefetch (prevPage, offset);
+    finish_background();
+
     // shift the buffers
-    Page *swap = editOverflowPage;
-    editOverflowPage = currentPage;
+    Page *formerNextPage = nextPage;
+    nextPage = currentPage;
     currentPage = prevPage;
-    prevPage = swap;
-    
-    // initialize the new prev page
-    prevPage->file_offset = (currentPage->file_offset >= PAGE_BYTES) ?
-                            currentPage->file_offset - PAGE_BYTES :
-                            INVALID_OFFSET;
-    prevPage->num_bytes = 0;
-    prevPage->modified = false;
-    
-    if (prevPage->file_offset != INVALID_OFFSET)
-    {
-        if (!fill_buffer (prevPage))
-            return false;
-    }
-    
-    // initialize the new edit overflow page
-    editOverflowPage->file_offset = currentPage->file_offset + currentPage->num_bytes;
-    editOverflowPage->num_bytes = 0;
-    editOverflowPage->modified = false;
-}
+    prevPage = formerNextPage;
 
-bool save_pages (void)
-{
-    uint32_t newDiskSize = 0;
-    
-    if (active_fid == INVALID_FID)
+    if (currentPage->file_offset != offset)
+        clear_page (currentPage, offset);
+
+    if (!fill_buffer (currentPage))
         return false;
-    
-    // seek to the start of the first modified buffer and write it
-    if (prevPage->modified && prevPage->file_offset != INVALID_OFFSET)
-    {
-        if (!m_sd_seek (active_fid, prevPage->file_offset))
-            return false;
-        if (!m_sd_write_file (active_fid, prevPage->num_bytes, prevPage->data))
-            return false;
-    }
-    
-    // continue writing modified buffers until we reach the edit overflow buffer
-    if (currentPage->modified && currentPage->file_offset != INVALID_OFFSET)
-    {
-        if (!m_sd_seek (active_fid, currentPage->file_offset))
-            return false;
-        if (!m_sd_write_file (active_fid, currentPage->num_bytes, currentPage->data))
-            return false;
-    }
-    
-    if (editOverflowPage->modified && editOverflowPage->file_offset != INVALID_OFFSET)
-    {
-        // before writing the edit overflow buffer, read from the file to see
-        // what it will be overwriting on disk
-        
-        Page *tempRead = &saveTemp;
-        Page *tempWrite = editOverflowPage;
-        
-        bool finished = false;
-        while (!finished)
+
+    // the old current page only carries on from here if the pages were aligned
+    if (!next_page_follows())
+        clear_page (nextPage, currentPage->file_offset + currentPage->num_bytes);
+
+    clear_page (prevPage, INVALID_OFFSET);
+    return true;
+}
+
+
+
+/*
+Lines are found through a sparse index of line starts: a checkpoint records
+the offset where some line begins and that line's number.  The build pass
+streams the document once and drops a checkpoint every index_spacing lines;
+if the table fills up, every other checkpoint is dropped and the spacing
+doubles, so any size of file fits in a fixed amount of RAM.
+
+Edits patch the checkpoints behind the edited offset instead of rebuilding
+anything.  Finding a line is a binary search over the checkpoints and then a
+scan forward from the nearest one, which reads at most index_spacing lines.
+*/
+
+#define LINE_CHECKPOINTS 256
+#define INDEX_CHUNK      M_SD_MAX_READ_LENGTH
+
+typedef struct LineCheckpoint
+{
+    uint32_t offset;  // where the line starts in the document
+    uint32_t line;    // its number, counting from 0
+} LineCheckpoint;
+
+static LineCheckpoint checkpoint[LINE_CHECKPOINTS];
+static uint16_t num_checkpoints = 0;
+static uint32_t index_spacing = 16;
+
+static uint32_t indexed_bytes = 0;  // how much of the document the index covers
+static uint32_t indexed_lines = 0;  // line breaks found in that part
+
+static char index_frame[M_SD_FRAME_HEADROOM + INDEX_CHUNK];
+static char *const index_buffer = &index_frame[M_SD_FRAME_HEADROOM];
+
+// line number of the first byte of currentPage, found when it's needed
+static uint32_t page_line_offset = INVALID_OFFSET;
+static uint32_t page_line = 0;
+
+static void reset_line_index (void)
+{
+    checkpoint[0].offset = 0;
+    checkpoint[0].line = 0;
+    num_checkpoints = 1;
+    index_spacing = 16;
+
+    indexed_bytes = 0;
+    indexed_lines = 0;
+    page_line_offset = INVALID_OFFSET;
+}
+
+static void add_checkpoint (uint32_t offset, uint32_t line)
+{
+    if (num_checkpoints == LINE_CHECKPOINTS)
+    {  // out of room: keep every other one and space them out further
+        for (uint16_t i = 1; i < LINE_CHECKPOINTS / 2; i++)
+            checkpoint[i] = checkpoint[i * 2];
+        num_checkpoints = LINE_CHECKPOINTS / 2;
+        index_spacing *= 2;
+    }
+
+    if (line - checkpoint[num_checkpoints - 1].line < index_spacing)
+        return;
+
+    checkpoint[num_checkpoints].offset = offset;
+    checkpoint[num_checkpoints].line = line;
+    num_checkpoints++;
+}
+
+// take in the next count bytes of the document
+static void index_chunk (const char *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (data[i] == '\n')
         {
-            // set the parameters of the read buffer to begin reading
-            // where the write buffer will overwrite
-            tempRead->file_offset = tempWrite->file_offset;
-            tempRead->num_bytes = 0;
-            
-            if (!fill_buffer (tempRead))
-                return false;
-            
-            // If, after filling the temp page buffer, the buffer still
-            // has room left, then we've reached the end of the file
-            if (tempRead->num_bytes != PAGE_BYTES)
-                finished = true;
-            
-            // write the previously-buffered data to its new position
-            if (!m_sd_seek (active_fid, tempWrite->file_offset))
-                return false;
-            if (!m_sd_write_file (active_fid, tempWrite->num_bytes, tempWrite->data))
+            indexed_lines++;
+            add_checkpoint (indexed_bytes + i + 1, indexed_lines);
+        }
+    }
+
+    indexed_bytes += count;
+}
+
+// index the next stretch of the document right away
+// returns false on a read error
+static bool index_step (void)
+{
+    finish_background();
+
+    uint32_t count = document_bytes - indexed_bytes;
+    if (count > INDEX_CHUNK)
+        count = INDEX_CHUNK;
+
+    if (!read_document (indexed_bytes, count, index_buffer))
+        return false;
+
+    index_chunk (index_buffer, count);
+    return true;
+}
+
+static bool index_complete (void)
+{
+    return (indexed_bytes >= document_bytes);
+}
+
+static void index_read_done (m_sd_request *request)
+{
+    index_reading = false;
+
+    if (request->state == M_SD_REQUEST_DONE)
+        index_chunk (index_buffer, request->length);
+}
+
+void index_lines (void)
+{
+    if (active_fid == INVALID_FID || index_reading || index_complete() || recovery_pending)
+        return;
+
+    // one piece at a time, like prefetch_pages()
+    uint32_t count = document_bytes - indexed_bytes;
+    if (count > INDEX_CHUNK)
+        count = INDEX_CHUNK;
+
+    uint32_t within;
+    const uint8_t i = find_piece (indexed_bytes, &within);
+    if (count > piece[i].length - within)
+        count = piece[i].length - within;
+
+    if (piece[i].source == ADDED)
+    {
+        index_chunk (&add_arena[piece[i].start + within], count);
+        return;
+    }
+
+    index_reading = true;
+    if (!m_sd_submit_read (&index_request, active_fid, piece[i].start + within,
+                           count, (uint8_t*)index_buffer, index_read_done))
+    {
+        index_reading = false;
+    }
+}
+
+uint8_t line_index_progress (void)
+{
+    if (index_complete())
+        return 100;
+
+    return (uint8_t)((uint64_t)indexed_bytes * 100 / document_bytes);
+}
+
+// keep the index in step with a byte inserted at offset
+static void index_inserted (uint32_t offset, char c)
+{
+    if (offset > indexed_bytes)
+        return;  // the build will get to it
+
+    indexed_bytes++;
+    if (c == '\n')
+        indexed_lines++;
+
+    for (uint16_t i = 0; i < num_checkpoints; i++)
+    {
+        if (checkpoint[i].offset > offset)
+        {
+            checkpoint[i].offset++;
+            if (c == '\n')
+                checkpoint[i].line++;
+        }
+    }
+
+    if (page_line_offset != INVALID_OFFSET && page_line_offset > offset)
+        page_line_offset = INVALID_OFFSET;
+}
+
+// keep the index in step with the byte c being deleted from offset
+static void index_deleted (uint32_t offset, char c)
+{
+    if (offset >= indexed_bytes)
+        return;
+
+    indexed_bytes--;
+    if (c == '\n')
+        indexed_lines--;
+
+    uint16_t kept = 0;
+    for (uint16_t i = 0; i < num_checkpoints; i++)
+    {
+        LineCheckpoint point = checkpoint[i];
+        if (point.offset > offset)
+        {
+            // the line after a deleted line break doesn't start a line anymore
+            if (c == '\n' && point.offset == offset + 1)
+                continue;
+
+            point.offset--;
+            if (c == '\n')
+                point.line--;
+        }
+        checkpoint[kept++] = point;
+    }
+    num_checkpoints = kept;
+
+    if (page_line_offset != INVALID_OFFSET && page_line_offset > offset)
+        page_line_offset = INVALID_OFFSET;
+}
+
+// the last checkpoint at or before a document offset
+static const LineCheckpoint *checkpoint_before_offset (uint32_t offset)
+{
+    uint16_t low = 0;
+    uint16_t high = num_checkpoints;
+    while (high - low > 1)
+    {
+        const uint16_t middle = (low + high) / 2;
+        if (checkpoint[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+    return &checkpoint[low];
+}
+
+// the last checkpoint at or before a line
+static const LineCheckpoint *checkpoint_before_line (uint32_t line)
+{
+    uint16_t low = 0;
+    uint16_t high = num_checkpoints;
+    while (high - low > 1)
+    {
+        const uint16_t middle = (low + high) / 2;
+        if (checkpoint[middle].line <= line)
+            low = middle;
+        else
+            high = middle;
+    }
+    return &checkpoint[low];
+}
+
+// number of the line holding a document offset
+static bool line_of_offset (uint32_t offset, uint32_t *line)
+{
+    finish_background();  // it shares index_buffer
+
+    const LineCheckpoint *point = checkpoint_before_offset (offset);
+
+    uint32_t position = point->offset;
+    *line = point->line;
+    while (position < offset)
+    {
+        uint32_t count = offset - position;
+        if (count > INDEX_CHUNK)
+            count = INDEX_CHUNK;
+
+        if (!read_document (position, count, index_buffer))
+            return false;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (index_buffer[i] == '\n')
+                (*line)++;
+        }
+        position += count;
+    }
+
+    return true;
+}
+
+// document offset where a line starts
+static bool find_line_start (uint32_t line, uint32_t *offset)
+{
+    finish_background();  // it shares index_buffer
+
+    const LineCheckpoint *point = checkpoint_before_line (line);
+
+    uint32_t position = point->offset;
+    uint32_t current = point->line;
+    while (current < line)
+    {
+        uint32_t count = indexed_bytes - position;
+        if (count > INDEX_CHUNK)
+            count = INDEX_CHUNK;
+        if (count == 0)
+            return false;  // there aren't that many lines
+
+        if (!read_document (position, count, index_buffer))
+            return false;
+
+        for (uint32_t i = 0; i < count && current < line; i++)
+        {
+            position++;
+            if (index_buffer[i] == '\n')
+                current++;
+        }
+    }
+
+    *offset = position;
+    return true;
+}
+
+uint32_t line_count (void)
+{
+    return indexed_lines + 1;
+}
+
+bool current_line (int pos, uint32_t *line)
+{
+    if (!currentPage || currentPage->file_offset == INVALID_OFFSET)
+        return false;
+
+    if (page_line_offset != currentPage->file_offset)
+    {
+        // not worth a long scan when the index will get there by itself
+        if (currentPage->file_offset > indexed_bytes)
+            return false;
+
+        if (!line_of_offset (currentPage->file_offset, &page_line))
+            return false;
+        page_line_offset = currentPage->file_offset;
+    }
+
+    // the rest is already in RAM
+    *line = page_line;
+    for (int i = 0; i < pos && i < currentPage->num_bytes; i++)
+    {
+        if (currentPage->data[i] == '\n')
+            (*line)++;
+    }
+
+    return true;
+}
+
+bool goto_line (uint32_t line)
+{
+    // a line the index hasn't reached yet is worth waiting for
+    while (line >= line_count() && !index_complete())
+    {
+        if (!index_step())
+            return false;
+    }
+
+    finish_background();
+
+    if (line >= line_count())
+        line = line_count() - 1;
+
+    uint32_t offset;
+    if (!find_line_start (line, &offset))
+        return false;
+
+    if (!show_page_at (offset))
+        return false;
+
+    page_line_offset = offset;
+    page_line = line;
+    return true;
+}
+
+/*
+Every edit is recorded in the undo journal as a run: one record holds up to
+UNDO_RUN bytes typed or deleted in a row at adjacent offsets, and a run also
+ends where a new word starts, so undoing a typed word is a single step.  The
+records live in a fixed ring in RAM, with the ones already undone (and so
+available to redo) after the ones that can still be undone.
+
+Once more than UNDO_KEEP records are in RAM, the oldest ones are due to be
+written out to a journal file on the card, which is kept as a stack of
+fixed-size records; undoing past what's in RAM reads them back in, newest
+first.  The writing waits for spill_undo_history() while the editor is idle,
+so typing never waits on the card; the spare slots above UNDO_KEEP take the
+records made in the meantime, and only if they run out too (a burst of keys
+with no pause at all) is a record written out there and then.  Redo only
+ever lives in RAM, so if a record has to come back in while the ring is
+full, the redo furthest away is forgotten to make room.  Either way the RAM
+used is fixed.
+*/
+
+#define UNDO_RECORDS 24
+#define UNDO_KEEP    20  // records kept in RAM once the idle loop has run
+#define UNDO_RUN     26  // keeps a record at 32 bytes
+
+#define UNDO_JOURNAL_NAME "EDITUNDO.JNL"
+
+typedef struct UndoRecord
+{
+    uint32_t offset;  // where the text starts in the document
+    uint8_t kind;     // UndoKind
+    uint8_t length;
+    char text[UNDO_RUN];
+} UndoRecord;
+
+static UndoRecord undo_ring[UNDO_RECORDS];
+static uint8_t undo_oldest = 0;  // ring index of the oldest record in RAM
+static uint8_t undo_count = 0;   // records that can be undone, oldest first
+static uint8_t redo_count = 0;   // undone records following them
+
+static uint8_t undo_fid = INVALID_FID;
+static uint32_t undo_spilled = 0;  // records in the journal file
+
+// an undo or redo stops the next edit from joining the record before it
+static bool undo_sealed = false;
+
+// ring index of the nth record from the oldest one in RAM
+static uint8_t undo_slot (uint8_t n)
+{
+    return (undo_oldest + n) % UNDO_RECORDS;
+}
+
+static void close_undo_journal (void)
+{
+    if (undo_fid != INVALID_FID)
+    {
+        m_sd_close_file (undo_fid);
+        m_sd_delete (UNDO_JOURNAL_NAME);
+        undo_fid = INVALID_FID;
+    }
+    undo_spilled = 0;
+}
+
+static void reset_undo (void)
+{
+    close_undo_journal();
+
+    undo_oldest = 0;
+    undo_count = 0;
+    redo_count = 0;
+    undo_sealed = false;
+}
+
+void clear_undo_history (void)
+{
+    reset_undo();
+}
+
+void release_pages (void)
+{
+    finish_background();
+
+    // a save still pending recovery is left on the card for recover_save()
+    // to finish by name, once the file is closed
+    if (save_temp_fid != INVALID_FID)
+        m_sd_close_file (save_temp_fid);
+    save_temp_fid = INVALID_FID;
+    recovery_pending = false;
+
+    active_fid = INVALID_FID;
+
+    // the undo history only lasts as long as the editing session
+    reset_undo();
+}
+
+void forget_pages (void)
+{
+    finish_background();
+
+    active_fid = INVALID_FID;
+
+    // a pending save is left for recover_saves() to finish, its temp file
+    // closed like everything else
+    recovery_pending = false;
+    save_temp_fid = INVALID_FID;
+
+    // the journal was closed along with everything else
+    if (undo_fid != INVALID_FID)
+    {
+        m_sd_delete (UNDO_JOURNAL_NAME);
+        undo_fid = INVALID_FID;
+    }
+    reset_undo();
+}
+
+// move the oldest record out of RAM and onto the card
+static void spill_undo (void)
+{
+    if (undo_fid == INVALID_FID && strcmp (active_name, UNDO_JOURNAL_NAME) != 0)
+    {
+        if (!m_sd_open_file (UNDO_JOURNAL_NAME, CREATE_FILE, &undo_fid))
+            undo_fid = INVALID_FID;
+    }
+
+    // if it can't be written, the history just ends here, and the journal
+    // goes too so the next record doesn't land on top of what's in it
+    if (undo_fid == INVALID_FID ||
+        !m_sd_pwrite (undo_fid, undo_spilled * sizeof (UndoRecord), sizeof (UndoRecord),
+                      (uint8_t*)&undo_ring[undo_oldest]))
+    {
+        close_undo_journal();
+    }
+    else
+        undo_spilled++;
+
+    undo_oldest = undo_slot (1);
+    undo_count--;
+}
+
+void spill_undo_history (void)
+{
+    if (active_fid == INVALID_FID || undo_count <= UNDO_KEEP)
+        return;
+
+    finish_background();
+
+    while (undo_count > UNDO_KEEP)
+        spill_undo();
+}
+
+// bring the newest record on the card back in front of the oldest in RAM
+static bool unspill_undo (void)
+{
+    if (undo_count + redo_count == UNDO_RECORDS)
+        redo_count--;
+
+    const uint8_t slot = undo_slot (UNDO_RECORDS - 1);
+    if (!m_sd_pread (undo_fid, (undo_spilled - 1) * sizeof (UndoRecord), sizeof (UndoRecord),
+                     (uint8_t*)&undo_ring[slot]))
+    {
+        return false;
+    }
+
+    undo_oldest = slot;
+    undo_count++;
+    undo_spilled--;
+    return true;
+}
+
+static bool is_blank (char c)
+{
+    return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+// whether a byte carries on the run rather than starting another word
+// before and after are the new byte and its neighbour in the run, in
+// document order, so a word and the blanks after it make up one run
+static bool joins_run (const UndoRecord *record, char before, char after)
+{
+    return (record->length < UNDO_RUN && !(is_blank (before) && !is_blank (after)));
+}
+
+static void record_edit (uint8_t kind, uint32_t offset, char c)
+{
+    redo_count = 0;  // a new edit replaces whatever could have been redone
+
+    if (undo_count > 0 && !undo_sealed)
+    {
+        UndoRecord *last = &undo_ring[undo_slot (undo_count - 1)];
+
+        if (last->kind == kind)
+        {
+            const uint32_t end = (kind == UNDO_INSERT) ? last->offset + last->length :
+                                 last->offset;
+
+            if (kind == UNDO_BACKSPACE && offset + 1 == last->offset &&
+                joins_run (last, c, last->text[0]))
+            {  // backing up through the text
+                memmove (&last->text[1], &last->text[0], last->length);
+                last->text[0] = c;
+                last->offset--;
+                last->length++;
+                return;
+            }
+            else if (kind != UNDO_BACKSPACE && offset == end &&
+                     joins_run (last, last->text[last->length - 1], c))
+            {  // typing on, or deleting forwards from the same spot
+                last->text[last->length++] = c;
+                return;
+            }
+        }
+    }
+
+    // normally spill_undo_history() has made room long before this
+    if (undo_count == UNDO_RECORDS)
+        spill_undo();
+
+    UndoRecord *record = &undo_ring[undo_slot (undo_count)];
+    record->offset = offset;
+    record->kind = kind;
+    record->length = 1;
+    record->text[0] = c;
+
+    undo_count++;
+    undo_sealed = false;
+}
+
+static bool apply_insert (const UndoRecord *record)
+{
+    for (uint8_t i = 0; i < record->length; i++)
+    {
+        if (!insert_at (record->offset + i, record->text[i]))
+            return false;
+        index_inserted (record->offset + i, record->text[i]);
+    }
+
+    return true;
+}
+
+static bool apply_delete (const UndoRecord *record)
+{
+    for (uint8_t i = 0; i < record->length; i++)
+    {
+        if (!delete_at (record->offset))
+            return false;
+        index_deleted (record->offset, record->text[i]);
+    }
+
+    return true;
+}
+
+// show the page the cursor belongs on, staying put if it's already in view
+static bool show_offset (uint32_t offset, int *pos)
+{
+    uint32_t start = currentPage->file_offset;
+    if (offset < start || offset >= start + PAGE_BYTES)
+        start = offset;
+
+    if (!show_page_at (start))
+        return false;
+
+    *pos = offset - start;
+    return true;
+}
+
+bool can_undo (void)
+{
+    return (undo_count > 0 || undo_spilled > 0);
+}
+
+bool can_redo (void)
+{
+    return (redo_count > 0);
+}
+
+bool undo_edit (int *pos)
+{
+    if (!can_undo())
+        return false;
+
+    finish_background();
+
+    if (undo_count == 0 && !unspill_undo())
+        return false;
+
+    const UndoRecord *record = &undo_ring[undo_slot (undo_count - 1)];
+
+    bool applied;
+    uint32_t cursor = record->offset;
+    if (record->kind == UNDO_INSERT)
+        applied = apply_delete (record);
+    else
+    {
+        applied = apply_insert (record);
+        if (record->kind == UNDO_BACKSPACE)
+            cursor += record->length;
+    }
+
+    if (!applied)
+        return false;
+
+    undo_count--;
+    redo_count++;
+    undo_sealed = true;
+
+    return show_offset (cursor, pos);
+}
+
+bool redo_edit (int *pos)
+{
+    if (!can_redo())
+        return false;
+
+    finish_background();
+
+    const UndoRecord *record = &undo_ring[undo_slot (undo_count)];
+
+    bool applied;
+    uint32_t cursor = record->offset;
+    if (record->kind == UNDO_INSERT)
+    {
+        applied = apply_insert (record);
+        cursor += record->length;
+    }
+    else
+        applied = apply_delete (record);
+
+    if (!applied)
+        return false;
+
+    undo_count++;
+    redo_count--;
+    undo_sealed = true;
+
+    return show_offset (cursor, pos);
+}
+
+/*
+Saving streams the edited document, in one sequential pass, into a temporary
+file next to the original and then copies it back over the original.  Both
+passes use the largest transfers the mMicroSD protocol allows, and nothing
+in the original is touched until the complete new text is safely on the card.
+
+mMicroSD has no rename, so the copy back is the "swap".  When the document
+grew or stayed the same size, only the part from the first edit onward is
+written out and copied back in place.  When it shrank, the file has to be
+recreated to drop its old tail, so the whole document goes through the temp
+file.
+
+The temp file doubles as a write-ahead journal.  Once the new text is on the
+card, a commit record saying where it goes is appended after it, and only
+then is the original touched.  If the copy back is cut short (the USB cable
+pulled, the power lost), recover_save() finds the committed temp file the
+next time the card is mounted or the file is opened and simply runs the
+copy again.  A temp file without a commit record is from a save that never
+got as far as the original, so it's deleted.
+
+A copy back that fails without a reset (an error on the bus, say) is run
+again straight away from the temp file, which is kept open for it, since
+the file is now part old and part new text that the pieces no longer
+describe.  If that fails too, the save is left pending: nothing is read,
+edited or saved until a later save_pages() gets the copy back through and
+the temp file deleted.  A temp file that still holds a committed save is
+never written over.
+*/
+
+#define SAVE_CHUNK M_SD_MAX_WRITE_LENGTH
+
+static char save_frame[M_SD_FRAME_HEADROOM + SAVE_CHUNK];
+static char *const save_buffer = &save_frame[M_SD_FRAME_HEADROOM];
+
+#define SAVE_COMMIT_MAGIC 0x314a4445  // "EDJ1"
+
+// appended to the temp file once the new text is all there
+typedef struct SaveCommit
+{
+    uint32_t magic;
+    char name[13];     // the file being saved
+    uint8_t recreate;  // whether the file is recreated rather than patched
+    uint32_t start;    // where the new text goes in the file
+    uint32_t length;   // how much new text comes before this record
+} SaveCommit;
+
+// the pending save's record, and whether it's known to be on the card
+static SaveCommit pending_commit;
+static bool pending_recorded;
+
+SaveStats last_save;
+
+// time the save with the core's cycle counter
+static uint32_t save_cycles_last;
+static uint64_t save_cycles;
+
+static void save_timer_start (void)
+{
+    save_cycles = 0;
+    save_cycles_last = mCycles();
+}
+
+// called at least once per chunk, so the 32-bit counter can't wrap unseen
+static void save_timer_tick (void)
+{
+    const uint32_t now = mCycles();
+    save_cycles += (uint32_t)(now - save_cycles_last);
+    save_cycles_last = now;
+}
+
+// write the document from offset onward into the temp file
+static bool stream_document (uint8_t temp_fid, uint32_t offset)
+{
+    while (offset < document_bytes)
+    {
+        uint32_t chunk = document_bytes - offset;
+        if (chunk > SAVE_CHUNK)
+            chunk = SAVE_CHUNK;
+
+        if (!read_document (offset, chunk, save_buffer))
+            return false;
+        if (!m_sd_write_framed (temp_fid, chunk, (uint8_t*)save_buffer, NULL))
+            return false;
+
+        offset += chunk;
+        last_save.bytes += chunk;
+        save_timer_tick();
+    }
+
+    return true;
+}
+
+// copy length bytes from the current position in one file to the other
+static bool copy_file (uint8_t from_fid, uint8_t to_fid, uint32_t length)
+{
+    while (length > 0)
+    {
+        const uint32_t chunk = (length > SAVE_CHUNK) ? SAVE_CHUNK : length;
+
+        if (!m_sd_read_framed (from_fid, chunk, (uint8_t*)save_buffer, NULL))
+            return false;
+        if (!m_sd_write_framed (to_fid, chunk, (uint8_t*)save_buffer, NULL))
+            return false;
+
+        length -= chunk;
+        last_save.bytes += chunk;
+        save_timer_tick();
+    }
+
+    return true;
+}
+
+// the temp file can't have the same name as the file being saved
+static const char *save_temp_name (void)
+{
+    return (strcmp (active_name, SAVE_TEMP_NAME) == 0) ? SAVE_TEMP_NAME_ALT :
+           SAVE_TEMP_NAME;
+}
+
+// copy the committed new text from the temp file into the file being saved
+static bool copy_back (uint8_t temp_fid, uint32_t start, bool shrinking)
+{
+    if (!m_sd_seek (temp_fid, 0))
+        return false;
+
+    if (shrinking)
+    {  // recreate the file to get rid of its old tail
+        if (active_fid != INVALID_FID && !m_sd_close_file (active_fid))
+            return false;
+        active_fid = INVALID_FID;
+
+        if (!m_sd_open_file (active_name, CREATE_FILE, &active_fid))
+        {
+            active_fid = INVALID_FID;
+            return false;
+        }
+    }
+    else if (!m_sd_seek (active_fid, start))
+        return false;
+
+    // the copy has to be on the card before the journal that could redo it
+    // goes, or the tail of it can be lost still buffered in m_microsd.c
+    return copy_file (temp_fid, active_fid, document_bytes - start) &&
+           m_sd_commit();
+}
+
+// get rid of the temp file of a save that failed before it was committed
+static void drop_temp_file (void)
+{
+    if (m_sd_close_file (save_temp_fid))
+    {
+        save_temp_fid = INVALID_FID;
+        m_sd_delete (save_temp_name());
+    }
+}
+
+// commit the pending save, copy it back from its temp file and get rid of
+// that, then start a fresh table over the result; whatever doesn't get done
+// is left for the next try
+static bool finish_copy_back (void)
+{
+    if (save_temp_fid != INVALID_FID)
+    {
+        // the new text has to be on the card before the record that vouches
+        // for it, and that before the original is touched
+        if (!pending_recorded)
+        {
+            if (!m_sd_seek (save_temp_fid, pending_commit.length) ||
+                !m_sd_write_file (save_temp_fid, sizeof (pending_commit),
+                                  (uint8_t*)&pending_commit) ||
+                !m_sd_commit())
+            {
                 return false;
-            
-            const uint32_t endOfWrite = tempWrite->file_offset + tempWrite->num_bytes;
-            newDiskSize = endOfWrite;
-            
-            // swap the read and write buffers
-            Page *swap = tempRead;
-            tempRead = tempWrite;
-            tempWrite = swap;
-            
-            // the next write will start at the end of the last write
-            tempWrite->file_offset = endOfWrite;
+            }
+            pending_recorded = true;
+        }
+
+        if (!copy_back (save_temp_fid, pending_commit.start, pending_commit.recreate) ||
+            !m_sd_close_file (save_temp_fid))
+        {
+            return false;
         }
+        save_temp_fid = INVALID_FID;
     }
-    
-    // update the cached file size
-    active_fid_disk_size = newDiskSize;
-    
-    prevPage->modified = false;
-    currentPage->modified = false;
-    
-    // clear the edit overflow page
-    editOverflowPage->num_bytes = 0;
-    editOverflowPage->modified = false;
+
+    // with the temp file copied and closed, only deleting it is left
+    if (!m_sd_delete (save_temp_name()))
+        return false;
+
+    recovery_pending = false;
+    active_fid_disk_size = document_bytes;
+    reset_pieces (document_bytes);
+    return true;
 }
 
+static bool untimed_save_pages (void)
+{
+    if (recovery_pending)
+        return finish_copy_back();
+
+    if (active_fid == INVALID_FID)
+        return false;
+
+    finish_background();
+
+    // find the first byte that differs from what's on the card
+    uint8_t i = 0;
+    uint32_t first_change = 0;
+    while (i < num_pieces && piece[i].source == ORIGINAL && piece[i].start == first_change)
+    {
+        first_change += piece[i].length;
+        i++;
+    }
+
+    const bool shrinking = (document_bytes < active_fid_disk_size);
+
+    if (!shrinking && first_change == document_bytes)
+    {  // nothing has changed, or the edits cancelled out
+        unsaved_bytes = 0;
+        memset (&last_save, 0, sizeof (last_save));
+        return true;
+    }
+
+    const uint32_t start = shrinking ? 0 : first_change;
+    const uint32_t round_trips = m_sd_round_trips;
+
+    last_save.bytes = 0;
+    save_timer_start();
+
+    const char *temp_name = save_temp_name();
+
+    if (save_temp_fid != INVALID_FID)
+    {  // left open by a save that failed
+        if (!m_sd_close_file (save_temp_fid))
+            return false;
+        save_temp_fid = INVALID_FID;
+    }
+
+    // a committed save still under that name is another file's that was cut
+    // short, and may be the only copy of it, so it's finished before the
+    // name is used again
+    if (!recover_save (temp_name, &active_fid))
+        return false;
+
+    if (!m_sd_open_file (temp_name, CREATE_FILE, &save_temp_fid))
+    {
+        save_temp_fid = INVALID_FID;
+        return false;
+    }
+
+    if (!stream_document (save_temp_fid, start))
+    {
+        drop_temp_file();
+        return false;
+    }
+
+    if (!m_sd_commit())
+    {
+        drop_temp_file();
+        return false;
+    }
+
+    // from here on the temp file is the only complete copy of the new text,
+    // and once its record is on its way the save may be committed whether
+    // or not the record is known to have got there, so if anything fails
+    // it's run again from there straight away, and after that by every
+    // save_pages() until it gets through
+    memset (&pending_commit, 0, sizeof (pending_commit));
+    pending_commit.magic = SAVE_COMMIT_MAGIC;
+    strcpy (pending_commit.name, active_name);
+    pending_commit.recreate = shrinking;
+    pending_commit.start = start;
+    pending_commit.length = document_bytes - start;
+
+    pending_recorded = false;
+    recovery_pending = true;
+
+    if (!finish_copy_back() && !finish_copy_back())
+        return false;
+
+    save_timer_tick();
+    last_save.ms = (uint32_t)(save_cycles / (SystemCoreClock / 1000));
+    last_save.round_trips = m_sd_round_trips - round_trips;
+    return true;
+}
+
+bool save_pages (void)
+{
+    const uint32_t start = PERF_START();
+    const bool saved = untimed_save_pages();
+    perf_record (PERF_SAVE_PAGES, start);
+    return saved;
+}
+
+/*
+Autosave keeps the amount of unsaved work bounded without putting a save in
+the path of a keystroke.  It only saves when the editor is idle and typing
+has paused: a long pause saves whatever has changed, and once more than
+AUTOSAVE_MAX_UNSAVED bytes are unsaved (or the piece table is getting close
+to forcing a save of its own in insert_at()) a short pause between keys is
+enough.  A save covers the document from the first edit onward, so however
+many edits have piled up, they go out in one sequential pass.
+
+A save that failed partway is never simply run again: while it's pending
+recovery, save_pages() only retries its copy back (see untimed_save_pages()),
+which autosave does after each long pause until it gets through.
+*/
+
+#ifndef AUTOSAVE_MAX_UNSAVED
+#define AUTOSAVE_MAX_UNSAVED 256
+#endif
+
+#define AUTOSAVE_IDLE_MS 2000  // a pause this long saves anything unsaved
+#define AUTOSAVE_GAP_MS  300   // a pause this long saves when over the limit
+
+static bool table_nearly_full (void)
+{
+    return (add_used > ADD_BYTES - ADD_BYTES / 4 ||
+            num_pieces > MAX_PIECES - MAX_PIECES / 4);
+}
+
+bool autosave_pages (void)
+{
+    if (!recovery_pending && (active_fid == INVALID_FID || unsaved_bytes == 0))
+        return true;
+
+    const uint32_t quiet = mMillis() - last_edit_ms;
+    const bool urgent = !recovery_pending &&
+                        (unsaved_bytes >= AUTOSAVE_MAX_UNSAVED || table_nearly_full());
+
+    if (quiet < AUTOSAVE_IDLE_MS && !(urgent && quiet >= AUTOSAVE_GAP_MS))
+        return true;
+
+    if (save_pages())
+        return true;
+
+    // don't retry until another pause has gone by
+    last_edit_ms = mMillis();
+    return false;
+}
+
+uint32_t unsaved_byte_count (void)
+{
+    return unsaved_bytes;
+}
+
+bool save_recovery_pending (void)
+{
+    return recovery_pending;
+}
+
+// finish or undo a save that was cut short, if temp_name is on the card
+// *file_id is the open file being edited, which a save of its own is copied
+// back through, or INVALID_FID; any other file is opened for its copy back
+static bool recover_save (const char *temp_name, uint8_t *file_id)
+{
+    uint8_t temp_fid;
+    if (!m_sd_open_file (temp_name, READ_FILE, &temp_fid))
+        return (m_sd_error_code == ERROR_FAT32_NOT_FOUND);
+
+    uint32_t size;
+    if (!m_sd_file_size (temp_fid, &size))
+    {
+        m_sd_close_file (temp_fid);
+        return false;
+    }
+
+    // a record that can't be read isn't the same as one that isn't there
+    SaveCommit commit;
+    if (size < sizeof (commit))
+        commit.magic = 0;
+    else if (!m_sd_pread (temp_fid, size - sizeof (commit), sizeof (commit), (uint8_t*)&commit))
+    {
+        m_sd_close_file (temp_fid);
+        return false;
+    }
+    commit.name[sizeof (commit.name) - 1] = '\0';
+
+    if (commit.magic != SAVE_COMMIT_MAGIC || commit.length != size - sizeof (commit))
+    {  // never committed, so the original was never touched
+        m_sd_close_file (temp_fid);
+        return m_sd_delete (temp_name);
+    }
+
+    const bool keep_open = (*file_id != INVALID_FID && strcmp (commit.name, active_name) == 0);
+    uint8_t target_fid = *file_id;
+
+    bool opened = true;
+    if (commit.recreate)
+    {
+        if (keep_open)
+            m_sd_close_file (target_fid);
+        opened = m_sd_open_file (commit.name, CREATE_FILE, &target_fid);
+    }
+    else if (!keep_open)
+        opened = m_sd_open_file (commit.name, APPEND_FILE, &target_fid);
+
+    if (!opened)
+    {
+        m_sd_close_file (temp_fid);
+        if (keep_open)
+            *file_id = INVALID_FID;
+        return false;
+    }
+
+    // copying it all again is fine, however far the last attempt got
+    const bool copied = m_sd_seek (target_fid, commit.start) &&
+                        m_sd_seek (temp_fid, 0) &&
+                        copy_file (temp_fid, target_fid, commit.length) &&
+                        m_sd_commit();
+
+    m_sd_close_file (temp_fid);
+    const bool finished = copied && m_sd_delete (temp_name);
+
+    if (keep_open)
+        *file_id = target_fid;
+    else
+        m_sd_close_file (target_fid);
+
+    return finished;
+}
+
+bool recover_saves (void)
+{
+    uint8_t no_file = INVALID_FID;
+    return (recover_save (SAVE_TEMP_NAME, &no_file) &&
+            recover_save (SAVE_TEMP_NAME_ALT, &no_file));
+}
@@ -4,38 +4,135 @@
 #define COLS_PER_LINE   80
 #define LINES_PER_PAGE  10
 #define PAGE_BYTES      (COLS_PER_LINE * LINES_PER_PAGE)
+#define INVALID_FID     0xff
 
 #include "main.h"
 
+// A Page is a window onto the document as it currently looks with all edits
+// applied.  The document itself lives in a piece table (see pageCache.c),
+// so a page is just a rendered copy that can be thrown away and refilled.
 typedef struct Page
 {
+    char headroom[M_SD_FRAME_HEADROOM];  // so reads can be framed in place
     char data[PAGE_BYTES];
     uint16_t num_bytes;
-    bool modified;
-    
-    uint32_t file_offset;
+
+    uint32_t file_offset;  // offset of data[0] in the edited document
 } Page;
 
 extern Page *prevPage;
 extern Page *currentPage;
-extern Page *editOverflowPage;
-//extern Page *nextPage;
+extern Page *nextPage;
+
+// name is needed because saving may have to recreate the file, which also
+// changes its file id (see active_file_id)
+bool init_pages (uint8_t file_id, const char *name);
 
-bool init_pages (uint8_t file_id);
+// the id of the file being edited, which is what should be closed afterwards;
+// INVALID_FID if a failed save left it closed
+uint8_t active_file_id (void);
 
 bool is_first_page (void);
 bool is_last_page  (void);
 
+// size of the document with all unsaved edits applied
+uint32_t document_size (void);
+
+// copy part of the document as it looks with all unsaved edits applied
+bool copy_document (uint32_t offset, uint32_t length, char *buffer);
+
 // pos is the position in the current page, not the overall file
 bool insert_char    (char c, int pos);
-void backspace_char (int pos);
-void delete_char    (int pos);
+bool backspace_char (int pos);
+bool delete_char    (int pos);
 
 bool page_down (void);
 bool page_up (void);
 
+// top up the pages either side of the current one in the background
+// call this whenever the editor is waiting for input; it returns quickly
+void prefetch_pages (void);
+
+// how often page_down/page_up found the page already in RAM
+typedef struct PrefetchStats
+{
+    uint32_t hits;
+    uint32_t misses;
+} PrefetchStats;
+
+extern PrefetchStats prefetch_stats;
+
+// build the line index a step at a time in the background
+// call this whenever the editor is waiting for input; it returns quickly
+void index_lines (void);
+
+// how much of the document the line index covers, in percent
+uint8_t line_index_progress (void);
+
+// lines are numbered from 0
+// until the index is complete, this only counts the lines it has seen
+uint32_t line_count (void);
+
+// which line position pos of the current page is on
+// false if the index hasn't reached the current page yet
+bool current_line (int pos, uint32_t *line);
+
+// make the page starting at the beginning of this line the current page
+bool goto_line (uint32_t line);
+
+// step back and forth through the edits made since the file was opened
+// on success *pos is where the cursor goes in the (new) current page
+bool can_undo (void);
+bool can_redo (void);
+bool undo_edit (int *pos);
+bool redo_edit (int *pos);
+
+// forget the undo history, and delete its journal file from the card
+void clear_undo_history (void);
+
+// write out the undo records that no longer fit in RAM (see pageCache.c)
+// call this whenever the editor is waiting for input
+void spill_undo_history (void);
+
 bool save_pages (void);
 
+// save if the editor has been idle long enough, see pageCache.c
+// call this whenever the editor is waiting for input
+// returns false if it tried to save and couldn't; a save pending recovery
+// is only ever retried as a recovery
+bool autosave_pages (void);
+
+// bytes inserted or deleted since the last save
+uint32_t unsaved_byte_count (void);
+
+// whether a save failed partway through putting the new text in the file,
+// in which case nothing can be read or edited until save_pages() succeeds
+bool save_recovery_pending (void);
+
+// let go of the file being edited, which the caller is about to close,
+// after saving it as far as it can be saved: nothing unsaved, pending or
+// undoable outlives its id, and a save still pending recovery is finished
+// from the card by name later (see pageCache.c)
+void release_pages (void);
+
+// drop the file being edited without saving it or closing anything, for
+// when the card has been remounted and the old file ids mean nothing
+void forget_pages (void);
+
+// finish any save in the current directory that was cut short (see
+// pageCache.c); init_pages() does the same for the file it opens
+bool recover_saves (void);
+
+// what the most recent save cost
+typedef struct SaveStats
+{
+    uint32_t bytes;        // file data written to the card
+    uint32_t round_trips;  // mMicroSD commands issued
+    uint32_t ms;           // time taken
+} SaveStats;
+
+extern SaveStats last_save;
+
 
 #endif
 
@@ -0,0 +1,103 @@
+#include "perf.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct perf_stats
+{
+    uint32_t count;
+    uint32_t min;     // all in cycles
+    uint32_t max;
+    uint64_t total;
+    uint32_t bucket[PERF_BUCKETS];
+} perf_stats;
+
+static perf_stats stats[PERF_PROBE_COUNT];
+
+static const char *const probe_name[PERF_PROBE_COUNT] =
+{
+    "send_order",
+    "receive_response",
+    "_write",
+    "print_current_page",
+    "fill_buffer",
+    "save_pages"
+};
+
+static const char *const bucket_name[PERF_BUCKETS] =
+{
+    "<4us", "<16us", "<64us", "<256us", "<1ms", "<4ms", "<16ms", "more"
+};
+
+#if PERF_ENABLED
+void perf_record (perf_probe probe, uint32_t start)
+{
+    const uint32_t cycles = mCycles() - start;
+    perf_stats *probe_stats = &stats[probe];
+    
+    if (probe_stats->count == 0 || cycles < probe_stats->min)
+        probe_stats->min = cycles;
+    if (cycles > probe_stats->max)
+        probe_stats->max = cycles;
+    
+    probe_stats->count++;
+    probe_stats->total += cycles;
+    
+    uint32_t limit = 4 * (SystemCoreClock / 1000000);
+    uint8_t bucket = 0;
+    while (bucket < PERF_BUCKETS - 1 && cycles >= limit)
+    {
+        limit *= 4;
+        bucket++;
+    }
+    probe_stats->bucket[bucket]++;
+}
+#endif
+
+void perf_reset (void)
+{
+    memset (stats, 0, sizeof (stats));
+}
+
+void perf_dump (void)
+{
+    // printing goes through _write(), which is probed itself, so the table
+    // is copied and cleared first
+    perf_stats snapshot[PERF_PROBE_COUNT];
+    memcpy (snapshot, stats, sizeof (stats));
+    perf_reset();
+    
+    #if !PERF_ENABLED
+    printf ("Probes were compiled out (PERF_ENABLED is 0)\r\n");
+    return;
+    #endif
+    
+    const uint32_t cycles_per_us = SystemCoreClock / 1000000;
+    
+    printf ("probe                  count     min us     avg us     max us\r\n");
+    
+    bool any = false;
+    for (uint8_t i = 0; i < PERF_PROBE_COUNT; i++)
+    {
+        const perf_stats *probe_stats = &snapshot[i];
+        if (probe_stats->count == 0)
+            continue;
+        any = true;
+        
+        printf ("%-18s %9lu %10lu %10lu %10lu\r\n    ", probe_name[i],
+                (unsigned long)probe_stats->count,
+                (unsigned long)(probe_stats->min / cycles_per_us),
+                (unsigned long)(probe_stats->total / probe_stats->count / cycles_per_us),
+                (unsigned long)(probe_stats->max / cycles_per_us));
+        
+        for (uint8_t bucket = 0; bucket < PERF_BUCKETS; bucket++)
+        {
+            if (probe_stats->bucket[bucket] > 0)
+                printf (" %s:%lu", bucket_name[bucket], (unsigned long)probe_stats->bucket[bucket]);
+        }
+        printf ("\r\n");
+    }
+    
+    if (!any)
+        printf ("(nothing recorded since the last perf)\r\n");
+}
@@ -0,0 +1,53 @@
+#ifndef PERF_H
+#define PERF_H
+
+#if defined(HOST)
+ #include "host/host.h"
+#else
+ #include "mGeneral.h"
+#endif
+
+// Probes time a stretch of code with the core's DWT cycle counter.  Each one
+// keeps a count, the min, max and total time, and a histogram in a static
+// table, which the "perf" command prints and clears.  A probe costs a couple
+// of register reads and a few adds; define PERF_ENABLED as 0 in the makefile
+// to compile them all away.
+//
+//     const uint32_t start = PERF_START();
+//     ...
+//     perf_record (PERF_FILL_BUFFER, start);
+
+#ifndef PERF_ENABLED
+#define PERF_ENABLED 1
+#endif
+
+typedef enum perf_probe
+{
+    PERF_SEND_ORDER = 0,    // m_microsd.c: an order going out over I2C
+    PERF_RECEIVE_RESPONSE,  // m_microsd.c: waiting for and reading the reply
+    PERF_USB_WRITE,         // mUSB.c: _write(), queueing console output
+    PERF_PRINT_PAGE,        // edit.c: print_current_page()
+    PERF_FILL_BUFFER,       // pageCache.c: reading a page out of the document
+    PERF_SAVE_PAGES,        // pageCache.c: save_pages()
+    
+    PERF_PROBE_COUNT
+} perf_probe;
+
+// histogram buckets go up by 4x: under 4 us, under 16 us, ... under 16 ms,
+// and anything longer
+#define PERF_BUCKETS 8
+
+#if PERF_ENABLED
+ #define PERF_START() mCycles()
+ void perf_record (perf_probe probe, uint32_t start);
+#else
+ #define PERF_START() 0
+ #define perf_record(probe, start) ((void)(start))
+#endif
+
+// print the table over the console and start it over
+void perf_dump (void);
+
+void perf_reset (void);
+
+#endif
@@ -5,7 +5,7 @@ void printFile (const char *fileName)
     uint32_t size;
     uint8_t fid;
     
-    if (!m_sd_get_size (fileName, &size) || !m_sd_open_file (fileName, READ_FILE, &fid))
+    if (!m_sd_open_file (fileName, READ_FILE, &fid) || !m_sd_file_size (fid, &size))
     {
         printf ("error opening ");
         for (const char *c = fileName; *c != '\0'; c++)
@@ -16,8 +16,9 @@ void printFile (const char *fileName)
     {
         while (size > 0)
         {
-            uint8_t buffer[64];
-            uint8_t length_to_read = (size > 64) ? 64 : size;
+            // one full-size frame at a time
+            static uint8_t buffer[M_SD_MAX_READ_LENGTH];
+            uint8_t length_to_read = (size > M_SD_MAX_READ_LENGTH) ? M_SD_MAX_READ_LENGTH : size;
             
             if (!m_sd_read_file (fid, length_to_read, buffer))
             {
@@ -25,6 +26,7 @@ void printFile (const char *fileName)
                 for (const char *c = fileName; *c != '\0'; c++)
                     putchar (*c);
                 printf (">\r\n");
+                break;
             }
             else
             {
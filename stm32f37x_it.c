@@ -29,6 +29,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f37x_it.h"
+#include "mGeneral.h"
 
 
 /* Private typedef -----------------------------------------------------------*/
@@ -152,9 +153,11 @@ void PendSV_Handler(void)
 * Output         : None
 * Return         : None
 *******************************************************************************/
-//void SysTick_Handler(void)
-//{
-//}
+void SysTick_Handler(void)
+{
+  mTickCount++;
+  CPAL_I2C_TIMEOUT_Manager();
+}
 
 /*******************************************************************************
 * Function Name  : USB_IRQHandler
@@ -49,7 +49,7 @@ void UsageFault_Handler(void);
 void SVC_Handler(void);
 void DebugMon_Handler(void);
 void PendSV_Handler(void);
-//void SysTick_Handler(void);
+void SysTick_Handler(void);
 //void USB_HP_IRQHandler(void);
 
 #ifdef __cplusplus
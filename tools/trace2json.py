@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+Convert a "trace dump" from the console into Chrome trace JSON.
+
+Capture the dump with anything that saves the raw bytes off the serial port,
+eg.
+
+    stty -F /dev/ttyACM0 raw
+    cat /dev/ttyACM0 > dump.bin &
+    (type "trace dump" in the console, then stop cat)
+
+    tools/trace2json.py dump.bin > trace.json
+
+and open trace.json in chrome://tracing or https://ui.perfetto.dev.  Anything
+before the dump's header in the capture (the echoed command, say) is skipped.
+
+The record layout and event numbers are defined in trace.h.
+"""
+
+import json
+import struct
+import sys
+
+MAGIC = b"TRC1"
+HEADER = struct.Struct("<4sII")
+RECORD = struct.Struct("<IHH")
+
+# event number -> (name, timeline row)
+EVENTS = {
+    1: ("order", "mMicroSD"),
+    2: ("response", "mMicroSD"),
+    3: ("i2c done", "I2C irq"),
+    4: ("i2c error", "I2C irq"),
+    5: ("usb in", "USB irq"),
+    6: ("usb out", "USB irq"),
+    7: ("key", "editor"),
+    8: ("redraw start", "editor"),
+    9: ("redraw end", "editor"),
+}
+
+ROWS = ["editor", "mMicroSD", "I2C irq", "USB irq"]
+
+TRACE_ORDER, TRACE_RESPONSE = 1, 2
+TRACE_KEY, TRACE_REDRAW_START, TRACE_REDRAW_END = 7, 8, 9
+
+
+def parse(data):
+    start = data.find(MAGIC)
+    if start < 0:
+        sys.exit("no trace header found")
+    _, clock_hz, count = HEADER.unpack_from(data, start)
+    offset = start + HEADER.size
+    if len(data) < offset + count * RECORD.size:
+        sys.exit("dump is cut short: header says %d records" % count)
+
+    records = []
+    last = None
+    high = 0
+    for i in range(count):
+        cycles, event, arg = RECORD.unpack_from(data, offset + i * RECORD.size)
+        # the counter is 32 bits, so it wraps every minute or so at 72 MHz;
+        # the records are in order, so going backwards means it wrapped
+        if last is not None and cycles < last:
+            high += 1 << 32
+        last = cycles
+        records.append((high + cycles, event, arg))
+    return clock_hz, records
+
+
+def arg_fields(event, arg):
+    if event == TRACE_ORDER:
+        return {"command": arg >> 8, "length": arg & 0xff}
+    if event == TRACE_RESPONSE:
+        return {"code": arg >> 8, "length": arg & 0xff}
+    if event == TRACE_KEY:
+        return {"key": arg, "char": chr(arg) if 32 <= arg < 127 else ""}
+    return {"arg": arg}
+
+
+def convert(clock_hz, records):
+    if not records:
+        return {"traceEvents": []}
+
+    origin = records[0][0]
+    cycles_per_us = clock_hz / 1e6
+
+    def us(cycles):
+        return (cycles - origin) / cycles_per_us
+
+    out = []
+    for tid, row in enumerate(ROWS):
+        out.append({"ph": "M", "name": "thread_name", "pid": 1, "tid": tid,
+                    "args": {"name": row}})
+
+    order = None   # the order waiting for its response
+    redraw = None  # the redraw that hasn't ended yet
+    for cycles, event, arg in records:
+        name, row = EVENTS.get(event, ("event %d" % event, "editor"))
+        tid = ROWS.index(row)
+
+        # orders and redraws become spans, everything else is an instant
+        if event == TRACE_ORDER:
+            order = (cycles, arg)
+            continue
+        elif event == TRACE_RESPONSE and order is not None:
+            out.append({"ph": "X", "name": "command %d" % (order[1] >> 8),
+                        "pid": 1, "tid": tid, "ts": us(order[0]),
+                        "dur": us(cycles) - us(order[0]),
+                        "args": {"order": arg_fields(TRACE_ORDER, order[1]),
+                                 "response": arg_fields(event, arg)}})
+            order = None
+            continue
+        elif event == TRACE_REDRAW_START:
+            redraw = cycles
+            continue
+        elif event == TRACE_REDRAW_END and redraw is not None:
+            out.append({"ph": "X", "name": "redraw", "pid": 1, "tid": tid,
+                        "ts": us(redraw), "dur": us(cycles) - us(redraw)})
+            redraw = None
+            continue
+
+        out.append({"ph": "i", "s": "t", "name": name, "pid": 1, "tid": tid,
+                    "ts": us(cycles), "args": arg_fields(event, arg)})
+
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s DUMP > trace.json" % sys.argv[0])
+    with open(sys.argv[1], "rb") as f:
+        clock_hz, records = parse(f.read())
+    json.dump(convert(clock_hz, records), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,59 @@
+#include "trace.h"
+#if !defined(HOST)
+ #include "mUSB.h"
+#endif
+#include <stdio.h>
+
+static trace_record ring[TRACE_RECORDS];
+static uint32_t next_record = 0;  // counts up forever, wrapped on use
+static volatile uint8_t paused = 0;
+
+#if TRACE_ENABLED
+void trace (trace_event event, uint16_t arg)
+{
+    if (paused)
+        return;
+    
+    // interrupts log events too, so the slot has to be claimed atomically
+    const uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    
+    trace_record *record = &ring[next_record & (TRACE_RECORDS - 1)];
+    next_record++;
+    record->cycles = mCycles();
+    record->event = event;
+    record->arg = arg;
+    
+    __set_PRIMASK (primask);
+}
+#endif
+
+uint32_t trace_count (void)
+{
+    return (next_record < TRACE_RECORDS) ? next_record : TRACE_RECORDS;
+}
+
+void trace_clear (void)
+{
+    next_record = 0;
+}
+
+void trace_dump (void)
+{
+    // sending the dump would log USB events over the top of it
+    paused = 1;
+    
+    const uint32_t count = trace_count();
+    const uint32_t header[3] = { TRACE_MAGIC, SystemCoreClock, count };
+    fwrite (header, sizeof (header), 1, stdout);
+    
+    // oldest first: once the ring has wrapped, that's the slot about to be reused
+    uint32_t first = next_record - count;
+    for (uint32_t i = 0; i < count; i++)
+        fwrite (&ring[(first + i) & (TRACE_RECORDS - 1)], sizeof (trace_record), 1, stdout);
+    
+    mUSBFlush();
+    
+    trace_clear();
+    paused = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#if defined(HOST)
+ #include "host/host.h"
+#else
+ #include "mGeneral.h"
+#endif
+
+// The trace is a ring of the most recent events, each stamped with the DWT
+// cycle counter, for seeing how USB traffic, I2C transfers and redraws
+// interleave.  Logging one is a few instructions with interrupts masked, so
+// it's safe from interrupt handlers and cheap enough to leave on; define
+// TRACE_ENABLED as 0 in the makefile to compile it out.
+//
+// "trace dump" sends the ring over the console as raw binary, and
+// tools/trace2json.py turns that into Chrome trace JSON (chrome://tracing
+// or ui.perfetto.dev).
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// must be a power of 2
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 512
+#endif
+
+// the numbers are part of the dump format, so only ever add to the end
+typedef enum trace_event
+{
+    TRACE_ORDER = 1,     // order sent to the mMicroSD, arg is command << 8 | data length
+    TRACE_RESPONSE,      // response read back, arg is response code << 8 | data length
+    TRACE_I2C_DONE,      // CPAL transfer complete interrupt, arg is 0 for a write, 1 for a read
+    TRACE_I2C_ERROR,     // CPAL error interrupt, arg is the device error
+    TRACE_USB_IN,        // EP1 packet taken by the host, arg is bytes still waiting to go
+    TRACE_USB_OUT,       // EP3 packet received, arg is its length
+    TRACE_KEY,           // editor read a key, arg is its code
+    TRACE_REDRAW_START,  // editor started printing the page
+    TRACE_REDRAW_END
+} trace_event;
+
+// dump format, all little-endian:
+//   header: "TRC1", core clock in Hz, record count (uint32 each)
+//   then the records, oldest first
+#define TRACE_MAGIC 0x31435254  // "TRC1"
+
+typedef struct trace_record
+{
+    uint32_t cycles;
+    uint16_t event;
+    uint16_t arg;
+} trace_record;
+
+#if TRACE_ENABLED
+ void trace (trace_event event, uint16_t arg);
+#else
+ #define trace(event, arg) ((void)0)
+#endif
+
+// send the ring over the console, then empty it
+// nothing is logged while the dump is going out
+void trace_dump (void);
+
+void trace_clear (void);
+
+// how many events the ring holds right now
+uint32_t trace_count (void);
+
+#endif
@@ -20,7 +20,7 @@ void writeToFile (const char *fileName,
         printf ("\r\n");
         return;
     }
-    else if (!m_sd_write_file (fid, dataLength, data))
+    else if (!m_sd_write_stream (fid, dataLength, data, NULL))
     {
         printf ("error writing to ");
         for (const char *c = fileName; *c != '\0'; c++)